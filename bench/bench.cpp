@@ -0,0 +1,279 @@
+/**
+ * bench: the numbers to track over time, run from the repository root.
+ *
+ *   bench [--json <out.json>] [--spp <n>] [--width <w>] [--only <name>]
+ *
+ * Microbenchmarks of the hot pieces in ns per call, then every scene
+ * main() has an index for, rendered with seed 1 at a fixed width and
+ * spp, in Mrays/s of traced rays (camera and bounces). Memory is the
+ * resident set after each scene is built, and the peak of the run.
+ * --only runs the benchmarks whose name contains the given text.
+ */
+#ifndef SLOWPT_STATS
+#define SLOWPT_STATS
+#endif
+#include "bvh.h"
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "aarectangle.h"
+#include "integrator.h"
+#include "material.h"
+#include "noise.h"
+#include "sceneparser.h"
+#include "sphere.h"
+#include "stats.h"
+#include "texture.h"
+
+struct micro_result {
+  std::string name;
+  double ns_per_op;
+};
+struct scene_result {
+  std::string name;
+  int w, h, spp;
+  double seconds, mrays;
+  uint64_t rays;
+  double rss_mb;
+};
+
+double now_ms() {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+// resident now, from /proc
+double rss_mb() {
+  long pages = 0, resident = 0;
+  FILE *fp = fopen("/proc/self/statm", "r");
+  if (fp) {
+    if (fscanf(fp, "%ld %ld", &pages, &resident) != 2) resident = 0;
+    fclose(fp);
+  }
+  return resident * double(sysconf(_SC_PAGESIZE)) / (1024 * 1024);
+}
+double peak_rss_mb() {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_maxrss / 1024.0;  // KB on linux
+}
+/**
+ * ns per call of op(i) for i in [0, n), the sink keeps
+ * the results from being optimized away
+ */
+template <typename Op>
+double ns_per_op(size_t n, Op op) {
+  double sink = 0;
+  auto start = now_ms();
+  for (size_t i = 0; i < n; i++) sink += op(i);
+  auto ms = now_ms() - start;
+  if (sink == 1.2345) std::cerr << "";
+  return ms * 1e6 / n;
+}
+std::vector<ray> random_rays(size_t n, double extent) {
+  std::vector<ray> rays;
+  for (size_t i = 0; i < n; i++) {
+    point3d from = vec3d::random(-extent, extent);
+    point3d to = vec3d::random(-1, 1);
+    rays.emplace_back(from, to - from, random_double());
+  }
+  return rays;
+}
+
+void run_micro(std::vector<micro_result> &out, char const *only) {
+  auto want = [&](char const *name) { return !only || strstr(name, only); };
+  // calls per benchmark, over rays few enough to stay in cache
+  size_t const N = 1 << 22, RAYS = 1 << 14;
+  srand(1);
+  auto rays = random_rays(RAYS, 4);
+  auto mat = make_shared<lambertian>(color_rgb{0.5, 0.5, 0.5});
+  hit_record rec;
+
+  if (want("aabb_hit")) {
+    std::vector<aabb> boxes;
+    for (int i = 0; i < 64; i++) {
+      point3d lo = vec3d::random(-1, 0);
+      boxes.emplace_back(lo, lo + vec3d::random(0.1, 1));
+    }
+    out.push_back({"aabb_hit", ns_per_op(N, [&](size_t i) {
+                     return boxes[i & 63].hit(rays[i % RAYS], 0.001, INF_DBL);
+                   })});
+  }
+  if (want("sphere_hit")) {
+    std::vector<shared_ptr<sphere>> spheres;
+    for (int i = 0; i < 64; i++)
+      spheres.push_back(make_shared<sphere>(vec3d::random(-1, 1), 0.3, mat));
+    out.push_back({"sphere_hit", ns_per_op(N, [&](size_t i) {
+                     return spheres[i & 63]->hit(rays[i % RAYS], 0.001,
+                                                 INF_DBL, rec);
+                   })});
+  }
+  if (want("rectangle_hit")) {
+    std::vector<shared_ptr<xy_rectangle>> rects;
+    for (int i = 0; i < 64; i++) {
+      auto x = random_double(-1, 0.5), y = random_double(-1, 0.5);
+      rects.push_back(make_shared<xy_rectangle>(
+          x, x + 0.5, y, y + 0.5, random_double(-1, 1), mat));
+    }
+    out.push_back({"rectangle_hit", ns_per_op(N, [&](size_t i) {
+                     return rects[i & 63]->hit(rays[i % RAYS], 0.001, INF_DBL,
+                                               rec);
+                   })});
+  }
+  if (want("bvh_build")) {
+    // per primitive, 64k spheres
+    std::vector<shared_ptr<base_object>> objects;
+    for (int i = 0; i < 1 << 16; i++)
+      objects.push_back(make_shared<sphere>(vec3d::random(-50, 50), 0.2, mat));
+    auto start = now_ms();
+    bvh_node tree{objects, 0, objects.size(), 0.0, 1.0};
+    out.push_back({"bvh_build", (now_ms() - start) * 1e6 / objects.size()});
+    out.push_back({"bvh_hit", ns_per_op(N / 256, [&](size_t i) {
+                     return tree.hit(rays[i % RAYS], 0.001, INF_DBL, rec);
+                   })});
+  }
+  if (want("noise_turb")) {
+    perlin_noise noise;
+    std::vector<point3d> points(RAYS);
+    for (auto &p : points) p = vec3d::random(-10, 10);
+    out.push_back({"noise_turb", ns_per_op(N / 4, [&](size_t i) {
+                     return noise.turb(points[i % RAYS]);
+                   })});
+  }
+  if (want("texture_lookup")) {
+    // bilinear, then trilinear over a footprint of a few texels
+    char const *path = "src/appearance/earthmap.jpg";
+    if (access(path, R_OK) != 0) {
+      std::cerr << "bench: no " << path << ", run from the repository root\n";
+    } else {
+      image_texture tex{path};
+      tex_footprint fp{};
+      fp.dudx = fp.dvdy = 4.0 / 1024;
+      std::vector<double> us(RAYS), vs(RAYS);
+      for (size_t i = 0; i < RAYS; i++) {
+        us[i] = random_double();
+        vs[i] = random_double();
+      }
+      out.push_back({"texture_lookup", ns_per_op(N, [&](size_t i) {
+                       return tex.value(us[i % RAYS], vs[i % RAYS],
+                                        point3d{})[0];
+                     })});
+      out.push_back({"texture_lookup_filtered", ns_per_op(N, [&](size_t i) {
+                       return tex.filtered_value(us[i % RAYS], vs[i % RAYS],
+                                                 point3d{}, fp)[0];
+                     })});
+    }
+  }
+}
+
+bool run_scene(std::string const &name, int width, int spp,
+               scene_result &res) {
+  std::string path = "scenes/" + name + ".scene";
+  srand(1);
+  scene sc;
+  if (!scene_parser::load(path.c_str(), sc)) return false;
+  sc.image_w = width;
+  sc.spp = spp;
+  auto st = prepare_still(sc);
+  int w = width, h = st.image_h;
+
+  auto &stats = render_stats::instance();
+  stats.reset();
+  auto start = now_ms();
+  for (int i = h - 1; i >= 0; i--)
+    for (int j = 0; j < w; j++)
+      for (int s = 0; s < spp; s++) {
+        auto u = (j + random_double()) / (w - 1);
+        auto v = (i + random_double()) / (h - 1);
+        ray r = st.cam->ray_at(u, v, st.ds, st.dt);
+        ray_color(r, sc.background, st.env.get(), *st.world, st.lights,
+                  sc.max_bounce);
+      }
+  res.seconds = (now_ms() - start) / 1000;
+  res.name = name;
+  res.w = w;
+  res.h = h;
+  res.spp = spp;
+  res.rays = stats.total(STAT_TRACED_RAYS);
+  res.mrays = res.rays / res.seconds / 1e6;
+  res.rss_mb = rss_mb();
+  return true;
+}
+
+bool write_json(char const *path, std::vector<micro_result> const &micro,
+                std::vector<scene_result> const &scenes) {
+  FILE *fp = fopen(path, "w");
+  if (!fp) {
+    std::cerr << "ERROR: Could not write '" << path << "'.\n";
+    return false;
+  }
+  fprintf(fp, "{\n  \"micro\": [");
+  for (size_t i = 0; i < micro.size(); i++)
+    fprintf(fp, "%s\n    {\"name\": \"%s\", \"ns_per_op\": %.3f}",
+            i ? "," : "", micro[i].name.c_str(), micro[i].ns_per_op);
+  fprintf(fp, "\n  ],\n  \"scenes\": [");
+  for (size_t i = 0; i < scenes.size(); i++) {
+    auto const &s = scenes[i];
+    fprintf(fp,
+            "%s\n    {\"name\": \"%s\", \"width\": %d, \"height\": %d, "
+            "\"spp\": %d, \"seconds\": %.4f, \"rays\": %llu, "
+            "\"mrays_per_s\": %.4f, \"rss_mb\": %.1f}",
+            i ? "," : "", s.name.c_str(), s.w, s.h, s.spp, s.seconds,
+            static_cast<unsigned long long>(s.rays), s.mrays, s.rss_mb);
+  }
+  fprintf(fp, "\n  ],\n  \"peak_rss_mb\": %.1f\n}\n", peak_rss_mb());
+  if (fclose(fp) != 0) {
+    std::cerr << "ERROR: Could not write '" << path << "'.\n";
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  char const *json_path = nullptr, *only = nullptr;
+  int spp = 16, width = 160;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--json") == 0 && i + 1 < argc)
+      json_path = argv[++i];
+    else if (strcmp(argv[i], "--spp") == 0 && i + 1 < argc)
+      spp = std::max(1, atoi(argv[++i]));
+    else if (strcmp(argv[i], "--width") == 0 && i + 1 < argc)
+      width = std::max(2, atoi(argv[++i]));
+    else if (strcmp(argv[i], "--only") == 0 && i + 1 < argc)
+      only = argv[++i];
+    else {
+      std::cerr << "usage: bench [--json <out.json>] [--spp <n>] "
+                   "[--width <w>] [--only <name>]\n";
+      return 1;
+    }
+  }
+
+  std::vector<micro_result> micro;
+  run_micro(micro, only);
+  for (auto const &m : micro)
+    printf("%-24s %10.2f ns/op\n", m.name.c_str(), m.ns_per_op);
+
+  std::vector<scene_result> scenes;
+  for (auto const &name : scene_names()) {
+    if (only && !strstr(name.c_str(), only)) continue;
+    scene_result res;
+    if (!run_scene(name, width, spp, res)) return 1;
+    scenes.push_back(res);
+    printf("%-24s %4dx%-4d %3d spp %8.3f s %8.3f Mrays/s %8.1f MB\n",
+           res.name.c_str(), res.w, res.h, res.spp, res.seconds, res.mrays,
+           res.rss_mb);
+    fflush(stdout);
+  }
+  printf("peak resident %.1f MB\n", peak_rss_mb());
+  if (json_path && !write_json(json_path, micro, scenes)) return 1;
+  return 0;
+}
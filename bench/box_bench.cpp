@@ -0,0 +1,100 @@
+/**
+ * box_bench: the slab box against the six rectangle object_list
+ * it replaced. Random boxes, rays from outside and inside, checks
+ * both agree then times each over the same rays.
+ */
+#include "bvh.h"
+
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+#include "aarectangle.h"
+#include "box.h"
+#include "material.h"
+#include "objectlist.h"
+
+// the box as it used to be built
+shared_ptr<object_list> rect_box(point3d const& p0, point3d const& p1,
+                                 shared_ptr<base_material> mat) {
+  auto faces = make_shared<object_list>();
+  faces->add(make_shared<xy_rectangle>(p0.x(), p1.x(), p0.y(), p1.y(), p0.z(),
+                                       mat, vec3d{0, 0, -1}));
+  faces->add(make_shared<xy_rectangle>(p0.x(), p1.x(), p0.y(), p1.y(), p1.z(),
+                                       mat, vec3d{0, 0, 1}));
+  faces->add(make_shared<xz_rectangle>(p0.x(), p1.x(), p0.z(), p1.z(), p0.y(),
+                                       mat, vec3d{0, -1, 0}));
+  faces->add(make_shared<xz_rectangle>(p0.x(), p1.x(), p0.z(), p1.z(), p1.y(),
+                                       mat, vec3d{0, 1, 0}));
+  faces->add(make_shared<yz_rectangle>(p0.y(), p1.y(), p0.z(), p1.z(), p0.x(),
+                                       mat, vec3d{-1, 0, 0}));
+  faces->add(make_shared<yz_rectangle>(p0.y(), p1.y(), p0.z(), p1.z(), p1.x(),
+                                       mat, vec3d{1, 0, 0}));
+  return faces;
+}
+
+bool same(vec3d const& a, vec3d const& b) {
+  return (a - b).norm2() < 1e-18;
+}
+
+template <typename Obj>
+double time_hits(std::vector<shared_ptr<Obj>> const& objs,
+                 std::vector<ray> const& rays, int& n_hits) {
+  auto start = std::chrono::steady_clock::now();
+  hit_record rec;
+  n_hits = 0;
+  for (size_t i = 0; i < rays.size(); i++)
+    n_hits += objs[i % objs.size()]->hit(rays[i], 0.001, INF_DBL, rec);
+  return std::chrono::duration<double, std::nano>(
+             std::chrono::steady_clock::now() - start)
+             .count() /
+         rays.size();
+}
+
+int main() {
+  int const N_BOXES = 64, N_RAYS = 1 << 22;
+  auto mat = make_shared<lambertian>(color_rgb{0.5, 0.5, 0.5});
+  std::vector<shared_ptr<box>> slabs;
+  std::vector<shared_ptr<object_list>> rects;
+  for (int i = 0; i < N_BOXES; i++) {
+    point3d p0{random_double(-2, 0), random_double(-2, 0), random_double(-2, 0)};
+    point3d p1{random_double(0, 2), random_double(0, 2), random_double(0, 2)};
+    slabs.push_back(make_shared<box>(p0, p1, mat));
+    rects.push_back(rect_box(p0, p1, mat));
+  }
+  // a quarter of the rays start inside, the rest aim around the box
+  std::vector<ray> rays;
+  rays.reserve(N_RAYS);
+  for (int i = 0; i < N_RAYS; i++) {
+    point3d o = i % 4 ? unit_vector(vec3d::random(-1, 1)) * 5
+                      : vec3d::random(-0.5, 0.5);
+    auto target = vec3d::random(-2.5, 2.5);
+    rays.emplace_back(o, target - o);
+  }
+
+  int mismatches = 0;
+  for (int i = 0; i < N_RAYS; i += 16) {
+    hit_record a, b;
+    bool ha = slabs[i % N_BOXES]->hit(rays[i], 0.001, INF_DBL, a);
+    bool hb = rects[i % N_BOXES]->hit(rays[i], 0.001, INF_DBL, b);
+    if (ha != hb) {
+      mismatches++;
+    } else if (ha && (fabs(a.t - b.t) > 1e-9 || fabs(a.u - b.u) > 1e-9 ||
+                      fabs(a.v - b.v) > 1e-9 || !same(a.normal, b.normal) ||
+                      a.front_face != b.front_face || !same(a.dpdu, b.dpdu) ||
+                      !same(a.dpdv, b.dpdv))) {
+      mismatches++;
+    }
+  }
+
+  int slab_hits, rect_hits;
+  auto rect_ns = time_hits(rects, rays, rect_hits);
+  auto slab_ns = time_hits(slabs, rays, slab_hits);
+  std::cout << "rays " << N_RAYS << ", hits " << slab_hits << " / "
+            << rect_hits << ", mismatches " << mismatches << " of "
+            << N_RAYS / 16 << "\n"
+            << "six rectangles " << rect_ns << " ns/ray\n"
+            << "slab           " << slab_ns << " ns/ray ("
+            << rect_ns / slab_ns << "x)\n";
+  return 0;
+}
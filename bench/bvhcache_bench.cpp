@@ -0,0 +1,78 @@
+/**
+ * bvhcache_bench: time to a usable tree for a large still scene,
+ * bvh_node built from scratch against flat_bvh cold (built and written)
+ * and warm (mapped from the file the cold run wrote).
+ * The trees must agree on every hit, and the flat one is traced too.
+ */
+#include "bvh.h"
+
+#include <unistd.h>
+
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+#include "flatbvh.h"
+#include "material.h"
+#include "sphere.h"
+
+template <typename F>
+double time_ms(F f) {
+  auto start = std::chrono::steady_clock::now();
+  f();
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+int main(int argc, char* argv[]) {
+  int n = argc > 1 ? atoi(argv[1]) : 1 << 20;
+  char dir[] = "/tmp/bvhcacheXXXXXX";
+  if (!mkdtemp(dir)) return 1;
+  srand(7);
+  object_list world;
+  auto mat = make_shared<lambertian>(color_rgb{0.5, 0.5, 0.5});
+  for (int i = 0; i < n; i++)
+    world.add(make_shared<sphere>(vec3d::random(-100, 100), 0.2, mat));
+
+  bvh_node tree;
+  auto build_ms = time_ms([&]() { tree = bvh_node{world, 0.0, 1.0}; });
+  shared_ptr<flat_bvh> cold, warm;
+  auto cold_ms = time_ms(
+      [&]() { cold = make_shared<flat_bvh>(world.objects_, 0.0, 1.0, dir); });
+  auto warm_ms = time_ms(
+      [&]() { warm = make_shared<flat_bvh>(world.objects_, 0.0, 1.0, dir); });
+
+  std::vector<ray> rays;
+  point3d eye{0, 0, -300};
+  for (int i = 0; i < 1 << 18; i++)
+    rays.emplace_back(eye, vec3d::random(-100, 100) - eye, 0.0);
+  int mismatches = 0, n_hits = 0;
+  for (auto const& r : rays) {
+    hit_record a, b;
+    bool hit_a = tree.hit(r, 0.001, INF_DBL, a);
+    bool hit_b = warm->hit(r, 0.001, INF_DBL, b);
+    n_hits += hit_a;
+    if (hit_a != hit_b || (hit_a && a.t != b.t)) mismatches++;
+  }
+  auto trace_ns = [&](base_object const& accel) {
+    hit_record rec;
+    return time_ms([&]() {
+             for (auto const& r : rays) accel.hit(r, 0.001, INF_DBL, rec);
+           }) *
+           1e6 / rays.size();
+  };
+  auto tree_ns = trace_ns(tree);
+  auto flat_ns = trace_ns(*warm);
+
+  std::cout << n << " spheres: bvh_node build " << build_ms
+            << " ms, flat_bvh cold " << cold_ms << " ms, warm " << warm_ms
+            << " ms (" << cold_ms / warm_ms << "x)\n"
+            << "hits " << n_hits << ", mismatches " << mismatches
+            << ", bvh_node " << tree_ns << " ns/ray, flat_bvh " << flat_ns
+            << " ns/ray\n";
+  cold.reset();
+  warm.reset();
+  std::string rm = std::string("rm -r ") + dir;
+  return system(rm.c_str()) == 0 && mismatches == 0 ? 0 : 1;
+}
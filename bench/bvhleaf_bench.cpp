@@ -0,0 +1,91 @@
+/**
+ * bvhleaf_bench: bvh_node with a leaf per object, as it used to be,
+ * against leaves of up to bvh_node::MAX_LEAF_ objects, for the cube of
+ * 1000 spheres in the final scene and for the moving grid of
+ * random_moving. Prints the shape of both trees, node visits and
+ * object tests per ray, and checks every ray hits the same t.
+ */
+#ifndef SLOWPT_STATS
+#define SLOWPT_STATS
+#endif
+#include "bvh.h"
+
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+#include "material.h"
+#include "sphere.h"
+
+struct result {
+  double ns, visits, tests;
+};
+
+result time_hits(bvh_node const& tree, std::vector<ray> const& rays,
+                 std::vector<double>& ts) {
+  hit_record rec;
+  auto &stats = render_stats::instance();
+  stats.reset();
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < rays.size(); i++) {
+    bool hit = tree.hit(rays[i], 0.001, INF_DBL, rec);
+    ts[i] = hit ? rec.t : -1;
+  }
+  auto ns = std::chrono::duration<double, std::nano>(
+                std::chrono::steady_clock::now() - start)
+                .count();
+  double n = rays.size();
+  return {ns / n, stats.total(STAT_BVH_NODES) / n,
+          stats.total(STAT_BVH_TESTS) / n};
+}
+
+void run(char const* name, std::vector<shared_ptr<base_object>>& objects,
+         point3d const& eye, point3d const& lo, point3d const& hi) {
+  std::vector<ray> rays;
+  for (int i = 0; i < 1 << 18; i++) {
+    point3d target{lo.x() + random_double() * (hi.x() - lo.x()),
+                   lo.y() + random_double() * (hi.y() - lo.y()),
+                   lo.z() + random_double() * (hi.z() - lo.z())};
+    rays.emplace_back(eye, target - eye, random_double());
+  }
+  std::vector<double> base_t(rays.size()), ts(rays.size());
+  result base{};
+  size_t const leaf_sizes[] = {1, 2, 4, bvh_node::MAX_LEAF_};
+  for (size_t max_leaf : leaf_sizes) {
+    bvh_node tree{objects, 0, objects.size(), 0.0, 1.0, max_leaf};
+    bvh_stats s;
+    tree.stats(s);
+    auto res = time_hits(tree, rays, max_leaf == 1 ? base_t : ts);
+    if (max_leaf == 1) base = res;
+    int mismatches = 0;
+    if (max_leaf != 1)
+      for (size_t i = 0; i < rays.size(); i++) mismatches += base_t[i] != ts[i];
+    std::cout << name << ", max_leaf " << max_leaf << ": " << s.nodes
+              << " nodes, " << s.leaves << " leaves, depth " << s.depth << ", "
+              << s.bytes / 1024.0 << " KB, " << res.visits << " visits/ray, "
+              << res.tests << " tests/ray, " << res.ns << " ns/ray ("
+              << base.ns / res.ns << "x), " << mismatches << " mismatches\n";
+  }
+}
+
+int main() {
+  srand(11);
+  auto white = make_shared<lambertian>(color_rgb{0.73, 0.73, 0.73});
+  // as the cube of the final scene, rays from its camera
+  std::vector<shared_ptr<base_object>> cube;
+  for (int i = 0; i < 1000; i++)
+    cube.push_back(make_shared<sphere>(vec3d::random(0, 165), 10, white));
+  run("cube", cube, point3d{-200, 80, -500}, point3d{0, 0, 0},
+      point3d{165, 165, 165});
+
+  // as the grid of random_moving, small spheres rising a little
+  std::vector<shared_ptr<base_object>> grid;
+  for (int a = -11; a < 11; a++)
+    for (int b = -11; b < 11; b++) {
+      point3d c0{a + 0.9 * random_double(), 0.2, b + 0.9 * random_double()};
+      auto c1 = c0 + vec3d{0, 0.5 * random_double(), 0};
+      grid.push_back(make_shared<sphere>(c0, c1, 0.0, 1.0, 0.2, white));
+    }
+  run("moving grid", grid, point3d{13, 2, 3}, point3d{-11, 0, -11},
+      point3d{11, 0.5, 11});
+}
@@ -0,0 +1,89 @@
+/**
+ * motion_bench: BVH traversal with moving spheres, nodes lerping their
+ * bounds by ray time against boxes swept over the whole shutter.
+ * The swept tree wraps each sphere so it reports the shutter box at any
+ * time, which is what every node saw before.
+ */
+#include "bvh.h"
+
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+#include "material.h"
+#include "sceneparser.h"
+#include "sphere.h"
+
+// bounds over the whole shutter whatever time is asked
+class swept : public base_object {
+ private:
+  shared_ptr<base_object> obj_ptr_;
+  double time0_, time1_;
+
+ public:
+  swept(shared_ptr<base_object> obj, double time0, double time1)
+      : obj_ptr_{obj}, time0_{time0}, time1_{time1} {}
+  virtual bool hit(ray const& r, double t_min, double t_max,
+                   hit_record& rec) const override {
+    return obj_ptr_->hit(r, t_min, t_max, rec);
+  }
+  virtual bool bounding_box(double tm0, double tm1,
+                            aabb& buf_aabb) const override {
+    return obj_ptr_->bounding_box(time0_, time1_, buf_aabb);
+  }
+};
+
+// small spheres in a 20 unit cube, each moving by speed along a random axis
+object_list flying_spheres(int n, double speed) {
+  object_list objects;
+  auto mat = make_shared<lambertian>(color_rgb{0.5, 0.5, 0.5});
+  for (int i = 0; i < n; i++) {
+    auto c0 = vec3d::random(-10, 10);
+    auto c1 = c0 + speed * unit_vector(vec3d::random(-1, 1));
+    objects.add(make_shared<sphere>(c0, c1, 0.0, 1.0, 0.1, mat));
+  }
+  return objects;
+}
+
+void run(char const* name, object_list world, point3d const& eye,
+         double spread) {
+  object_list wrapped;
+  for (auto const& obj : world.objects_)
+    wrapped.add(make_shared<swept>(obj, 0.0, 1.0));
+  // both trees split the same, on the same centroids and swept boxes
+  bvh_node lerped{world, 0.0, 1.0};
+  bvh_node sweeping{wrapped, 0.0, 1.0};
+
+  std::vector<ray> rays;
+  for (int i = 0; i < 1 << 18; i++) {
+    auto target = vec3d::random(-spread, spread);
+    rays.emplace_back(eye, target - eye, random_double());
+  }
+  auto time_hits = [&](bvh_node const& bvh, int& n_hits) {
+    hit_record rec;
+    n_hits = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (auto const& r : rays) n_hits += bvh.hit(r, 0.001, INF_DBL, rec);
+    return std::chrono::duration<double, std::nano>(
+               std::chrono::steady_clock::now() - start)
+               .count() /
+           rays.size();
+  };
+  int swept_hits, lerp_hits;
+  auto swept_ns = time_hits(sweeping, swept_hits);
+  auto lerp_ns = time_hits(lerped, lerp_hits);
+  std::cout << name << ": hits " << lerp_hits << " / " << swept_hits
+            << ", swept " << swept_ns << " ns/ray, lerped " << lerp_ns
+            << " ns/ray (" << swept_ns / lerp_ns << "x)\n";
+}
+
+int main() {
+  srand(7);
+  scene random_moving;
+  if (!scene_parser::load("scenes/random_moving.scene", random_moving))
+    return 1;
+  run("random_moving", random_moving.world, point3d{13, 2, 3}, 3);
+  run("flying, slow", flying_spheres(20000, 0.5), point3d{0, 0, -30}, 10);
+  run("flying, fast", flying_spheres(20000, 4), point3d{0, 0, -30}, 10);
+  return 0;
+}
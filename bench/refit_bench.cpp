@@ -0,0 +1,99 @@
+/**
+ * refit_bench: per frame bvh update for a final_scene sized animation,
+ * 400 rippling ground boxes and 1000 drifting small spheres, all
+ * keyframed. Compares refit() against a full rebuild, then the cost of
+ * tracing through the refit tree against a fresh one.
+ */
+#include "bvh.h"
+
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+#include "animation.h"
+#include "box.h"
+#include "material.h"
+#include "sphere.h"
+
+double ms_since(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+double trace_ns(bvh_node const& bvh, std::vector<ray> const& rays) {
+  hit_record rec;
+  auto start = std::chrono::steady_clock::now();
+  int n_hits = 0;
+  for (auto const& r : rays) n_hits += bvh.hit(r, 0.001, INF_DBL, rec);
+  return ms_since(start) * 1e6 / rays.size();
+}
+
+int main() {
+  int const FRAMES = 48;
+  srand(7);
+  animation anim;
+  object_list world;
+  auto mat = make_shared<lambertian>(color_rgb{0.5, 0.5, 0.5});
+  for (int i = 0; i < 20; i++) {
+    for (int j = 0; j < 20; j++) {
+      auto x0 = -1000.0 + i * 100, z0 = -1000.0 + j * 100;
+      auto ground_box = make_shared<box>(
+          point3d(x0, 0, z0), point3d(x0 + 100, random_double(1, 70), z0 + 100),
+          mat);
+      auto instance = make_shared<transform_instance>(ground_box, transform{});
+      transform_track track;
+      for (int k = 0; k <= FRAMES; k += 4) {
+        auto rise = 20 * sin(0.4 * (i + j) + 2 * PI * k / FRAMES);
+        track.add(transform_key{static_cast<double>(k), vec3d{0, rise, 0},
+                                vec3d{0, 1, 0}, 0, vec3d{1, 1, 1}});
+      }
+      anim.animate(instance, track);
+      world.add(instance);
+    }
+  }
+  for (int i = 0; i < 1000; i++) {
+    auto ball = make_shared<sphere>(point3d::random(0, 165) +
+                                        vec3d(-100, 270, 395),
+                                    10, mat);
+    auto instance = make_shared<transform_instance>(ball, transform{});
+    transform_track track;
+    track.add(transform_key{0, vec3d{0, 0, 0}, vec3d{0, 1, 0}, 0,
+                            vec3d{1, 1, 1}});
+    track.add(transform_key{FRAMES, vec3d::random(-200, 200), vec3d{0, 1, 0},
+                            0, vec3d{1, 1, 1}});
+    anim.animate(instance, track);
+    world.add(instance);
+  }
+
+  std::vector<ray> rays;
+  for (int i = 0; i < 1 << 18; i++) {
+    point3d eye{478, 278, -600};
+    auto target = point3d{random_double(-500, 800), random_double(0, 600),
+                          random_double(0, 800)};
+    rays.emplace_back(eye, target - eye, 0.0);
+  }
+
+  bvh_node refit_bvh{world, 0, 1};
+  double refit_ms = 0, rebuild_ms = 0;
+  for (int frame = 1; frame <= FRAMES; frame++) {
+    anim.apply(frame);
+    auto start = std::chrono::steady_clock::now();
+    refit_bvh.refit();
+    refit_ms += ms_since(start);
+    start = std::chrono::steady_clock::now();
+    bvh_node rebuilt{world, 0, 1};
+    rebuild_ms += ms_since(start);
+  }
+  bvh_node fresh{world, 0, 1};
+  std::cout << world.objects_.size() << " animated objects, " << FRAMES
+            << " frames\n"
+            << "refit   " << refit_ms / FRAMES << " ms/frame\n"
+            << "rebuild " << rebuild_ms / FRAMES << " ms/frame ("
+            << rebuild_ms / refit_ms << "x)\n"
+            << "after the last frame, node area " << refit_bvh.area_sum()
+            << " refit vs " << fresh.area_sum() << " rebuilt\n"
+            << "trace " << trace_ns(refit_bvh, rays) << " ns/ray refit, "
+            << trace_ns(fresh, rays) << " ns/ray rebuilt\n";
+  return 0;
+}
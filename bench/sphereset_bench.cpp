@@ -0,0 +1,87 @@
+/**
+ * sphereset_bench: a bvh_node over sphere objects against a sphere_set
+ * of the same spheres, for the cube of 1000 spheres in the final scene
+ * and for the moving grid of random_moving. Every ray must hit the
+ * same t in both, also with the range starting or ending at that t.
+ */
+#include "bvh.h"
+
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+#include "material.h"
+#include "sphere.h"
+#include "sphereset.h"
+
+void run(char const* name, std::vector<shared_ptr<sphere>> const& spheres,
+         point3d const& eye, point3d const& lo, point3d const& hi) {
+  std::vector<shared_ptr<base_object>> objects(spheres.begin(), spheres.end());
+  bvh_node tree{objects, 0, objects.size(), 0.0, 1.0};
+  sphere_set set{spheres, 0.0, 1.0};
+
+  std::vector<ray> rays;
+  for (int i = 0; i < 1 << 18; i++) {
+    point3d target{lo.x() + random_double() * (hi.x() - lo.x()),
+                   lo.y() + random_double() * (hi.y() - lo.y()),
+                   lo.z() + random_double() * (hi.z() - lo.z())};
+    rays.emplace_back(eye, target - eye, random_double());
+  }
+  std::vector<double> tree_t(rays.size()), set_t(rays.size());
+  auto time_hits = [&](base_object const& obj, std::vector<double>& ts) {
+    hit_record rec;
+    int n_hits = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < rays.size(); i++) {
+      bool hit = obj.hit(rays[i], 0.001, INF_DBL, rec);
+      n_hits += hit;
+      ts[i] = hit ? rec.t : -1;
+    }
+    return std::chrono::duration<double, std::nano>(
+               std::chrono::steady_clock::now() - start)
+               .count() /
+           rays.size();
+  };
+  auto tree_ns = time_hits(tree, tree_t);
+  auto set_ns = time_hits(set, set_t);
+  int mismatches = 0;
+  for (size_t i = 0; i < rays.size(); i++)
+    mismatches += tree_t[i] != set_t[i];
+  // where rounding would tell the two apart, at the ends of the range
+  hit_record rec;
+  for (size_t i = 0; i < rays.size(); i++) {
+    if (tree_t[i] < 0) continue;
+    for (auto range : {std::make_pair(tree_t[i], INF_DBL),
+                       std::make_pair(0.001, tree_t[i])}) {
+      bool tree_hit = tree.hit(rays[i], range.first, range.second, rec);
+      auto t = tree_hit ? rec.t : -1;
+      bool set_hit = set.hit(rays[i], range.first, range.second, rec);
+      mismatches += tree_hit != set_hit || (set_hit && rec.t != t);
+    }
+  }
+  std::cout << name << ": " << spheres.size() << " spheres, " << mismatches
+            << " mismatches, bvh_node " << tree_ns << " ns/ray, sphere_set "
+            << set_ns << " ns/ray (" << tree_ns / set_ns << "x)\n";
+}
+
+int main() {
+  srand(11);
+  auto white = make_shared<lambertian>(color_rgb{0.73, 0.73, 0.73});
+  // as the cube of the final scene, rays from its camera
+  std::vector<shared_ptr<sphere>> cube;
+  for (int i = 0; i < 1000; i++)
+    cube.push_back(make_shared<sphere>(vec3d::random(0, 165), 10, white));
+  run("cube", cube, point3d{-200, 80, -500}, point3d{0, 0, 0},
+      point3d{165, 165, 165});
+
+  // as the grid of random_moving, small spheres rising a little
+  std::vector<shared_ptr<sphere>> grid;
+  for (int a = -11; a < 11; a++)
+    for (int b = -11; b < 11; b++) {
+      point3d c0{a + 0.9 * random_double(), 0.2, b + 0.9 * random_double()};
+      auto c1 = c0 + vec3d{0, 0.5 * random_double(), 0};
+      grid.push_back(make_shared<sphere>(c0, c1, 0.0, 1.0, 0.2, white));
+    }
+  run("moving grid", grid, point3d{13, 2, 3}, point3d{-11, 0, -11},
+      point3d{11, 0.5, 11});
+}
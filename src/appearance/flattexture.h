@@ -0,0 +1,78 @@
+#ifndef FLAT_TEXTURE_H
+#define FLAT_TEXTURE_H
+
+#include <vector>
+
+#include "texture.h"
+
+/**
+ *  A texture graph flattened when the material is built.
+ *  The common cases are stored by value and evaluated inline:
+ *  a constant color costs no call at all, a checker of two
+ *  constants is one mask computation. Anything else keeps
+ *  the texture and goes through its virtual calls.
+ */
+class flat_texture {
+ public:
+  enum kind { CONSTANT, CHECKER, GENERIC };
+
+ private:
+  kind kind_;
+  color_rgb even_, odd_;  // CONSTANT uses even_ only
+  shared_ptr<texture> generic_;
+
+ public:
+  flat_texture(color_rgb const& c) : kind_{CONSTANT}, even_{c} {}
+  flat_texture(shared_ptr<texture> t);
+
+  kind type() const { return kind_; }
+  color_rgb value(double u, double v, point3d const& p,
+                  tex_footprint const& fp) const {
+    switch (kind_) {
+      case CONSTANT:
+        return even_;
+      case CHECKER: {
+        auto mask = checker_texture::filtered_mask(p, fp);
+        if (mask >= 1) return even_;
+        if (mask <= -1) return odd_;
+        return 0.5 * (1 + mask) * even_ + 0.5 * (1 - mask) * odd_;
+      }
+      default:
+        return generic_->filtered_value(u, v, p, fp);
+    }
+  }
+  void value_batch(tex_query const* q, color_rgb* out, size_t n,
+                   tex_scratch& scratch) const {
+    if (kind_ == CONSTANT)
+      std::fill(out, out + n, even_);
+    else if (kind_ == GENERIC)
+      generic_->value_batch(q, out, n, scratch);
+    else
+      for (size_t i = 0; i < n; i++)
+        out[i] = value(q[i].u, q[i].v, q[i].p, q[i].fp);
+  }
+  int cost() const {
+    return kind_ == CONSTANT ? 0 : kind_ == CHECKER ? 1 : generic_->cost();
+  }
+};
+
+flat_texture::flat_texture(shared_ptr<texture> t)
+    : kind_{GENERIC}, generic_{t} {
+  color_rgb even, odd;
+  if (t->constant_value(even)) {
+    kind_ = CONSTANT;
+    even_ = even;
+    generic_ = nullptr;
+    return;
+  }
+  auto checker = dynamic_cast<checker_texture const*>(t.get());
+  if (checker && checker->even_->constant_value(even) &&
+      checker->odd_->constant_value(odd)) {
+    kind_ = CHECKER;
+    even_ = even;
+    odd_ = odd;
+    generic_ = nullptr;
+  }
+}
+
+#endif
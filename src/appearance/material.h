@@ -1,7 +1,12 @@
 #ifndef MATERIAL_BASE_H
 #define MATERIAL_BASE_H
 
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
 #include "baseobject.h"
+#include "flattexture.h"
 #include "noise.h"
 #include "rt_utils.h"
 #include "texture.h"
@@ -10,13 +15,20 @@
 
 struct scatter_record {
   bool is_specular;
-  shared_ptr<pdf> pdf_ptr;
+  material_pdf pdf;  // sampled when not specular
   color_rgb attenuation;
   ray ray_specular;
 };
+// buffers of a batch of shading, one set per integrator and reused
+struct shade_scratch {
+  std::vector<tex_query> queries;
+  std::vector<color_rgb> colors;
+  tex_scratch textures;  // for the lookups of the queries
+};
 
 class base_material {
  public:
+  base_material() : id_{next_id()} {}
   virtual color_rgb emit(ray const& r_in, hit_record const& rec, double u,
                          double v, point3d const& p) const {
     return color_rgb{0, 0, 0};  // do not emit light by default
@@ -29,23 +41,103 @@ class base_material {
                              ray const& scattered) const {
     return 0.0;
   }
+  /**
+   * scatter() for n hits of this material at once,
+   * scattered[i] is what scatter() would return
+   */
+  virtual void scatter_batch(ray const* r_in, hit_record const* h_rec,
+                             scatter_record* s_rec, unsigned char* scattered,
+                             size_t n, shade_scratch& scratch) const {
+    for (size_t i = 0; i < n; i++)
+      scattered[i] = scatter(r_in[i], h_rec[i], s_rec[i]);
+  }
+  // rough cost of one scatter, the wavefront integrator sorts by it
+  virtual int shading_cost() const { return 1; }
+  // of the kind, the stats count scatters by it
+  virtual char const* name() const { return "material"; }
+  /**
+   * in the order materials were made, so with the scene built the same
+   * way it sorts the same from run to run, unlike the address
+   */
+  uint32_t id() const { return id_; }
+
+ private:
+  uint32_t id_;
+  static uint32_t next_id() {
+    static std::atomic<uint32_t> next{0};
+    return next++;
+  }
 };
 
+/**
+ * Differentials of a perfect specular bounce, following pbrt.
+ * wi is the unit mirror (or refracted) direction, eta the ratio
+ * of refraction indices as in dielectric, unused for reflection.
+ * The offset rays leave from p + dpdx (dpdy), their directions are
+ * wi changed to first order by the incoming direction and the normal.
+ */
+inline void specular_differentials(ray const& r_in, hit_record const& h_rec,
+                                   vec3d const& wi, bool refracted, double eta,
+                                   ray& out) {
+  if (!r_in.has_differentials()) return;
+  auto wo = -unit_vector(r_in.direction());
+  auto const& n = h_rec.normal;
+  auto dndx = h_rec.dndx(), dndy = h_rec.dndy();
+  auto dwodx = -unit_vector(r_in.rx_direction()) - wo;
+  auto dwody = -unit_vector(r_in.ry_direction()) - wo;
+  auto ddndx = dot(dwodx, n) + dot(wo, dndx);
+  auto ddndy = dot(dwody, n) + dot(wo, dndy);
+  vec3d rx_dir, ry_dir;
+  if (!refracted) {
+    rx_dir = wi - dwodx + 2 * (dot(wo, n) * dndx + ddndx * n);
+    ry_dir = wi - dwody + 2 * (dot(wo, n) * dndy + ddndy * n);
+  } else {
+    auto cos_i = dot(wo, n), cos_t = fabs(dot(wi, n));
+    if (cos_t == 0) return;
+    auto mu = eta * cos_i - cos_t;
+    auto dmu = eta - eta * eta * cos_i / cos_t;
+    rx_dir = wi - eta * dwodx + mu * dndx + dmu * ddndx * n;
+    ry_dir = wi - eta * dwody + mu * dndy + dmu * ddndy * n;
+  }
+  // keep the offsets if the actual direction is perturbed, as by fuzz
+  auto d = unit_vector(out.direction());
+  out.set_differentials(h_rec.p + h_rec.dpdx, d + (rx_dir - wi),
+                        h_rec.p + h_rec.dpdy, d + (ry_dir - wi));
+}
+inline tex_footprint footprint_of(hit_record const& h_rec);
+// the texture lookups of a batch of hits into q, which only grows
+inline void queries_of(hit_record const* h_rec, size_t n,
+                       std::vector<tex_query>& q) {
+  if (q.size() < n) q.resize(n);
+  for (size_t i = 0; i < n; i++)
+    q[i] = tex_query{h_rec[i].u, h_rec[i].v, h_rec[i].p, footprint_of(h_rec[i])};
+}
+inline tex_footprint footprint_of(hit_record const& h_rec) {
+  tex_footprint fp;
+  fp.dudx = h_rec.dudx;
+  fp.dvdx = h_rec.dvdx;
+  fp.dudy = h_rec.dudy;
+  fp.dvdy = h_rec.dvdy;
+  fp.dpdx = h_rec.dpdx;
+  fp.dpdy = h_rec.dpdy;
+  return fp;
+}
+
 class lambertian : public base_material {
  private:
-  std::shared_ptr<texture> albedo_;
+  flat_texture albedo_;
 
  public:
-  lambertian(color_rgb const& c)
-      : albedo_{std::make_shared<solid_texture>(c)} {}
+  lambertian(color_rgb const& c) : albedo_{c} {}
 
   lambertian(std::shared_ptr<texture> t) : albedo_{t} {}
 
   virtual bool scatter(const ray& r_in, const hit_record& h_rec,
                        scatter_record& s_rec) const override {
     s_rec.is_specular = false;
-    s_rec.attenuation = albedo_->value(h_rec.u, h_rec.v, h_rec.p);
-    s_rec.pdf_ptr = make_shared<cosine_pdf>(h_rec.normal);
+    s_rec.attenuation =
+        albedo_.value(h_rec.u, h_rec.v, h_rec.p, footprint_of(h_rec));
+    s_rec.pdf = material_pdf::cosine(h_rec.normal);
     return true;
 
     // onb uvw;
@@ -63,6 +155,22 @@ class lambertian : public base_material {
 
     // return true;
   }
+  virtual void scatter_batch(ray const* r_in, hit_record const* h_rec,
+                             scatter_record* s_rec, unsigned char* scattered,
+                             size_t n, shade_scratch& scratch) const override {
+    queries_of(h_rec, n, scratch.queries);
+    if (scratch.colors.size() < n) scratch.colors.resize(n);
+    albedo_.value_batch(scratch.queries.data(), scratch.colors.data(), n,
+                        scratch.textures);
+    for (size_t i = 0; i < n; i++) {
+      s_rec[i].is_specular = false;
+      s_rec[i].attenuation = scratch.colors[i];
+      s_rec[i].pdf = material_pdf::cosine(h_rec[i].normal);
+      scattered[i] = true;
+    }
+  }
+  virtual int shading_cost() const override { return 1 + albedo_.cost(); }
+  virtual char const* name() const override { return "lambertian"; }
   virtual double scatter_pdf(ray const& r_in, hit_record const& h_rec,
                              ray const& scattered) const override {
     // return .5 / PI;
@@ -74,12 +182,12 @@ class lambertian : public base_material {
 
 class metal : public base_material {
  private:
-  std::shared_ptr<texture> albedo_;
+  flat_texture albedo_;
   double fuzz_;
 
  public:
   metal(color_rgb const& a, double f)
-      : albedo_{make_shared<solid_texture>(a)}, fuzz_{f > 1.0 ? 1.0 : f} {}
+      : albedo_{a}, fuzz_{f > 1.0 ? 1.0 : f} {}
   metal(std::shared_ptr<texture> t, double f)
       : albedo_{t}, fuzz_{f > 1.0 ? 1.0 : f} {}
   virtual bool scatter(const ray& r_in, const hit_record& h_rec,
@@ -87,11 +195,16 @@ class metal : public base_material {
     vec3d reflect_dir = reflect(unit_vector(r_in.direction()), h_rec.normal);
     s_rec.ray_specular = ray{
         h_rec.p, reflect_dir + fuzz_ * random_in_unit_sphere(), r_in.time()};
-    s_rec.attenuation = albedo_->value(h_rec.u, h_rec.v, h_rec.p);
-    s_rec.is_specular = true;
-    s_rec.pdf_ptr = nullptr;  // when is_specular is true, just use ray_specular
+    // fuzz is ignored, the footprint follows the mirror direction
+    specular_differentials(r_in, h_rec, reflect_dir, false, 0,
+                           s_rec.ray_specular);
+    s_rec.attenuation =
+        albedo_.value(h_rec.u, h_rec.v, h_rec.p, footprint_of(h_rec));
+    s_rec.is_specular = true;  // ray_specular is used, not the pdf
     return true;
   }
+  virtual int shading_cost() const override { return 2 + albedo_.cost(); }
+  virtual char const* name() const override { return "metal"; }
 };
 
 class dielectric : public base_material {
@@ -117,6 +230,7 @@ class dielectric : public base_material {
     double refraction_ratio = h_rec.front_face ? (1.0 / ir_) : ir_;
     vec3d unit_in_dir = unit_vector(r_in.direction());
     vec3d out_dir;
+    bool refracted = false;
     // for precision
     auto cos_theta = fmin(dot(-unit_in_dir, h_rec.normal), 1.0);
     auto sin_theta = sqrt(1.0 - cos_theta * cos_theta);
@@ -138,34 +252,45 @@ class dielectric : public base_material {
       out_dir = reflect(unit_in_dir, h_rec.normal);
     } else {
       out_dir = refract(unit_in_dir, h_rec.normal, refraction_ratio);
+      refracted = true;
     }
 
     s_rec.ray_specular = ray(h_rec.p, out_dir, r_in.time());
+    specular_differentials(r_in, h_rec, out_dir, refracted, refraction_ratio,
+                           s_rec.ray_specular);
     s_rec.attenuation = color_rgb{1.0, 1.0, 1.0};
     s_rec.is_specular = true;
-    s_rec.pdf_ptr = nullptr;
     return true;
   }
+  virtual int shading_cost() const override { return 3; }
+  virtual char const* name() const override { return "dielectric"; }
 };
 class diffuse_light : public base_material {
  public:
   // cstr takes a color (to solid texture) or a texture (any would be ok)
   diffuse_light(shared_ptr<texture> txt) : emit_{txt} {}
-  diffuse_light(color_rgb const& c) : emit_{make_shared<solid_texture>(c)} {}
+  diffuse_light(color_rgb const& c) : emit_{c} {}
   virtual bool scatter(const ray& r_in, const hit_record& h_rec,
                        scatter_record& s_rec) const override {
     return false;  // a diffuse light source does not reflect rays
   }
+  virtual void scatter_batch(ray const* r_in, hit_record const* h_rec,
+                             scatter_record* s_rec, unsigned char* scattered,
+                             size_t n, shade_scratch& scratch) const override {
+    std::fill(scattered, scattered + n, 0);
+  }
+  virtual int shading_cost() const override { return 0; }
+  virtual char const* name() const override { return "diffuse_light"; }
   virtual color_rgb emit(ray const& r_in, hit_record const& rec, double u,
                          double v, point3d const& p) const override {
     if (rec.front_face)
-      return emit_->value(u, v, p);
+      return emit_.value(u, v, p, footprint_of(rec));
     else
       return color_rgb{0, 0, 0};
   }
 
  private:
-  shared_ptr<texture> emit_;  // always use a texture now
+  flat_texture emit_;  // a texture, flattened when built
 };
 
 /**
@@ -173,22 +298,25 @@ class diffuse_light : public base_material {
  */
 class isotropic_medium : public base_material {
  private:
-  shared_ptr<texture> albedo_;
+  flat_texture albedo_;
 
  public:
-  isotropic_medium(color_rgb clr) : albedo_{make_shared<solid_texture>(clr)} {}
+  isotropic_medium(color_rgb clr) : albedo_{clr} {}
   isotropic_medium(shared_ptr<texture> text) : albedo_{text} {}
   virtual bool scatter(const ray& r_in, const hit_record& h_rec,
                        scatter_record& s_rec) const override {
     s_rec.is_specular = false;
-    s_rec.attenuation = albedo_->value(h_rec.u, h_rec.v, h_rec.p);
-    s_rec.pdf_ptr = make_shared<on_sphere_pdf>();
+    s_rec.attenuation =
+        albedo_.value(h_rec.u, h_rec.v, h_rec.p, footprint_of(h_rec));
+    s_rec.pdf = material_pdf::sphere();
     return true;
   }
   virtual double scatter_pdf(ray const& r_in, hit_record const& h_rec,
                              ray const& scattered) const override {
     return 0.25 / PI;
   }
+  virtual int shading_cost() const override { return 1 + albedo_.cost(); }
+  virtual char const* name() const override { return "isotropic_medium"; }
 };
 
 #endif
@@ -0,0 +1,245 @@
+#ifndef MIPMAP_H
+#define MIPMAP_H
+
+#include <vector>
+
+#include "parallel.h"
+#include "rt_utils.h"
+#include "vec3d.h"
+
+/**
+ * Filters over an image pyramid, shared by the in memory mipmap below
+ * and the tiled one in texcache.h. Image provides levels(), width(lvl),
+ * height(lvl) and texel(lvl, x, y) clamped at the border.
+ *
+ * texture space is (s, t) in [0, 1]^2, t = 0 at the top row
+ */
+template <typename Image>
+class mip_filter {
+ public:
+  color_rgb bilerp(int lvl, double s, double t) const;
+  /**
+   * isotropic filter, width is the footprint in texture space
+   * (fraction of the image)
+   */
+  color_rgb trilinear(double s, double t, double width) const;
+  /**
+   * anisotropic filter, (ds0, dt0) and (ds1, dt1) are
+   * the screen space derivatives of (s, t)
+   */
+  color_rgb ewa(double s, double t, double ds0, double dt0, double ds1,
+                double dt1) const;
+
+ private:
+  static int const WEIGHT_LUT_SIZE_ = 128;
+  static double const MAX_ANISOTROPY_;
+  // gaussian for EWA, built once
+  static double const *weight_lut();
+  Image const &image() const { return static_cast<Image const &>(*this); }
+  // EWA on one level, dst0 and dst1 are the axes of the ellipse
+  color_rgb ewa(int lvl, double s, double t, double ds0, double dt0,
+                double ds1, double dt1) const;
+};
+template <typename Image>
+double const mip_filter<Image>::MAX_ANISOTROPY_ = 8.0;
+
+template <typename Image>
+double const *mip_filter<Image>::weight_lut() {
+  struct lut {
+    double w[WEIGHT_LUT_SIZE_];
+    lut() {
+      // gaussian falloff, zero at r = 1
+      double const alpha = 2;
+      for (int i = 0; i < WEIGHT_LUT_SIZE_; i++) {
+        double r2 = static_cast<double>(i) / (WEIGHT_LUT_SIZE_ - 1);
+        w[i] = exp(-alpha * r2) - exp(-alpha);
+      }
+    }
+  };
+  static lut const table;
+  return table.w;
+}
+template <typename Image>
+color_rgb mip_filter<Image>::bilerp(int lvl, double s, double t) const {
+  auto const &img = image();
+  // texel centers are at half integers
+  auto x = s * img.width(lvl) - 0.5;
+  auto y = t * img.height(lvl) - 0.5;
+  int x0 = static_cast<int>(floor(x)), y0 = static_cast<int>(floor(y));
+  auto dx = x - x0, dy = y - y0;
+  // clang-format off
+  return (1 - dx) * (1 - dy) * img.texel(lvl, x0,     y0)
+         + dx     * (1 - dy) * img.texel(lvl, x0 + 1, y0)
+         + (1 - dx) * dy     * img.texel(lvl, x0,     y0 + 1)
+         + dx     * dy       * img.texel(lvl, x0 + 1, y0 + 1);
+  // clang-format on
+}
+template <typename Image>
+color_rgb mip_filter<Image>::trilinear(double s, double t,
+                                       double width) const {
+  auto const &img = image();
+  // the level where one texel covers the footprint
+  auto lod = img.levels() - 1 + log2(std::max(width, 1e-8));
+  if (lod <= 0) return bilerp(0, s, t);
+  if (lod >= img.levels() - 1) return img.texel(img.levels() - 1, 0, 0);
+  int ilod = static_cast<int>(floor(lod));
+  auto delta = lod - ilod;
+  return (1 - delta) * bilerp(ilod, s, t) + delta * bilerp(ilod + 1, s, t);
+}
+/**
+ * Heckbert's elliptically weighted average, following pbrt.
+ * The minor axis picks the level, the major axis is clamped
+ * to MAX_ANISOTROPY_ times the minor to bound the cost.
+ */
+template <typename Image>
+color_rgb mip_filter<Image>::ewa(double s, double t, double ds0, double dt0,
+                                 double ds1, double dt1) const {
+  if (ds0 * ds0 + dt0 * dt0 < ds1 * ds1 + dt1 * dt1) {
+    std::swap(ds0, ds1);
+    std::swap(dt0, dt1);
+  }
+  auto major = sqrt(ds0 * ds0 + dt0 * dt0);
+  auto minor = sqrt(ds1 * ds1 + dt1 * dt1);
+  if (minor * MAX_ANISOTROPY_ < major && minor > 0) {
+    auto scale = major / (minor * MAX_ANISOTROPY_);
+    ds1 *= scale;
+    dt1 *= scale;
+    minor *= scale;
+  }
+  if (minor == 0) return bilerp(0, s, t);
+
+  auto lod = std::max(0.0, image().levels() - 1 + log2(minor));
+  int ilod = static_cast<int>(floor(lod));
+  auto delta = lod - ilod;
+  return (1 - delta) * ewa(ilod, s, t, ds0, dt0, ds1, dt1) +
+         delta * ewa(ilod + 1, s, t, ds0, dt0, ds1, dt1);
+}
+template <typename Image>
+color_rgb mip_filter<Image>::ewa(int lvl, double s, double t, double ds0,
+                                 double dt0, double ds1, double dt1) const {
+  auto const &img = image();
+  if (lvl >= img.levels()) return img.texel(img.levels() - 1, 0, 0);
+  // to texel coordinates of this level
+  auto w = img.width(lvl), h = img.height(lvl);
+  auto x = s * w - 0.5;
+  auto y = t * h - 0.5;
+  ds0 *= w;
+  dt0 *= h;
+  ds1 *= w;
+  dt1 *= h;
+  // implicit ellipse A s^2 + B s t + C t^2 = F, normalized to F = 1
+  auto A = dt0 * dt0 + dt1 * dt1 + 1;
+  auto B = -2 * (ds0 * dt0 + ds1 * dt1);
+  auto C = ds0 * ds0 + ds1 * ds1 + 1;
+  auto inv_f = 1 / (A * C - B * B * 0.25);
+  A *= inv_f;
+  B *= inv_f;
+  C *= inv_f;
+  // bounding box of the ellipse
+  auto det = -B * B + 4 * A * C;
+  auto inv_det = 1 / det;
+  auto u_sqrt = sqrt(det * C), v_sqrt = sqrt(A * det);
+  int x0 = static_cast<int>(ceil(x - 2 * inv_det * u_sqrt));
+  int x1 = static_cast<int>(floor(x + 2 * inv_det * u_sqrt));
+  int y0 = static_cast<int>(ceil(y - 2 * inv_det * v_sqrt));
+  int y1 = static_cast<int>(floor(y + 2 * inv_det * v_sqrt));
+
+  auto lut = weight_lut();
+  color_rgb sum{0, 0, 0};
+  double sum_weights = 0;
+  for (int iy = y0; iy <= y1; iy++) {
+    auto dy = iy - y;
+    for (int ix = x0; ix <= x1; ix++) {
+      auto dx = ix - x;
+      auto r2 = A * dx * dx + B * dx * dy + C * dy * dy;
+      if (r2 >= 1) continue;
+      auto index = std::min(static_cast<int>(r2 * WEIGHT_LUT_SIZE_),
+                            WEIGHT_LUT_SIZE_ - 1);
+      auto weight = lut[index];
+      sum += weight * img.texel(lvl, ix, iy);
+      sum_weights += weight;
+    }
+  }
+  if (sum_weights <= 0) return bilerp(lvl, s, t);
+  return sum / sum_weights;
+}
+
+/**
+ * rgb image pyramid in linear float, all in memory,
+ * level 0 is the full image, each level halves both sides down to 1x1
+ */
+class mipmap : public mip_filter<mipmap> {
+ public:
+  enum filter_mode { TRILINEAR, EWA };
+
+ private:
+  struct level {
+    int width, height;
+    std::vector<float> texels;  // rgb, row major
+  };
+  std::vector<level> levels_;
+
+  void downsample(level const &src, level &dst) const;
+
+ public:
+  mipmap() {}
+  /**
+   * @param rgb linear rgb, row major
+   * the pyramid is built in parallel, row by row
+   */
+  mipmap(std::vector<float> rgb, int width, int height);
+  int levels() const { return static_cast<int>(levels_.size()); }
+  int width(int lvl) const { return levels_[lvl].width; }
+  int height(int lvl) const { return levels_[lvl].height; }
+  // clamped at the border
+  color_rgb texel(int lvl, int x, int y) const;
+  size_t bytes() const;
+};
+
+mipmap::mipmap(std::vector<float> rgb, int width, int height) {
+  levels_.push_back(level{width, height, std::move(rgb)});
+  while (levels_.back().width > 1 || levels_.back().height > 1) {
+    level next;
+    downsample(levels_.back(), next);
+    levels_.push_back(std::move(next));
+  }
+}
+/**
+ * 2x2 box filter, the last row/column of an odd side
+ * is folded into its neighbour by clamping
+ */
+void mipmap::downsample(level const &src, level &dst) const {
+  dst.width = std::max(1, src.width / 2);
+  dst.height = std::max(1, src.height / 2);
+  dst.texels.resize(static_cast<size_t>(dst.width) * dst.height * 3);
+  parallel_for(0, dst.height, [&](size_t y) {
+    int y0 = std::min(src.height - 1, static_cast<int>(2 * y));
+    int y1 = std::min(src.height - 1, static_cast<int>(2 * y + 1));
+    for (int x = 0; x < dst.width; x++) {
+      int x0 = std::min(src.width - 1, 2 * x);
+      int x1 = std::min(src.width - 1, 2 * x + 1);
+      for (int c = 0; c < 3; c++) {
+        auto at = [&](int xx, int yy) {
+          auto idx = (static_cast<size_t>(yy) * src.width + xx) * 3 + c;
+          return src.texels[idx];
+        };
+        dst.texels[(y * dst.width + x) * 3 + c] =
+            0.25f * (at(x0, y0) + at(x1, y0) + at(x0, y1) + at(x1, y1));
+      }
+    }
+  });
+}
+color_rgb mipmap::texel(int lvl, int x, int y) const {
+  auto const &l = levels_[lvl];
+  x = std::max(0, std::min(l.width - 1, x));
+  y = std::max(0, std::min(l.height - 1, y));
+  auto px = &l.texels[(static_cast<size_t>(y) * l.width + x) * 3];
+  return color_rgb{px[0], px[1], px[2]};
+}
+size_t mipmap::bytes() const {
+  size_t total = 0;
+  for (auto const &l : levels_) total += l.texels.size() * sizeof(float);
+  return total;
+}
+
+#endif
@@ -1,18 +1,35 @@
 #ifndef NOISE_H
 #define NOISE_H
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "rt_utils.h"
 /**
  *  We set value of the noise function as zero,
  *  and assign a random gradient at each lattice.
  *
+ *  Gradients are kept as three arrays (x, y, z) so the SIMD path
+ *  can gather them lane by lane. With SSE2 two noise values are
+ *  computed at once, one point per lane: two octaves in turb(),
+ *  two shading points in the batched calls. Each lane does exactly
+ *  the scalar arithmetic in the same order, so results are bit
+ *  for bit those of noise().
  */
 class perlin_noise {
  public:
   perlin_noise() {
     // generate random gradients
-    random_grad_ = new vec3d[MAP_SIZE_];
-    for (int i = 0; i < MAP_SIZE_; i++) random_grad_[i] = random_unit_vector();
+    grad_x_ = new double[MAP_SIZE_];
+    grad_y_ = new double[MAP_SIZE_];
+    grad_z_ = new double[MAP_SIZE_];
+    for (int i = 0; i < MAP_SIZE_; i++) {
+      auto g = random_unit_vector();
+      grad_x_[i] = g.x();
+      grad_y_[i] = g.y();
+      grad_z_[i] = g.z();
+    }
     // generate permuted coordinate mapping
     x_map_ = coord_permute();
     y_map_ = coord_permute();
@@ -23,10 +40,39 @@ class perlin_noise {
     auto temp_p = p;
     auto weight = 1.0;
 
+    // octaves in pairs, summed in the same order as one by one
+    int i = 0;
+    for (; i + 1 < depth; i += 2) {
+      auto next_p = temp_p * 2;
+      double n0, n1;
+      noise2(temp_p, next_p, n0, n1);
+      accum += weight * n0;
+      weight *= 0.5;
+      accum += weight * n1;
+      weight *= 0.5;
+      temp_p = next_p * 2;
+    }
+    if (i < depth) accum += weight * noise(temp_p);
+
+    return fabs(accum);
+  }
+  /**
+   * turb without the octaves finer than width,
+   * an octave fades out as its period nears twice the width
+   */
+  double turb_filtered(const point3d &p, double width, int depth = 7) const {
+    auto accum = 0.0;
+    auto temp_p = p;
+    auto weight = 1.0;
+    auto freq_width = width;  // width in units of this octave's lattice
+
     for (int i = 0; i < depth; i++) {
-      accum += weight * noise(temp_p);
+      auto fade = clamp(2 - 4 * freq_width, 0.0, 1.0);
+      if (fade <= 0) break;
+      accum += fade * weight * noise(temp_p);
       weight *= 0.5;
       temp_p *= 2;
+      freq_width *= 2;
     }
 
     return fabs(accum);
@@ -35,35 +81,76 @@ class perlin_noise {
     // point NEAR to the origin
     // NOTE: use static_cast will make floor to zero,
     //       and u/v/w negative
-    auto u = p.x() - floor(p.x());
-    auto v = p.y() - floor(p.y());
-    auto w = p.z() - floor(p.z());
+    auto fx = floor(p.x()), fy = floor(p.y()), fz = floor(p.z());
+    auto u = p.x() - fx;
+    auto v = p.y() - fy;
+    auto w = p.z() - fz;
     /**
      *  Hermitian Smoothing
      *  a curve whose first and second derivatives are zero at 0 and 1
      *  this will make lattice's influence "bigger",
      *  so the grid will not be too attractive
      */
+    auto uu = fade(u), vv = fade(v), ww = fade(w);
     // values for LERP
-    auto i = static_cast<int>(floor(p.x()));
-    auto j = static_cast<int>(floor(p.y()));
-    auto k = static_cast<int>(floor(p.z()));
-    // take all the lattice values
-    vec3d lattice[2][2][2];
+    auto i = static_cast<int>(fx);
+    auto j = static_cast<int>(fy);
+    auto k = static_cast<int>(fz);
+    double val = 0;
     for (int di = 0; di < 2; di++) {
       for (int dj = 0; dj < 2; dj++) {
         for (int dk = 0; dk < 2; dk++) {
           // xor to merge three coordinates
-          lattice[di][dj][dk] =
-              random_grad_[x_map_[(i + di) & 255] ^ y_map_[(j + dj) & 255] ^
-                           z_map_[(k + dk) & 255]];
+          auto g = x_map_[(i + di) & 255] ^ y_map_[(j + dj) & 255] ^
+                   z_map_[(k + dk) & 255];
+          /**
+           *  Weight's projection on gradient
+           *  is the delta at (i, j, k)
+           */
+          auto delta = grad_x_[g] * (u - di) + grad_y_[g] * (v - dj) +
+                       grad_z_[g] * (w - dk);
+          // clang-format off
+          val += delta * (di ? uu : 1 - uu)
+                       * (dj ? vv : 1 - vv)
+                       * (dk ? ww : 1 - ww);
+          // clang-format on
         }
       }
     }
-    return tri_LERP(lattice, u, v, w);
+    return val;
+  }
+  // out[i] = noise(p[i]), two points at a time
+  void noise_batch(point3d const *p, double *out, size_t n) const {
+    size_t i = 0;
+    for (; i + 1 < n; i += 2) noise2(p[i], p[i + 1], out[i], out[i + 1]);
+    if (i < n) out[i] = noise(p[i]);
+  }
+  // out[i] = turb(p[i], depth), two points at a time
+  void turb_batch(point3d const *p, double *out, size_t n,
+                  int depth = 7) const {
+    size_t i = 0;
+    for (; i + 1 < n; i += 2) {
+      auto p0 = p[i], p1 = p[i + 1];
+      auto accum0 = 0.0, accum1 = 0.0;
+      auto weight = 1.0;
+      for (int d = 0; d < depth; d++) {
+        double n0, n1;
+        noise2(p0, p1, n0, n1);
+        accum0 += weight * n0;
+        accum1 += weight * n1;
+        weight *= 0.5;
+        p0 *= 2;
+        p1 *= 2;
+      }
+      out[i] = fabs(accum0);
+      out[i + 1] = fabs(accum1);
+    }
+    if (i < n) out[i] = turb(p[i], depth);
   }
   ~perlin_noise() {
-    delete[] random_grad_;
+    delete[] grad_x_;
+    delete[] grad_y_;
+    delete[] grad_z_;
     delete[] x_map_;
     delete[] y_map_;
     delete[] z_map_;
@@ -72,7 +159,7 @@ class perlin_noise {
  private:
   static int const MAP_SIZE_ = 256;
   static int permutation_[];
-  vec3d *random_grad_;
+  double *grad_x_, *grad_y_, *grad_z_;
   int *x_map_, *y_map_, *z_map_;
   int *coord_permute() {
     auto p = new int[MAP_SIZE_];
@@ -87,32 +174,75 @@ class perlin_noise {
     }
     return p;
   }
-  double tri_LERP(vec3d lattice[2][2][2], double u, double v, double w) const {
-    auto uu = u * u * u * (6 * u * u - 15 * u + 10);
-    auto vv = v * v * v * (6 * v * v - 15 * v + 10);
-    auto ww = w * w * w * (6 * w * w - 15 * w + 10);
-    double val = 0;
-    for (int i = 0; i < 2; i++) {
-      for (int j = 0; j < 2; j++) {
-        for (int k = 0; k < 2; k++) {
-          // get the needed base
-          vec3d weight{u - i, v - j, w - k};
-          /**
-           *  Weight's projection on gradient
-           *  is the delta at (i, j, k)
-           */
-          // clang-format off
-          val += dot(lattice[i][j][k], weight)
-                 * (i * uu + (1 - i) * (1 - uu))
-                 * (j * vv + (1 - j) * (1 - vv))
-                 * (k * ww + (1 - k) * (1 - ww));
-          // clang-format on
-        }
+  static double fade(double t) { return t * t * t * (6 * t * t - 15 * t + 10); }
+  // noise(p0) and noise(p1)
+  void noise2(point3d const &p0, point3d const &p1, double &n0,
+              double &n1) const;
+};
+
+#if defined(__SSE2__)
+void perlin_noise::noise2(point3d const &p0, point3d const &p1, double &n0,
+                          double &n1) const {
+  // SSE2 has no floor, the lattice cell is found per lane
+  double f0[3], f1[3];
+  int c0[3], c1[3];
+  for (int a = 0; a < 3; a++) {
+    f0[a] = floor(p0[a]);
+    f1[a] = floor(p1[a]);
+    c0[a] = static_cast<int>(f0[a]);
+    c1[a] = static_cast<int>(f1[a]);
+  }
+  // lane 0 is p0, lane 1 is p1
+  __m128d const one = _mm_set1_pd(1.0);
+  __m128d const six = _mm_set1_pd(6.0), fifteen = _mm_set1_pd(15.0),
+                ten = _mm_set1_pd(10.0);
+  __m128d frac[3], weight[3][2], delta[3][2];
+  for (int a = 0; a < 3; a++) {
+    auto t = _mm_sub_pd(_mm_set_pd(p1[a], p0[a]), _mm_set_pd(f1[a], f0[a]));
+    frac[a] = t;
+    // t * t * t * (6 * t * t - 15 * t + 10), in the scalar order
+    auto t3 = _mm_mul_pd(_mm_mul_pd(t, t), t);
+    auto poly = _mm_add_pd(
+        _mm_sub_pd(_mm_mul_pd(_mm_mul_pd(six, t), t), _mm_mul_pd(fifteen, t)),
+        ten);
+    auto f = _mm_mul_pd(t3, poly);
+    weight[a][0] = _mm_sub_pd(one, f);
+    weight[a][1] = f;
+    delta[a][0] = frac[a];
+    delta[a][1] = _mm_sub_pd(frac[a], one);
+  }
+  __m128d val = _mm_setzero_pd();
+  for (int di = 0; di < 2; di++) {
+    for (int dj = 0; dj < 2; dj++) {
+      for (int dk = 0; dk < 2; dk++) {
+        auto g0 = x_map_[(c0[0] + di) & 255] ^ y_map_[(c0[1] + dj) & 255] ^
+                  z_map_[(c0[2] + dk) & 255];
+        auto g1 = x_map_[(c1[0] + di) & 255] ^ y_map_[(c1[1] + dj) & 255] ^
+                  z_map_[(c1[2] + dk) & 255];
+        auto gx = _mm_set_pd(grad_x_[g1], grad_x_[g0]);
+        auto gy = _mm_set_pd(grad_y_[g1], grad_y_[g0]);
+        auto gz = _mm_set_pd(grad_z_[g1], grad_z_[g0]);
+        auto d = _mm_add_pd(_mm_add_pd(_mm_mul_pd(gx, delta[0][di]),
+                                       _mm_mul_pd(gy, delta[1][dj])),
+                            _mm_mul_pd(gz, delta[2][dk]));
+        d = _mm_mul_pd(_mm_mul_pd(_mm_mul_pd(d, weight[0][di]), weight[1][dj]),
+                       weight[2][dk]);
+        val = _mm_add_pd(val, d);
       }
     }
-    return val;
   }
-};
+  double out[2];
+  _mm_storeu_pd(out, val);
+  n0 = out[0];
+  n1 = out[1];
+}
+#else
+void perlin_noise::noise2(point3d const &p0, point3d const &p1, double &n0,
+                          double &n1) const {
+  n0 = noise(p0);
+  n1 = noise(p1);
+}
+#endif
 // 256 perlin noise LUT
 // https://en.wikipedia.org/wiki/Perlin_noise
 int perlin_noise::permutation_[] = {
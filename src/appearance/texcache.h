@@ -0,0 +1,465 @@
+#ifndef TEXCACHE_H
+#define TEXCACHE_H
+
+/**
+ * Demand paged textures for images too large to keep in memory.
+ *
+ * An image is converted once into <path>.tiled, a mip-mapped pyramid
+ * cut into TILE_SIZE x TILE_SIZE tiles of 8 bit rgb. Where <path> is
+ * read only it goes to $XDG_CACHE_HOME/slowpt or /tmp/slowpt, and where
+ * that fails too the texture is kept in memory. Tiles are read
+ * with pread() when a lookup touches them and kept in one LRU shared
+ * by all images and threads, bounded in bytes.
+ */
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "image_utils.h"
+#include "mipmap.h"
+#include "texture.h"
+
+class tex_cache;
+
+/**
+ * one image in the tiled format, texels go through the cache
+ */
+class tiled_image : public mip_filter<tiled_image> {
+ public:
+  static int const TILE_SIZE = 64;
+  static size_t const TILE_BYTES = TILE_SIZE * TILE_SIZE * 3;
+
+ private:
+  struct level {
+    int width, height;
+    int tiles_x, tiles_y;
+    int64_t offset;  // of the first tile in the file
+  };
+  std::vector<level> levels_;
+  int fd_;
+  int id_;  // in the cache
+
+  static char const MAGIC_[8];
+  static uint32_t const VERSION_ = 1;
+
+  // pyramid layout, same halving as mipmap
+  void layout(int width, int height);
+  int64_t header_bytes() const { return 8 + 4 + 8 + 8 + 4 + 4 + 8 * levels(); }
+  bool read_header(std::string const &tiled_path, struct stat const &src);
+  static bool convert(std::string const &path, std::string const &tiled_path,
+                      struct stat const &src);
+  // the tiled file in the cache directory, empty if there is none
+  static std::string cache_path(std::string const &path);
+
+ public:
+  tiled_image(int id) : fd_{-1}, id_{id} {}
+  ~tiled_image() {
+    if (fd_ >= 0) close(fd_);
+  }
+  tiled_image(tiled_image const &) = delete;
+  tiled_image &operator=(tiled_image const &) = delete;
+  /**
+   * converts the image if <path>.tiled is missing or stale, into the
+   * cache directory if <path>.tiled cannot be written
+   */
+  bool open(std::string const &path);
+  bool is_open() const { return fd_ >= 0; }
+  int id() const { return id_; }
+  int levels() const { return static_cast<int>(levels_.size()); }
+  int width(int lvl) const { return levels_[lvl].width; }
+  int height(int lvl) const { return levels_[lvl].height; }
+  // clamped at the border
+  color_rgb texel(int lvl, int x, int y) const;
+  // read one tile from disk into buf, TILE_BYTES long
+  bool read_tile(int lvl, int tx, int ty, unsigned char *buf) const;
+};
+char const tiled_image::MAGIC_[8] = {'S', 'P', 'T', 'T', 'I', 'L', 'E', 0};
+uint32_t const tiled_image::VERSION_;
+int const tiled_image::TILE_SIZE;
+size_t const tiled_image::TILE_BYTES;
+
+/**
+ * The process wide cache, textures are deduplicated by path.
+ * Tiles are handed out as shared_ptr, so an evicted tile stays
+ * valid for whoever is still reading it.
+ */
+class tex_cache {
+ public:
+  typedef std::vector<unsigned char> tile;
+
+ private:
+  std::mutex mutex_;
+  std::unordered_map<std::string, shared_ptr<tiled_image>> images_;
+  // in memory where tiling failed, by path and filter
+  std::unordered_map<std::string, shared_ptr<image_texture>> fallbacks_;
+  // most recently used at the front
+  std::list<uint64_t> lru_;
+  struct entry {
+    shared_ptr<tile const> data;
+    std::list<uint64_t>::iterator pos;
+  };
+  std::unordered_map<uint64_t, entry> tiles_;
+  size_t budget_;
+  size_t hits_, misses_;
+
+  tex_cache() : budget_{size_t(256) << 20}, hits_{0}, misses_{0} {}
+  static uint64_t key(int id, int lvl, int tx, int ty) {
+    return (static_cast<uint64_t>(id) << 48) |
+           (static_cast<uint64_t>(lvl) << 40) |
+           (static_cast<uint64_t>(ty) << 20) | static_cast<uint64_t>(tx);
+  }
+
+ public:
+  static tex_cache &instance() {
+    static tex_cache cache;
+    return cache;
+  }
+  // nullptr if the image cannot be read or converted anywhere
+  shared_ptr<tiled_image> image(std::string const &path);
+  // the image in memory instead, loaded once per path and filter
+  shared_ptr<image_texture> fallback(std::string const &path,
+                                     mipmap::filter_mode filter);
+  shared_ptr<tile const> fetch(tiled_image const &img, int lvl, int tx, int ty);
+  // bound on the bytes of resident tiles
+  void set_budget(size_t bytes);
+  void report(std::ostream &out);
+};
+
+/**
+ * texture backed by the cache, filters like image_texture
+ */
+class tiled_texture : public texture {
+ private:
+  shared_ptr<tiled_image> image_;
+  mipmap::filter_mode filter_;
+  // in memory when no tiled file could be written
+  shared_ptr<image_texture> fallback_;
+
+ public:
+  tiled_texture(char const *filename,
+                mipmap::filter_mode filter = mipmap::TRILINEAR)
+      : image_{tex_cache::instance().image(filename)}, filter_{filter} {
+    if (!image_) fallback_ = tex_cache::instance().fallback(filename, filter);
+  }
+
+  virtual color_rgb value(double u, double v, point3d const &p) const override {
+    if (!image_) return fallback_->value(u, v, p);
+    // Flip V to image coordinates
+    return image_->bilerp(0, clamp(u, 0.0, 1.0), 1.0 - clamp(v, 0.0, 1.0));
+  }
+  virtual color_rgb filtered_value(double u, double v, point3d const &p,
+                                   tex_footprint const &fp) const override {
+    if (!image_) return fallback_->filtered_value(u, v, p, fp);
+    auto s = clamp(u, 0.0, 1.0);
+    auto t = 1.0 - clamp(v, 0.0, 1.0);
+    // t is flipped, so are its derivatives
+    if (filter_ == mipmap::EWA)
+      return image_->ewa(s, t, fp.dudx, -fp.dvdx, fp.dudy, -fp.dvdy);
+    auto width = 2 * std::max(std::max(fabs(fp.dudx), fabs(fp.dvdx)),
+                              std::max(fabs(fp.dudy), fabs(fp.dvdy)));
+    return image_->trilinear(s, t, width);
+  }
+};
+
+/**
+ * 8 bit texels are gamma 2 encoded, as for image_texture
+ */
+inline float tile_to_linear(unsigned char c) {
+  struct lut {
+    float v[256];
+    lut() {
+      for (int i = 0; i < 256; i++) v[i] = (i / 255.0f) * (i / 255.0f);
+    }
+  };
+  static lut const table;
+  return table.v[c];
+}
+inline unsigned char tile_from_linear(float c) {
+  return static_cast<unsigned char>(255 * sqrt(clamp(c, 0.0, 1.0)) + 0.5);
+}
+
+void tiled_image::layout(int width, int height) {
+  levels_.clear();
+  while (true) {
+    level l;
+    l.width = width;
+    l.height = height;
+    l.tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+    l.tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+    levels_.push_back(l);
+    if (width == 1 && height == 1) break;
+    width = std::max(1, width / 2);
+    height = std::max(1, height / 2);
+  }
+  // the header size depends on the level count
+  int64_t offset = header_bytes();
+  for (auto &l : levels_) {
+    l.offset = offset;
+    offset += static_cast<int64_t>(l.tiles_x) * l.tiles_y * TILE_BYTES;
+  }
+}
+/**
+ * header: magic, version, source size and mtime, tile size,
+ * level count, then width and height of each level.
+ * Tiles follow level by level, row by row, edge tiles padded.
+ */
+bool tiled_image::read_header(std::string const &tiled_path,
+                              struct stat const &src) {
+  FILE *fp = fopen(tiled_path.c_str(), "rb");
+  if (!fp) return false;
+  char magic[8];
+  uint32_t version;
+  int64_t size, mtime;
+  int tile_size, n_levels, w, h;
+  bool ok = fread(magic, 1, 8, fp) == 8 && memcmp(magic, MAGIC_, 8) == 0 &&
+            fread(&version, sizeof(version), 1, fp) == 1 &&
+            version == VERSION_ && fread(&size, sizeof(size), 1, fp) == 1 &&
+            size == src.st_size && fread(&mtime, sizeof(mtime), 1, fp) == 1 &&
+            mtime == static_cast<int64_t>(src.st_mtime) &&
+            fread(&tile_size, sizeof(tile_size), 1, fp) == 1 &&
+            tile_size == TILE_SIZE &&
+            fread(&n_levels, sizeof(n_levels), 1, fp) == 1 &&
+            fread(&w, sizeof(w), 1, fp) == 1 &&
+            fread(&h, sizeof(h), 1, fp) == 1 && w > 0 && h > 0;
+  fclose(fp);
+  if (!ok) return false;
+  layout(w, h);
+  if (levels() != n_levels) return false;
+  // the file must hold every tile
+  struct stat st;
+  if (stat(tiled_path.c_str(), &st) != 0) return false;
+  auto const &last = levels_.back();
+  return st.st_size >= last.offset + static_cast<int64_t>(TILE_BYTES);
+}
+/**
+ * The only time the whole image is in memory. Each level is written
+ * out tile by tile, then box filtered into the next one in linear space.
+ */
+bool tiled_image::convert(std::string const &path,
+                          std::string const &tiled_path,
+                          struct stat const &src) {
+  auto start = std::chrono::steady_clock::now();
+  int width, height, channels = 3;
+  auto data = stbi_load(path.c_str(), &width, &height, &channels, 3);
+  if (!data) return false;
+  std::vector<unsigned char> cur(data, data + static_cast<size_t>(width) *
+                                                  height * 3);
+  stbi_image_free(data);
+
+  tiled_image shape{-1};
+  shape.layout(width, height);
+  /**
+   * write to a temporary first, a half written file is never picked up,
+   * named by process so two converting the same image do not mix
+   */
+  std::string tmp_path = tiled_path + ".tmp." + std::to_string(getpid());
+  FILE *fp = fopen(tmp_path.c_str(), "wb");
+  if (!fp) return false;
+  int64_t size = src.st_size, mtime = static_cast<int64_t>(src.st_mtime);
+  int tile_size = TILE_SIZE, n_levels = shape.levels();
+  bool ok = fwrite(MAGIC_, 1, 8, fp) == 8 &&
+            fwrite(&VERSION_, sizeof(VERSION_), 1, fp) == 1 &&
+            fwrite(&size, sizeof(size), 1, fp) == 1 &&
+            fwrite(&mtime, sizeof(mtime), 1, fp) == 1 &&
+            fwrite(&tile_size, sizeof(tile_size), 1, fp) == 1 &&
+            fwrite(&n_levels, sizeof(n_levels), 1, fp) == 1;
+  for (auto const &l : shape.levels_)
+    ok = ok && fwrite(&l.width, sizeof(int), 1, fp) == 1 &&
+         fwrite(&l.height, sizeof(int), 1, fp) == 1;
+
+  std::vector<unsigned char> buf(TILE_BYTES);
+  for (int lvl = 0; ok && lvl < n_levels; lvl++) {
+    auto const &l = shape.levels_[lvl];
+    for (int ty = 0; ok && ty < l.tiles_y; ty++) {
+      for (int tx = 0; ok && tx < l.tiles_x; tx++) {
+        for (int y = 0; y < TILE_SIZE; y++) {
+          int sy = std::min(l.height - 1, ty * TILE_SIZE + y);
+          for (int x = 0; x < TILE_SIZE; x++) {
+            int sx = std::min(l.width - 1, tx * TILE_SIZE + x);
+            memcpy(&buf[(y * TILE_SIZE + x) * 3],
+                   &cur[(static_cast<size_t>(sy) * l.width + sx) * 3], 3);
+          }
+        }
+        ok = fwrite(buf.data(), 1, TILE_BYTES, fp) == TILE_BYTES;
+      }
+    }
+    if (lvl + 1 == n_levels) break;
+    // 2x2 box filter, clamped like mipmap::downsample
+    auto const &nl = shape.levels_[lvl + 1];
+    std::vector<unsigned char> next(static_cast<size_t>(nl.width) * nl.height *
+                                    3);
+    parallel_for(0, nl.height, [&](size_t y) {
+      int y0 = std::min(l.height - 1, static_cast<int>(2 * y));
+      int y1 = std::min(l.height - 1, static_cast<int>(2 * y + 1));
+      for (int x = 0; x < nl.width; x++) {
+        int x0 = std::min(l.width - 1, 2 * x);
+        int x1 = std::min(l.width - 1, 2 * x + 1);
+        for (int c = 0; c < 3; c++) {
+          auto at = [&](int xx, int yy) {
+            return tile_to_linear(
+                cur[(static_cast<size_t>(yy) * l.width + xx) * 3 + c]);
+          };
+          next[(y * nl.width + x) * 3 + c] = tile_from_linear(
+              0.25f * (at(x0, y0) + at(x1, y0) + at(x0, y1) + at(x1, y1)));
+        }
+      }
+    });
+    cur.swap(next);
+  }
+  ok = fclose(fp) == 0 && ok;
+  if (!ok || rename(tmp_path.c_str(), tiled_path.c_str()) != 0) {
+    remove(tmp_path.c_str());
+    return false;
+  }
+  auto ms = std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - start)
+                .count();
+  std::cerr << "tex_cache: converted " << path << " (" << width << "x"
+            << height << ") to " << tiled_path << " in " << ms << " ms\n";
+  return true;
+}
+std::string tiled_image::cache_path(std::string const &path) {
+  char const *xdg = getenv("XDG_CACHE_HOME");
+  std::string dir = std::string(xdg && *xdg ? xdg : "/tmp") + "/slowpt";
+  if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) return "";
+  // the whole path in the name, images of the same name do not collide
+  char full[PATH_MAX];
+  std::string name = realpath(path.c_str(), full) ? full : path;
+  for (auto &c : name)
+    if (c == '/') c = '_';
+  return dir + "/" + name + ".tiled";
+}
+bool tiled_image::open(std::string const &path) {
+  struct stat src;
+  if (stat(path.c_str(), &src) != 0) return false;
+  for (auto const &tiled_path : {path + ".tiled", cache_path(path)}) {
+    if (tiled_path.empty()) continue;
+    if (!read_header(tiled_path, src) &&
+        !(convert(path, tiled_path, src) && read_header(tiled_path, src)))
+      continue;
+    fd_ = ::open(tiled_path.c_str(), O_RDONLY);
+    if (fd_ >= 0) return true;
+  }
+  return false;
+}
+bool tiled_image::read_tile(int lvl, int tx, int ty, unsigned char *buf) const {
+  auto const &l = levels_[lvl];
+  auto offset =
+      l.offset + (static_cast<int64_t>(ty) * l.tiles_x + tx) * TILE_BYTES;
+  size_t done = 0;
+  while (done < TILE_BYTES) {
+    auto n = pread(fd_, buf + done, TILE_BYTES - done, offset + done);
+    if (n <= 0) return false;
+    done += n;
+  }
+  return true;
+}
+color_rgb tiled_image::texel(int lvl, int x, int y) const {
+  auto const &l = levels_[lvl];
+  x = std::max(0, std::min(l.width - 1, x));
+  y = std::max(0, std::min(l.height - 1, y));
+  int tx = x / TILE_SIZE, ty = y / TILE_SIZE;
+  /**
+   * neighbouring lookups mostly land in the same tile,
+   * remember the last one per thread to skip the lock
+   */
+  struct last_tile {
+    int img = -1;  // by id, an address may be reused by another image
+    int lvl, tx, ty;
+    shared_ptr<tex_cache::tile const> data;
+  };
+  static thread_local last_tile last;
+  if (last.img != id_ || last.lvl != lvl || last.tx != tx || last.ty != ty) {
+    last.data = tex_cache::instance().fetch(*this, lvl, tx, ty);
+    last.img = id_;
+    last.lvl = lvl;
+    last.tx = tx;
+    last.ty = ty;
+  }
+  if (!last.data) return color_rgb{0, 1, 1};
+  auto px = &(*last.data)[((y % TILE_SIZE) * TILE_SIZE + x % TILE_SIZE) * 3];
+  return color_rgb{tile_to_linear(px[0]), tile_to_linear(px[1]),
+                   tile_to_linear(px[2])};
+}
+
+shared_ptr<tiled_image> tex_cache::image(std::string const &path) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = images_.find(path);
+  if (it != images_.end()) return it->second;
+  auto img = make_shared<tiled_image>(static_cast<int>(images_.size()));
+  if (!img->open(path)) {
+    std::cerr << "tex_cache: could not tile '" << path
+              << "', it is kept in memory\n";
+    img = nullptr;
+  }
+  images_[path] = img;
+  return img;
+}
+shared_ptr<image_texture> tex_cache::fallback(std::string const &path,
+                                              mipmap::filter_mode filter) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto &tex = fallbacks_[path + "#" + std::to_string(filter)];
+  if (!tex) tex = make_shared<image_texture>(path.c_str(), filter);
+  return tex;
+}
+shared_ptr<tex_cache::tile const> tex_cache::fetch(tiled_image const &img,
+                                                   int lvl, int tx, int ty) {
+  auto k = key(img.id(), lvl, tx, ty);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = tiles_.find(k);
+    if (it != tiles_.end()) {
+      hits_++;
+      lru_.splice(lru_.begin(), lru_, it->second.pos);
+      return it->second.data;
+    }
+    misses_++;
+  }
+  // read outside the lock, two threads may read the same tile at worst
+  auto data = make_shared<tile>(tiled_image::TILE_BYTES);
+  if (!img.read_tile(lvl, tx, ty, data->data())) return nullptr;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = tiles_.find(k);
+  if (it != tiles_.end()) return it->second.data;
+  lru_.push_front(k);
+  tiles_[k] = entry{data, lru_.begin()};
+  while (lru_.size() > 1 && lru_.size() * tiled_image::TILE_BYTES > budget_) {
+    tiles_.erase(lru_.back());
+    lru_.pop_back();
+  }
+  return data;
+}
+void tex_cache::set_budget(size_t bytes) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  budget_ = bytes;
+  while (!lru_.empty() && lru_.size() * tiled_image::TILE_BYTES > budget_) {
+    tiles_.erase(lru_.back());
+    lru_.pop_back();
+  }
+}
+void tex_cache::report(std::ostream &out) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (images_.empty()) return;
+  auto lookups = hits_ + misses_;
+  out << "tex_cache: " << images_.size() << " image(s), " << lru_.size()
+      << " tiles resident ("
+      << (lru_.size() * tiled_image::TILE_BYTES >> 10) << " KiB of "
+      << (budget_ >> 10) << " KiB), " << misses_ << " tile reads, hit rate "
+      << (lookups ? 100.0 * hits_ / lookups : 0.0) << "%\n";
+}
+
+#endif
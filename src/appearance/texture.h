@@ -5,9 +5,59 @@
  *  uv is calculated along with the ray hit
  */
 
+#include <chrono>
+#include <deque>
+#include <vector>
+
+#include "aabb.h"
 #include "colorRGB.h"
-#include "noise.h"
 #include "image_utils.h"
+#include "mipmap.h"
+#include "noise.h"
+
+/**
+ *  screen space derivatives of uv and p at the lookup,
+ *  all zero means a point sample
+ */
+struct tex_footprint {
+  double dudx = 0, dvdx = 0;
+  double dudy = 0, dvdy = 0;
+  vec3d dpdx, dpdy;
+  // size of the footprint in object space
+  double width() const { return std::max(dpdx.norm(), dpdy.norm()); }
+};
+// one lookup of a batch
+struct tex_query {
+  double u, v;
+  point3d p;
+  tex_footprint fp;
+};
+/**
+ *  buffers value_batch() reuses from call to call, one level per
+ *  nested call as a checker passes its lookups on to its children
+ */
+class tex_scratch {
+ public:
+  struct level {
+    std::vector<double> mask;
+    std::vector<tex_query> even_q, odd_q;
+    std::vector<color_rgb> even_c, odd_c;
+    std::vector<size_t> exact;
+    std::vector<point3d> pts;
+    std::vector<double> turbs;
+  };
+  // the buffers of a call, until the matching leave()
+  level& enter() {
+    if (depth_ == levels_.size()) levels_.emplace_back();
+    return levels_[depth_++];
+  }
+  void leave() { depth_--; }
+
+ private:
+  // a deque, so a level stays put while deeper ones are added
+  std::deque<level> levels_;
+  size_t depth_ = 0;
+};
 
 class texture {
  public:
@@ -15,6 +65,28 @@ class texture {
    *  we need a point3d to make some anisotropic texture
    */
   virtual color_rgb value(double u, double v, point3d const& p) const = 0;
+  /**
+   *  lookup filtered over a footprint,
+   *  textures that do not filter just take a point sample
+   */
+  virtual color_rgb filtered_value(double u, double v, point3d const& p,
+                                   tex_footprint const& fp) const {
+    return value(u, v, p);
+  }
+  /**
+   *  out[i] = filtered_value() of q[i], one virtual call for
+   *  the whole batch, textures override it with tight loops
+   *  over buffers from scratch
+   */
+  virtual void value_batch(tex_query const* q, color_rgb* out, size_t n,
+                           tex_scratch& scratch) const {
+    for (size_t i = 0; i < n; i++)
+      out[i] = filtered_value(q[i].u, q[i].v, q[i].p, q[i].fp);
+  }
+  // rough cost of one lookup, to group cheap shading work together
+  virtual int cost() const { return 1; }
+  // true if the texture is one color everywhere, c is set to it
+  virtual bool constant_value(color_rgb& c) const { return false; }
 };
 
 class solid_texture : public texture {
@@ -29,6 +101,15 @@ class solid_texture : public texture {
   virtual color_rgb value(double u, double v, point3d const& p) const override {
     return color_value_;
   }
+  virtual void value_batch(tex_query const* q, color_rgb* out, size_t n,
+                           tex_scratch& scratch) const override {
+    std::fill(out, out + n, color_value_);
+  }
+  virtual int cost() const override { return 0; }
+  virtual bool constant_value(color_rgb& c) const override {
+    c = color_value_;
+    return true;
+  }
 };
 
 class checker_texture : public texture {
@@ -49,11 +130,86 @@ class checker_texture : public texture {
     else
       return even_->value(u, v, p);
   }
+  /**
+   *  The pattern is the sign of a product of one sine per axis,
+   *  so a box filter over the footprint's bounds is the product
+   *  of the box filtered square wave on each axis, exactly.
+   */
+  virtual color_rgb filtered_value(double u, double v, point3d const& p,
+                                   tex_footprint const& fp) const override {
+    auto mask = filtered_mask(p, fp);
+    if (mask >= 1) return even_->filtered_value(u, v, p, fp);
+    if (mask <= -1) return odd_->filtered_value(u, v, p, fp);
+    return 0.5 * (1 + mask) * even_->filtered_value(u, v, p, fp) +
+           0.5 * (1 - mask) * odd_->filtered_value(u, v, p, fp);
+  }
+  /**
+   *  masks first, then each child sees one batch of
+   *  the lookups that need it
+   */
+  virtual void value_batch(tex_query const* q, color_rgb* out, size_t n,
+                           tex_scratch& scratch) const override {
+    auto& l = scratch.enter();
+    auto& mask = l.mask;
+    auto &even_c = l.even_c, &odd_c = l.odd_c;
+    auto &even_q = l.even_q, &odd_q = l.odd_q;
+    mask.resize(n);
+    even_q.clear();
+    odd_q.clear();
+    for (size_t i = 0; i < n; i++) {
+      mask[i] = filtered_mask(q[i].p, q[i].fp);
+      if (mask[i] > -1) even_q.push_back(q[i]);
+      if (mask[i] < 1) odd_q.push_back(q[i]);
+    }
+    even_c.resize(even_q.size());
+    odd_c.resize(odd_q.size());
+    even_->value_batch(even_q.data(), even_c.data(), even_q.size(), scratch);
+    odd_->value_batch(odd_q.data(), odd_c.data(), odd_q.size(), scratch);
+    size_t ie = 0, io = 0;
+    for (size_t i = 0; i < n; i++) {
+      if (mask[i] >= 1)
+        out[i] = even_c[ie++];
+      else if (mask[i] <= -1)
+        out[i] = odd_c[io++];
+      else
+        out[i] = 0.5 * (1 + mask[i]) * even_c[ie++] +
+                 0.5 * (1 - mask[i]) * odd_c[io++];
+    }
+    scratch.leave();
+  }
+  virtual int cost() const override {
+    return 1 + even_->cost() + odd_->cost();
+  }
+  /**
+   *  +1 on even, -1 on odd, in between where the footprint
+   *  covers both, box filtered
+   */
+  static double filtered_mask(point3d const& p, tex_footprint const& fp) {
+    double mask = 1;
+    for (int a = 0; a < 3; a++)
+      mask *= filtered_square(p[a], fabs(fp.dpdx[a]) + fabs(fp.dpdy[a]));
+    return mask;
+  }
+
+ private:
+  static double const FREQ_;
+  // integral of sign(sin(FREQ_ * x)), a triangle wave
+  static double square_integral(double x) {
+    auto phase = fmod(FREQ_ * x, 2 * PI);
+    if (phase < 0) phase += 2 * PI;
+    return (PI - fabs(phase - PI)) / FREQ_;
+  }
+  // sign(sin(FREQ_ * x)) averaged over [x - w/2, x + w/2]
+  static double filtered_square(double x, double w) {
+    if (w <= 0) return sin(FREQ_ * x) < 0 ? -1 : 1;
+    return (square_integral(x + 0.5 * w) - square_integral(x - 0.5 * w)) / w;
+  }
 
  public:
   shared_ptr<texture> odd_;
   shared_ptr<texture> even_;
 };
+double const checker_texture::FREQ_ = 10;
 
 class noise_texture : public texture {
  public:
@@ -61,63 +217,243 @@ class noise_texture : public texture {
   noise_texture(double scale) : scale_{scale} {}
 
   virtual color_rgb value(double u, double v, const point3d& p) const override {
-    return color_rgb{1, 1, 1} * 0.5 *
-           (1 + sin(p.z() * scale_ + 10 * noise_.turb(p)));
+    return color_rgb{1, 1, 1} * 0.5 * (1 + sin(p.z() * scale_ + 10 * turb(p)));
   }
+  /**
+   *  Octaves finer than the footprint are faded out in turb,
+   *  the sine of z is box filtered, which scales it by a sinc,
+   *  both fade to the average grey.
+   *  The baked grid is already smooth below a cell, so it is
+   *  used as long as the footprint is smaller than that.
+   */
+  virtual color_rgb filtered_value(double u, double v, point3d const& p,
+                                   tex_footprint const& fp) const override {
+    auto width = fp.width();
+    auto t = width < cell_ ? turb(p) : noise_.turb_filtered(p, width);
+    return marble(p, t, fp);
+  }
+  /**
+   *  Sample turb into a grid over box, built in parallel. Lookups
+   *  inside the box are then trilinear, outside they stay exact.
+   *  The resolution doubles until the RMS error at probe points
+   *  is within max_error, or the next grid would exceed max_bytes.
+   */
+  void bake(aabb const& box, double max_error = 0.02,
+            size_t max_bytes = size_t(64) << 20);
+  /**
+   *  Lookups that need every octave of the exact turb go
+   *  through perlin_noise::turb_batch, two at a time,
+   *  the rest take the scalar path.
+   */
+  virtual void value_batch(tex_query const* q, color_rgb* out, size_t n,
+                           tex_scratch& scratch) const override;
+  virtual int cost() const override { return grid_.empty() ? 8 : 2; }
 
  private:
   perlin_noise noise_;
   double scale_;  // the noise is periodic
+  // baked turb at the grid vertices, x fastest, empty if not baked
+  std::vector<float> grid_;
+  point3d grid_min_;
+  int nx_ = 0, ny_ = 0, nz_ = 0;
+  double cell_ = 0;
+
+  double turb(point3d const& p) const;
+  // color for turbulence t at p, the sine of z box filtered over fp
+  color_rgb marble(point3d const& p, double t, tex_footprint const& fp) const {
+    auto phase = p.z() * scale_ + 10 * t;
+    auto half = 0.5 * scale_ * (fabs(fp.dpdx.z()) + fabs(fp.dpdy.z()));
+    auto damp = 1.0;
+    if (half >= PI)
+      damp = 0;
+    else if (half > 0)
+      damp = sin(half) / half;
+    return color_rgb{1, 1, 1} * 0.5 * (1 + damp * sin(phase));
+  }
+  void build_grid(aabb const& box, double cell);
+  double grid_error(aabb const& box, double& max_err) const;
+  static size_t grid_bytes(aabb const& box, double cell);
 };
 
+double noise_texture::turb(point3d const& p) const {
+  if (grid_.empty()) return noise_.turb(p);
+  auto gx = (p.x() - grid_min_.x()) / cell_;
+  auto gy = (p.y() - grid_min_.y()) / cell_;
+  auto gz = (p.z() - grid_min_.z()) / cell_;
+  if (!(gx >= 0 && gy >= 0 && gz >= 0 && gx <= nx_ - 1 && gy <= ny_ - 1 &&
+        gz <= nz_ - 1))
+    return noise_.turb(p);
+  int i = std::min(static_cast<int>(gx), nx_ - 2);
+  int j = std::min(static_cast<int>(gy), ny_ - 2);
+  int k = std::min(static_cast<int>(gz), nz_ - 2);
+  auto fx = gx - i, fy = gy - j, fz = gz - k;
+  size_t sy = nx_, sz = static_cast<size_t>(nx_) * ny_;
+  auto at = &grid_[k * sz + j * sy + i];
+  auto lerp = [](double a, double b, double t) { return a + t * (b - a); };
+  // clang-format off
+  auto c00 = lerp(at[0],           at[1],                fx);
+  auto c10 = lerp(at[sy],          at[sy + 1],           fx);
+  auto c01 = lerp(at[sz],          at[sz + 1],           fx);
+  auto c11 = lerp(at[sz + sy],     at[sz + sy + 1],      fx);
+  // clang-format on
+  return lerp(lerp(c00, c10, fy), lerp(c01, c11, fy), fz);
+}
+void noise_texture::value_batch(tex_query const* q, color_rgb* out,
+                                size_t n, tex_scratch& scratch) const {
+  // footprints this small keep all 7 octaves in turb_filtered
+  double const FULL_DETAIL_WIDTH = 1.0 / 256;
+  auto& l = scratch.enter();
+  auto& exact = l.exact;
+  auto& pts = l.pts;
+  auto& turbs = l.turbs;
+  exact.clear();
+  for (size_t i = 0; i < n; i++) {
+    auto const& fp = q[i].fp;
+    if (grid_.empty() && fp.width() <= FULL_DETAIL_WIDTH)
+      exact.push_back(i);
+    else
+      out[i] = noise_texture::filtered_value(q[i].u, q[i].v, q[i].p, fp);
+  }
+  pts.resize(exact.size());
+  turbs.resize(exact.size());
+  for (size_t k = 0; k < exact.size(); k++) pts[k] = q[exact[k]].p;
+  noise_.turb_batch(pts.data(), turbs.data(), pts.size());
+  for (size_t k = 0; k < exact.size(); k++)
+    out[exact[k]] = marble(pts[k], turbs[k], q[exact[k]].fp);
+  scratch.leave();
+}
+size_t noise_texture::grid_bytes(aabb const& box, double cell) {
+  size_t n = sizeof(float);
+  for (int a = 0; a < 3; a++)
+    n *= static_cast<size_t>(ceil((box.max()[a] - box.min()[a]) / cell)) + 2;
+  return n;
+}
+void noise_texture::build_grid(aabb const& box, double cell) {
+  cell_ = cell;
+  grid_min_ = box.min();
+  // one extra vertex so the grid covers the box
+  nx_ = static_cast<int>(ceil((box.max().x() - box.min().x()) / cell)) + 2;
+  ny_ = static_cast<int>(ceil((box.max().y() - box.min().y()) / cell)) + 2;
+  nz_ = static_cast<int>(ceil((box.max().z() - box.min().z()) / cell)) + 2;
+  std::vector<float> grid(static_cast<size_t>(nx_) * ny_ * nz_);
+  // turb is const and never calls rand(), safe to run in parallel
+  parallel_for(0, static_cast<size_t>(ny_) * nz_, [&](size_t row) {
+    auto j = row % ny_, k = row / ny_;
+    for (int i = 0; i < nx_; i++)
+      grid[row * nx_ + i] = static_cast<float>(noise_.turb(
+          grid_min_ + cell * vec3d{double(i), double(j), double(k)}));
+  });
+  grid_.swap(grid);
+}
+/**
+ *  baked vs exact turb at Halton points in the box,
+ *  deterministic and leaves rand() alone
+ */
+double noise_texture::grid_error(aabb const& box, double& max_err) const {
+  auto radical_inverse = [](int base, int i) {
+    double inv = 1.0 / base, f = inv, r = 0;
+    for (; i > 0; i /= base, f *= inv) r += f * (i % base);
+    return r;
+  };
+  int const PROBES = 4096;
+  double sum2 = 0;
+  max_err = 0;
+  auto ext = box.max() - box.min();
+  for (int n = 1; n <= PROBES; n++) {
+    auto p = box.min() + vec3d{ext.x() * radical_inverse(2, n),
+                               ext.y() * radical_inverse(3, n),
+                               ext.z() * radical_inverse(5, n)};
+    auto err = fabs(turb(p) - noise_.turb(p));
+    sum2 += err * err;
+    max_err = std::max(max_err, err);
+  }
+  return sqrt(sum2 / PROBES);
+}
+void noise_texture::bake(aabb const& box, double max_error, size_t max_bytes) {
+  auto start = std::chrono::steady_clock::now();
+  auto ext = box.max() - box.min();
+  auto cell = std::max(ext.x(), std::max(ext.y(), ext.z())) / 16;
+  if (!(cell > 0) || grid_bytes(box, cell) > max_bytes) return;
+  double rms, max_err;
+  while (true) {
+    grid_.clear();
+    build_grid(box, cell);
+    rms = grid_error(box, max_err);
+    if (rms <= max_error || grid_bytes(box, cell / 2) > max_bytes) break;
+    cell /= 2;
+  }
+  auto ms = std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - start)
+                .count();
+  std::cerr << "noise_texture: baked " << nx_ << "x" << ny_ << "x" << nz_
+            << " grid, " << (grid_.size() * sizeof(float) >> 10)
+            << " KiB, cell " << cell_ << ", rms error " << rms << " (max "
+            << max_err << "), " << ms << " ms\n";
+}
+
+/**
+ *  Image kept as a mip-mapped pyramid of linear floats.
+ *  8 bit texels are decoded with gamma 2,
+ *  the inverse of what write_color() encodes with.
+ */
 class image_texture : public texture {
  private:
-  unsigned char* data;
-  int width, height;
-  int bytes_per_scanline;
+  mipmap pyramid_;
+  mipmap::filter_mode filter_;
+  bool loaded_;
 
  public:
-  const static int bytes_per_pixel = 3;  // three channels, all in [0, 255]
-
-  image_texture() : data(nullptr), width(0), height(0), bytes_per_scanline(0) {}
-
-  image_texture(const char* filename) {
-    auto components_per_pixel = bytes_per_pixel;
-    data = stbi_load(filename, &width, &height, &components_per_pixel,
-                     components_per_pixel);
+  image_texture() : filter_{mipmap::TRILINEAR}, loaded_{false} {}
 
+  image_texture(const char* filename,
+                mipmap::filter_mode filter = mipmap::TRILINEAR)
+      : filter_{filter}, loaded_{false} {
+    int width, height;
+    int components_per_pixel = 3;
+    auto data = stbi_load(filename, &width, &height, &components_per_pixel,
+                          components_per_pixel);
     if (!data) {
       std::cerr << "ERROR: Could not load texture image file '" << filename
                 << "'.\n";
-      width = height = 0;
+      return;
     }
-
-    bytes_per_scanline = bytes_per_pixel * width;
+    float to_linear[256];
+    for (int i = 0; i < 256; i++) {
+      auto c = i / 255.0f;
+      to_linear[i] = c * c;
+    }
+    std::vector<float> rgb(static_cast<size_t>(width) * height * 3);
+    for (size_t i = 0; i < rgb.size(); i++) rgb[i] = to_linear[data[i]];
+    stbi_image_free(data);
+    pyramid_ = mipmap{std::move(rgb), width, height};
+    loaded_ = true;
   }
 
-  ~image_texture() { delete data; }
-
+  // point sample, bilinear on the full resolution
   virtual color_rgb value(double u, double v, vec3d const& p) const override {
     // If we have no texture data, then return solid cyan as a debugging aid.
-    if (data == nullptr) return color_rgb{0, 1, 1};
-
-    // Clamp input texture coordinates to [0,1] x [1,0]
-    u = clamp(u, 0.0, 1.0);
-    v = 1.0 - clamp(v, 0.0, 1.0);  // Flip V to image coordinates
-
-    auto i = static_cast<int>(u * width);
-    auto j = static_cast<int>(v * height);
-
-    // Clamp integer mapping, since actual coordinates should be less than 1.0
-    if (i >= width) i = width - 1;
-    if (j >= height) j = height - 1;
-
-    const auto color_scale = 1.0 / 255.0;
-    auto pixel = data + j * bytes_per_scanline + i * bytes_per_pixel;
-
-    return color_rgb{color_scale * pixel[0], color_scale * pixel[1],
-                     color_scale * pixel[2]};
+    if (!loaded_) return color_rgb{0, 1, 1};
+    // Flip V to image coordinates
+    return pyramid_.bilerp(0, clamp(u, 0.0, 1.0), 1.0 - clamp(v, 0.0, 1.0));
+  }
+  virtual color_rgb filtered_value(double u, double v, point3d const& p,
+                                   tex_footprint const& fp) const override {
+    if (!loaded_) return color_rgb{0, 1, 1};
+    auto s = clamp(u, 0.0, 1.0);
+    auto t = 1.0 - clamp(v, 0.0, 1.0);
+    // t is flipped, so are its derivatives
+    if (filter_ == mipmap::EWA)
+      return pyramid_.ewa(s, t, fp.dudx, -fp.dvdx, fp.dudy, -fp.dvdy);
+    auto width = 2 * std::max(std::max(fabs(fp.dudx), fabs(fp.dvdx)),
+                              std::max(fabs(fp.dudy), fabs(fp.dvdy)));
+    return pyramid_.trilinear(s, t, width);
+  }
+  virtual void value_batch(tex_query const* q, color_rgb* out, size_t n,
+                           tex_scratch& scratch) const override {
+    for (size_t i = 0; i < n; i++)
+      out[i] = image_texture::filtered_value(q[i].u, q[i].v, q[i].p, q[i].fp);
   }
+  virtual int cost() const override { return filter_ == mipmap::EWA ? 4 : 2; }
 };
 
 #endif
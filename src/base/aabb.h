@@ -17,10 +17,15 @@ class aabb {
   point3d min() const;
   point3d max() const;
   bool hit(ray const &r, double t_min, double t_max) const;
+  double surface_area() const;
 };
 
 point3d aabb::min() const { return this->min_; }
 point3d aabb::max() const { return this->max_; }
+double aabb::surface_area() const {
+  auto d = max_ - min_;
+  return 2 * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+}
 bool aabb::hit(ray const &r, double t_min, double t_max) const {
   for (int axis = 0; axis < 3; axis++) {
     auto inv_d = 1 / r.direction()[axis];
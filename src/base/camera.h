@@ -53,6 +53,17 @@ class camera {
                lower_left_ + s * hori_edge_ + t * vert_edge_ - origin_new,
                random_double(open_time_, close_time_)};
   }
+  /**
+   * ray with differentials, the offset rays go through
+   * (s + ds, t) and (s, t + dt) from the same point on the lens
+   */
+  ray ray_at(double s, double t, double ds, double dt) {
+    ray r = ray_at(s, t);
+    auto target = r.origin() + r.direction();
+    r.set_differentials(r.origin(), target + ds * hori_edge_ - r.origin(),
+                        r.origin(), target + dt * vert_edge_ - r.origin());
+    return r;
+  }
 };
 
 #endif
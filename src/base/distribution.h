@@ -0,0 +1,147 @@
+#ifndef DISTRIBUTION_H
+#define DISTRIBUTION_H
+
+#include <cstdio>
+#include <vector>
+
+#include "parallel.h"
+#include "rt_utils.h"
+
+/**
+ * piecewise constant distribution on [0, 1),
+ * n pieces with value func[i] each
+ */
+class distribution_1d {
+ public:
+  std::vector<double> func_, cdf_;
+  double func_int_;  // integral of func on [0, 1)
+
+ public:
+  distribution_1d() : func_int_{0} {}
+  distribution_1d(double const *f, int n) { build(f, n); }
+  void build(double const *f, int n);
+  int count() const { return static_cast<int>(func_.size()); }
+  double integral() const { return func_int_; }
+  /**
+   * @param u uniform in [0, 1)
+   * @param pdf density of the sample, wrt [0, 1)
+   * @param offset index of the piece sampled
+   * @return sample in [0, 1)
+   */
+  double sample_continuous(double u, double &pdf, int &offset) const;
+  // density of piece i, wrt [0, 1)
+  double pdf(int i) const { return func_int_ > 0 ? func_[i] / func_int_ : 0; }
+  bool write(FILE *fp) const;
+  bool read(FILE *fp);
+};
+
+void distribution_1d::build(double const *f, int n) {
+  func_.assign(f, f + n);
+  cdf_.resize(n + 1);
+  cdf_[0] = 0;
+  for (int i = 1; i <= n; i++) cdf_[i] = cdf_[i - 1] + func_[i - 1] / n;
+  func_int_ = cdf_[n];
+  // an all zero function is sampled uniformly
+  for (int i = 1; i <= n; i++)
+    cdf_[i] = func_int_ == 0 ? static_cast<double>(i) / n : cdf_[i] / func_int_;
+}
+double distribution_1d::sample_continuous(double u, double &pdf,
+                                          int &offset) const {
+  // last cdf entry <= u
+  offset = static_cast<int>(std::upper_bound(cdf_.begin(), cdf_.end(), u) -
+                            cdf_.begin()) -
+           1;
+  offset = std::max(0, std::min(count() - 1, offset));
+  auto du = u - cdf_[offset];
+  auto width = cdf_[offset + 1] - cdf_[offset];
+  if (width > 0) du /= width;
+  pdf = this->pdf(offset);
+  return (offset + du) / count();
+}
+bool distribution_1d::write(FILE *fp) const {
+  int n = count();
+  return fwrite(&n, sizeof(n), 1, fp) == 1 &&
+         fwrite(&func_int_, sizeof(func_int_), 1, fp) == 1 &&
+         fwrite(func_.data(), sizeof(double), n, fp) == size_t(n) &&
+         fwrite(cdf_.data(), sizeof(double), n + 1, fp) == size_t(n + 1);
+}
+bool distribution_1d::read(FILE *fp) {
+  int n;
+  if (fread(&n, sizeof(n), 1, fp) != 1 || n <= 0) return false;
+  func_.resize(n);
+  cdf_.resize(n + 1);
+  return fread(&func_int_, sizeof(func_int_), 1, fp) == 1 &&
+         fread(func_.data(), sizeof(double), n, fp) == size_t(n) &&
+         fread(cdf_.data(), sizeof(double), n + 1, fp) == size_t(n + 1);
+}
+
+/**
+ * piecewise constant distribution on [0, 1)^2,
+ * sampled by a marginal on v then a conditional on u
+ */
+class distribution_2d {
+ private:
+  std::vector<distribution_1d> conditional_;  // one per row
+  distribution_1d marginal_;
+
+ public:
+  distribution_2d() {}
+  /**
+   * @param f row major, nu * nv values
+   * rows are built in parallel
+   */
+  void build(double const *f, int nu, int nv);
+  /**
+   * @param u0 u1 uniform in [0, 1)
+   * @param pdf density wrt [0, 1)^2
+   * @param u v the sample
+   */
+  void sample(double u0, double u1, double &pdf, double &u, double &v) const;
+  double pdf(double u, double v) const;
+  // of f on [0, 1)^2, 0 if f is
+  double integral() const { return marginal_.integral(); }
+  bool write(FILE *fp) const;
+  bool read(FILE *fp);
+};
+
+void distribution_2d::build(double const *f, int nu, int nv) {
+  conditional_.resize(nv);
+  parallel_for(0, nv, [&](size_t v) {
+    conditional_[v].build(f + v * nu, nu);
+  });
+  std::vector<double> marginal_func(nv);
+  for (int v = 0; v < nv; v++) marginal_func[v] = conditional_[v].integral();
+  marginal_.build(marginal_func.data(), nv);
+}
+void distribution_2d::sample(double u0, double u1, double &pdf, double &u,
+                             double &v) const {
+  double pdf0, pdf1;
+  int iv, iu;
+  v = marginal_.sample_continuous(u1, pdf1, iv);
+  u = conditional_[iv].sample_continuous(u0, pdf0, iu);
+  pdf = pdf0 * pdf1;
+}
+double distribution_2d::pdf(double u, double v) const {
+  int nu = conditional_[0].count(), nv = marginal_.count();
+  int iu = std::max(0, std::min(nu - 1, static_cast<int>(u * nu)));
+  int iv = std::max(0, std::min(nv - 1, static_cast<int>(v * nv)));
+  if (marginal_.integral() == 0) return 0;
+  return conditional_[iv].func_[iu] / marginal_.integral();
+}
+bool distribution_2d::write(FILE *fp) const {
+  int nv = static_cast<int>(conditional_.size());
+  if (fwrite(&nv, sizeof(nv), 1, fp) != 1) return false;
+  for (auto const &c : conditional_)
+    if (!c.write(fp)) return false;
+  return marginal_.write(fp);
+}
+bool distribution_2d::read(FILE *fp) {
+  int nv;
+  if (fread(&nv, sizeof(nv), 1, fp) != 1 || nv <= 0) return false;
+  conditional_.resize(nv);
+  for (auto &c : conditional_)
+    if (!c.read(fp)) return false;
+  return marginal_.read(fp) && marginal_.count() == nv;
+}
+
+#endif
@@ -1,4 +1,9 @@
+#ifndef IMAGE_UTILS_H
+#define IMAGE_UTILS_H
+
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image/stb_image.h"
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write/stb_image_write.h"
+
+#endif
@@ -21,6 +21,7 @@ class onb {
   }
 
   void build_from_w(const vec3d&);
+  void build_from_unit_w(const vec3d&);
 
  private:
   vec3d axis[3];
@@ -32,5 +33,18 @@ void onb::build_from_w(const vec3d& n) {
   axis[1] = unit_vector(cross(w(), a));
   axis[0] = cross(w(), v());
 }
+/**
+ * n MUST be normalized.
+ * Branchless basis from Duff et al. 2017,
+ * no normalization and no cross product, cheap enough to build per sample
+ */
+void onb::build_from_unit_w(const vec3d& n) {
+  auto sign = std::copysign(1.0, n.z());
+  auto a = -1.0 / (sign + n.z());
+  auto b = n.x() * n.y() * a;
+  axis[0] = vec3d{1.0 + sign * n.x() * n.x() * a, sign * b, -sign * n.x()};
+  axis[1] = vec3d{b, sign + n.y() * n.y() * a, -n.y()};
+  axis[2] = n;
+}
 
 #endif
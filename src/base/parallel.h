@@ -0,0 +1,45 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+// asked once, hardware_concurrency() reads sysfs on every call
+inline int thread_count() {
+  static int const n = std::max(1u, std::thread::hardware_concurrency());
+  return n;
+}
+
+/**
+ * run func(i) for i in [begin, end) on all cores
+ * indices are handed out dynamically, chunk at a time
+ * NOTE: func must not use rand(), it is not thread safe
+ */
+template <typename Func>
+void parallel_for(size_t begin, size_t end, Func func, size_t chunk = 1) {
+  if (end <= begin) return;
+  if (chunk == 0) chunk = 1;
+  size_t n_chunks = (end - begin + chunk - 1) / chunk;
+  size_t n_threads = std::min(static_cast<size_t>(thread_count()), n_chunks);
+  if (n_threads <= 1) {
+    for (size_t i = begin; i < end; i++) func(i);
+    return;
+  }
+  std::atomic<size_t> next{begin};
+  auto worker = [&]() {
+    while (true) {
+      size_t st = next.fetch_add(chunk);
+      if (st >= end) break;
+      size_t ed = std::min(end, st + chunk);
+      for (size_t i = st; i < ed; i++) func(i);
+    }
+  };
+  std::vector<std::thread> pool;
+  for (size_t i = 1; i < n_threads; i++) pool.emplace_back(worker);
+  worker();  // this thread works too
+  for (auto &th : pool) th.join();
+}
+
+#endif
@@ -6,18 +6,35 @@ class ray {
   point3d ori_;
   vec3d dir_;
   double time_;
+  // optional differentials, rays through the neighbouring pixels
+  bool has_diff_;
+  point3d rx_ori_, ry_ori_;
+  vec3d rx_dir_, ry_dir_;
 
  public:
-  ray() {}
+  ray() : has_diff_{false} {}
   // _dir would be used to generate the _unit_ vector
   ray(const point3d& ori, const vec3d& dir, double tm = 0.0)
-      : ori_{ori}, dir_{dir}, time_{tm} {
+      : ori_{ori}, dir_{dir}, time_{tm}, has_diff_{false} {
     // no need for unit vector, would straggle the speed
   }
   // getters
   point3d origin() const { return ori_; }
   vec3d direction() const { return dir_; }
   double time() const { return time_; }
+  bool has_differentials() const { return has_diff_; }
+  point3d rx_origin() const { return rx_ori_; }
+  point3d ry_origin() const { return ry_ori_; }
+  vec3d rx_direction() const { return rx_dir_; }
+  vec3d ry_direction() const { return ry_dir_; }
+  void set_differentials(point3d const& rx_ori, vec3d const& rx_dir,
+                         point3d const& ry_ori, vec3d const& ry_dir) {
+    rx_ori_ = rx_ori;
+    rx_dir_ = rx_dir;
+    ry_ori_ = ry_ori;
+    ry_dir_ = ry_dir;
+    has_diff_ = true;
+  }
   // func
   point3d at(double t) const { return ori_ + t * dir_; }
 };
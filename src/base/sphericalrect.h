@@ -0,0 +1,137 @@
+#ifndef SPHERICAL_RECT_H
+#define SPHERICAL_RECT_H
+
+#include "rt_utils.h"
+#include "vec3d.h"
+
+/**
+ * A rectangle seen from a point, as a spherical quad.
+ * Directions are sampled uniformly in the solid angle,
+ * from Urena et al. 2013, An Area-Preserving Parametrization
+ * for Spherical Rectangles.
+ */
+class spherical_rectangle {
+ private:
+  point3d o_;
+  vec3d x_, y_, z_;  // local frame, z points away from the rectangle
+  double z0_, x0_, y0_, x1_, y1_;
+  double b0_, b1_, b0sq_, k_;
+  double solid_angle_;
+
+ public:
+  /**
+   * @param s  a corner of the rectangle
+   * @param ex one edge from s
+   * @param ey the other edge from s, orthogonal to ex
+   * @param o  the point we look from
+   */
+  spherical_rectangle(point3d const& s, vec3d const& ex, vec3d const& ey,
+                      point3d const& o);
+  double solid_angle() const { return solid_angle_; }
+  /**
+   * map (u, v) in [0, 1)^2 to a point on the rectangle,
+   * uniform in solid angle from o
+   */
+  point3d sample(double u, double v) const;
+};
+
+spherical_rectangle::spherical_rectangle(point3d const& s, vec3d const& ex,
+                                         vec3d const& ey, point3d const& o)
+    : o_{o} {
+  auto exl = ex.norm();
+  auto eyl = ey.norm();
+  x_ = ex / exl;
+  y_ = ey / eyl;
+  z_ = cross(x_, y_);
+  vec3d d = s - o;
+  z0_ = dot(d, z_);
+  // flip z to make it point against the rectangle
+  if (z0_ > 0) {
+    z_ = -z_;
+    z0_ = -z0_;
+  }
+  x0_ = dot(d, x_);
+  y0_ = dot(d, y_);
+  x1_ = x0_ + exl;
+  y1_ = y0_ + eyl;
+  // vertices in the local frame
+  vec3d v00{x0_, y0_, z0_}, v01{x0_, y1_, z0_};
+  vec3d v10{x1_, y0_, z0_}, v11{x1_, y1_, z0_};
+  // normals of the planes through o and each edge
+  auto n0 = unit_vector(cross(v00, v10));
+  auto n1 = unit_vector(cross(v10, v11));
+  auto n2 = unit_vector(cross(v11, v01));
+  auto n3 = unit_vector(cross(v01, v00));
+  // internal angles of the spherical quad
+  auto g0 = acos(clamp(-dot(n0, n1), -1.0, 1.0));
+  auto g1 = acos(clamp(-dot(n1, n2), -1.0, 1.0));
+  auto g2 = acos(clamp(-dot(n2, n3), -1.0, 1.0));
+  auto g3 = acos(clamp(-dot(n3, n0), -1.0, 1.0));
+
+  b0_ = n0.z();
+  b1_ = n2.z();
+  b0sq_ = b0_ * b0_;
+  k_ = 2 * PI - g2 - g3;
+  solid_angle_ = g0 + g1 - k_;
+}
+
+point3d spherical_rectangle::sample(double u, double v) const {
+  // u picks the sub-quad of area u * S, which gives x
+  auto au = u * solid_angle_ + k_;
+  auto fu = (cos(au) * b0_ - b1_) / sin(au);
+  auto cu = (fu > 0 ? 1.0 : -1.0) / sqrt(fu * fu + b0sq_);
+  cu = clamp(cu, -1.0, 1.0);
+  auto xu = -(cu * z0_) / sqrt(1 - cu * cu);
+  xu = clamp(xu, x0_, x1_);
+  // v is uniform in the height of the projected segment, which gives y
+  auto d = sqrt(xu * xu + z0_ * z0_);
+  auto h0 = y0_ / sqrt(d * d + y0_ * y0_);
+  auto h1 = y1_ / sqrt(d * d + y1_ * y1_);
+  auto hv = h0 + v * (h1 - h0);
+  auto hv2 = hv * hv;
+  auto yv = (hv2 < 1 - 1e-6) ? (hv * d) / sqrt(1 - hv2) : y1_;
+
+  return o_ + xu * x_ + yv * y_ + z0_ * z_;
+}
+
+/**
+ * The solid angle sampling is unstable for tiny or nearly hemispherical
+ * rectangles, we sample by area there, as pbrt does.
+ * Both functions below MUST make the same choice.
+ */
+constexpr double SPH_RECT_MIN_SOLID_ANGLE = 3e-4;
+constexpr double SPH_RECT_MAX_SOLID_ANGLE = 6.22;
+inline bool use_solid_angle(double solid_angle) {
+  return solid_angle > SPH_RECT_MIN_SOLID_ANGLE &&
+         solid_angle < SPH_RECT_MAX_SOLID_ANGLE;
+}
+
+/**
+ * pdf of a direction from origin which is known to hit
+ * the rectangle (s, ex, ey) at origin + t * dir
+ */
+inline double rectangle_pdf(point3d const& s, vec3d const& ex,
+                            vec3d const& ey, point3d const& origin,
+                            vec3d const& dir, double t) {
+  spherical_rectangle sq{s, ex, ey, origin};
+  if (use_solid_angle(sq.solid_angle())) return 1 / sq.solid_angle();
+  // by area
+  auto normal = cross(ex, ey);
+  auto area = normal.norm();
+  auto distance_squared = t * t * dir.norm2();
+  auto cosine = fabs(dot(dir, normal) / (area * dir.norm()));
+  return distance_squared / (cosine * area);
+}
+/**
+ * a direction from origin to a point on the rectangle (s, ex, ey)
+ */
+inline vec3d rectangle_sample(point3d const& s, vec3d const& ex,
+                              vec3d const& ey, point3d const& origin) {
+  spherical_rectangle sq{s, ex, ey, origin};
+  auto u = random_double();
+  auto v = random_double();
+  if (use_solid_angle(sq.solid_angle())) return sq.sample(u, v) - origin;
+  return s + u * ex + v * ey - origin;
+}
+
+#endif
@@ -0,0 +1,230 @@
+#ifndef STATS_H
+#define STATS_H
+
+/**
+ * Counters of what a render did, reported when it is done.
+ *
+ * Each thread counts into a block of its own with plain increments,
+ * the blocks are added up by report() and write_json(), or when their
+ * thread ends. Configured with -DSLOWPT_STATS=OFF the STAT_ macros are
+ * empty, nothing is counted and report() says so.
+ */
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+enum stat_counter {
+  STAT_CAMERA_RAYS,
+  STAT_SPECULAR_RAYS,   // mirror and glass bounces
+  STAT_SCATTERED_RAYS,  // sampled from a pdf
+  STAT_TRACED_RAYS,     // of any kind, against the world
+  STAT_ESCAPED_RAYS,    // hit nothing
+  STAT_BVH_NODES,       // bvh nodes visited
+  STAT_BVH_TESTS,       // objects tested in bvh leaves
+  STAT_COUNTER_COUNT
+};
+enum stat_stage {
+  STAGE_LOAD,     // scene files
+  STAGE_BVH,      // builds and refits
+  STAGE_RENDER,   // of images, denoising and writing them included
+  STAGE_DENOISE,  // filtering images after
+  STAGE_WRITE,    // images to files
+  STAGE_COUNT
+};
+
+class render_stats {
+ public:
+  // names of the counters and stages, in report order
+  static char const *const COUNTER_NAMES_[STAT_COUNTER_COUNT];
+  static char const *const STAGE_NAMES_[STAGE_COUNT];
+
+  // counts of one thread or a sum, material names are compared by pointer
+  struct block {
+    uint64_t counts[STAT_COUNTER_COUNT] = {};
+    std::vector<std::pair<char const *, uint64_t>> scatters;
+    void add(block const &other);
+    void scatter(char const *material, uint64_t n) {
+      for (auto &s : scatters)
+        if (s.first == material) {
+          s.second += n;
+          return;
+        }
+      scatters.emplace_back(material, n);
+    }
+  };
+
+  static render_stats &instance() {
+    static render_stats stats;
+    return stats;
+  }
+  static block &local() {
+    static thread_local thread_block b;
+    return b;
+  }
+  void add_time(stat_stage stage, double ms) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ms_[stage] += ms;
+  }
+  // sum over all threads, counting threads must be done
+  uint64_t total(stat_counter c);
+  // counts and times back to zero, for benches
+  void reset();
+  void report(std::ostream &out);
+  bool write_json(char const *path);
+
+ private:
+  // one per counting thread, in live_ while the thread runs
+  struct thread_block : block {
+    thread_block() { instance().attach(this); }
+    ~thread_block() { instance().detach(this); }
+  };
+  std::mutex mutex_;
+  std::vector<block *> live_;
+  block done_;  // of threads that ended
+  double ms_[STAGE_COUNT] = {};
+
+  render_stats() {}
+  void attach(block *b);
+  void detach(block *b);
+  // the sum of done_ and live_
+  block sum();
+};
+char const *const render_stats::COUNTER_NAMES_[STAT_COUNTER_COUNT] = {
+    "camera", "specular", "scattered", "traced",
+    "escaped", "bvh_nodes", "bvh_tests"};
+char const *const render_stats::STAGE_NAMES_[STAGE_COUNT] = {
+    "load", "bvh", "render", "denoise", "write"};
+
+/**
+ * adds the time it lived to a stage,
+ * a scope of its own when there is more than one in a function
+ */
+class stat_timer {
+ private:
+  stat_stage stage_;
+  std::chrono::steady_clock::time_point start_;
+
+ public:
+  stat_timer(stat_stage stage)
+      : stage_{stage}, start_{std::chrono::steady_clock::now()} {}
+  ~stat_timer() {
+    render_stats::instance().add_time(
+        stage_, std::chrono::duration<double, std::milli>(
+                    std::chrono::steady_clock::now() - start_)
+                    .count());
+  }
+};
+
+#ifdef SLOWPT_STATS
+#define STAT_COUNT(counter) (render_stats::local().counts[counter]++)
+#define STAT_ADD(counter, n) (render_stats::local().counts[counter] += (n))
+#define STAT_SCATTER(material, n) (render_stats::local().scatter(material, n))
+#define STAT_TIMER(name, stage) stat_timer name{stage}
+#else
+#define STAT_COUNT(counter)
+#define STAT_ADD(counter, n)
+#define STAT_SCATTER(material, n)
+#define STAT_TIMER(name, stage)
+#endif
+
+void render_stats::block::add(block const &other) {
+  for (int c = 0; c < STAT_COUNTER_COUNT; c++) counts[c] += other.counts[c];
+  for (auto const &s : other.scatters) scatter(s.first, s.second);
+}
+void render_stats::attach(block *b) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  live_.push_back(b);
+}
+void render_stats::detach(block *b) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  done_.add(*b);
+  for (size_t i = 0; i < live_.size(); i++)
+    if (live_[i] == b) {
+      live_[i] = live_.back();
+      live_.pop_back();
+      break;
+    }
+}
+render_stats::block render_stats::sum() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  block total = done_;
+  for (auto b : live_) total.add(*b);
+  return total;
+}
+uint64_t render_stats::total(stat_counter c) { return sum().counts[c]; }
+void render_stats::reset() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto b : live_) *b = block{};
+  done_ = block{};
+  for (auto &ms : ms_) ms = 0;
+}
+void render_stats::report(std::ostream &out) {
+#ifndef SLOWPT_STATS
+  out << "stats: not counted, configure with -DSLOWPT_STATS=ON\n";
+#else
+  auto s = sum();
+  auto const *n = s.counts;
+  auto per = [](uint64_t a, uint64_t b) { return b ? double(a) / b : 0.0; };
+  out << "stats: rays";
+  for (int c = STAT_CAMERA_RAYS; c <= STAT_ESCAPED_RAYS; c++)
+    out << (c == 0 ? " " : ", ") << COUNTER_NAMES_[c] << " " << n[c];
+  out << "\n  path length " << per(n[STAT_TRACED_RAYS], n[STAT_CAMERA_RAYS])
+      << " rays per camera ray\n  bvh "
+      << per(n[STAT_BVH_NODES], n[STAT_TRACED_RAYS]) << " nodes and "
+      << per(n[STAT_BVH_TESTS], n[STAT_TRACED_RAYS])
+      << " object tests per ray\n  scatter";
+  for (size_t i = 0; i < s.scatters.size(); i++)
+    out << (i ? ", " : " ") << s.scatters[i].first << " "
+        << s.scatters[i].second;
+  out << "\n  time";
+  for (int st = 0; st < STAGE_COUNT; st++)
+    out << (st ? ", " : " ") << STAGE_NAMES_[st] << " " << ms_[st] << " ms";
+  out << "\n";
+#endif
+}
+bool render_stats::write_json(char const *path) {
+#ifndef SLOWPT_STATS
+  std::cerr << "ERROR: No stats to write to '" << path
+            << "', configure with -DSLOWPT_STATS=ON.\n";
+  return false;
+#else
+  auto s = sum();
+  auto const *n = s.counts;
+  auto per = [](uint64_t a, uint64_t b) { return b ? double(a) / b : 0.0; };
+  FILE *fp = fopen(path, "w");
+  if (!fp) {
+    std::cerr << "ERROR: Could not write '" << path << "'.\n";
+    return false;
+  }
+  fprintf(fp, "{\n  \"counters\": {");
+  for (int c = 0; c < STAT_COUNTER_COUNT; c++)
+    fprintf(fp, "%s\n    \"%s\": %llu", c ? "," : "", COUNTER_NAMES_[c],
+            static_cast<unsigned long long>(n[c]));
+  fprintf(fp,
+          "\n  },\n  \"path_length\": %.4f,\n  \"bvh_nodes_per_ray\": %.4f,"
+          "\n  \"bvh_tests_per_ray\": %.4f,\n  \"scatter\": {",
+          per(n[STAT_TRACED_RAYS], n[STAT_CAMERA_RAYS]),
+          per(n[STAT_BVH_NODES], n[STAT_TRACED_RAYS]),
+          per(n[STAT_BVH_TESTS], n[STAT_TRACED_RAYS]));
+  for (size_t i = 0; i < s.scatters.size(); i++)
+    fprintf(fp, "%s\n    \"%s\": %llu", i ? "," : "", s.scatters[i].first,
+            static_cast<unsigned long long>(s.scatters[i].second));
+  fprintf(fp, "\n  },\n  \"time_ms\": {");
+  for (int st = 0; st < STAGE_COUNT; st++)
+    fprintf(fp, "%s\n    \"%s\": %.3f", st ? "," : "", STAGE_NAMES_[st],
+            ms_[st]);
+  fprintf(fp, "\n  }\n}\n");
+  if (fclose(fp) != 0) {
+    std::cerr << "ERROR: Could not write '" << path << "'.\n";
+    return false;
+  }
+  return true;
+#endif
+}
+
+#endif
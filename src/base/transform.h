@@ -0,0 +1,190 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include "aabb.h"
+#include "rt_utils.h"
+#include "vec3d.h"
+
+/**
+ * Affine transform, a 3x4 matrix [A | b] taking p to A p + b.
+ * The inverse is kept alongside so neither direction inverts anything.
+ * Composition follows matrices: (a * b) applies b first.
+ */
+class transform {
+ private:
+  double m_[3][4], inv_[3][4];
+
+  transform(double const m[3][4], double const inv[3][4]);
+  static void multiply(double const a[3][4], double const b[3][4],
+                       double out[3][4]);
+
+ public:
+  // identity
+  transform();
+  // the inverse is solved here, m must be invertible
+  explicit transform(double const m[3][4]);
+  static transform translation(vec3d const& offset);
+  static transform scaling(vec3d const& factor);
+  // angle in degrees, counter clockwise looking down the axis
+  static transform rotation(vec3d const& axis, double angle);
+
+  transform operator*(transform const& rhs) const;
+  // element of [A | b]
+  double operator()(int row, int col) const { return m_[row][col]; }
+  transform inverse() const { return transform{inv_, m_}; }
+  bool is_identity() const;
+  // rotation and translation only, lengths and angles are kept
+  bool is_rigid() const;
+
+  point3d point(point3d const& p) const;
+  vec3d vector(vec3d const& v) const;
+  // by the inverse transpose, NOT normalized
+  vec3d normal(vec3d const& n) const;
+  point3d inv_point(point3d const& p) const;
+  vec3d inv_vector(vec3d const& v) const;
+  /**
+   * bounds of the transformed box, Arvo's method:
+   * each output axis takes the min and max of every matrix term
+   */
+  aabb bounds(aabb const& box) const;
+};
+
+transform::transform() {
+  for (int i = 0; i < 3; i++)
+    for (int j = 0; j < 4; j++) m_[i][j] = inv_[i][j] = i == j ? 1 : 0;
+}
+transform::transform(double const m[3][4], double const inv[3][4]) {
+  for (int i = 0; i < 3; i++)
+    for (int j = 0; j < 4; j++) {
+      m_[i][j] = m[i][j];
+      inv_[i][j] = inv[i][j];
+    }
+}
+/**
+ * inverse of A by cofactors, then the translation is -inv(A) b
+ */
+transform::transform(double const m[3][4]) {
+  for (int i = 0; i < 3; i++)
+    for (int j = 0; j < 4; j++) m_[i][j] = m[i][j];
+  auto cof = [&](int r, int c) {
+    int r0 = (r + 1) % 3, r1 = (r + 2) % 3;
+    int c0 = (c + 1) % 3, c1 = (c + 2) % 3;
+    return m[r0][c0] * m[r1][c1] - m[r0][c1] * m[r1][c0];
+  };
+  auto det = m[0][0] * cof(0, 0) + m[0][1] * cof(0, 1) + m[0][2] * cof(0, 2);
+  auto inv_det = 1 / det;
+  for (int i = 0; i < 3; i++)
+    for (int j = 0; j < 3; j++) inv_[i][j] = cof(j, i) * inv_det;
+  for (int i = 0; i < 3; i++)
+    inv_[i][3] = -(inv_[i][0] * m[0][3] + inv_[i][1] * m[1][3] +
+                   inv_[i][2] * m[2][3]);
+}
+transform transform::translation(vec3d const& offset) {
+  transform xf;
+  for (int i = 0; i < 3; i++) {
+    xf.m_[i][3] = offset[i];
+    xf.inv_[i][3] = -offset[i];
+  }
+  return xf;
+}
+transform transform::scaling(vec3d const& factor) {
+  transform xf;
+  for (int i = 0; i < 3; i++) {
+    xf.m_[i][i] = factor[i];
+    xf.inv_[i][i] = 1 / factor[i];
+  }
+  return xf;
+}
+/**
+ * Rodrigues' formula, R = cos I + sin [k]x + (1 - cos) k k^T.
+ * R is orthonormal, the inverse is its transpose.
+ */
+transform transform::rotation(vec3d const& axis, double angle) {
+  auto k = unit_vector(axis);
+  auto radians = deg_to_rad(angle);
+  auto c = cos(radians), s = sin(radians);
+  // clang-format off
+  double cross[3][3] = {{    0, -k[2],  k[1]},
+                        { k[2],     0, -k[0]},
+                        {-k[1],  k[0],     0}};
+  // clang-format on
+  transform xf;
+  for (int i = 0; i < 3; i++)
+    for (int j = 0; j < 3; j++) {
+      xf.m_[i][j] = (i == j ? c : 0) + s * cross[i][j] + (1 - c) * k[i] * k[j];
+      xf.inv_[j][i] = xf.m_[i][j];
+    }
+  return xf;
+}
+void transform::multiply(double const a[3][4], double const b[3][4],
+                         double out[3][4]) {
+  for (int i = 0; i < 3; i++)
+    for (int j = 0; j < 4; j++) {
+      out[i][j] = a[i][0] * b[0][j] + a[i][1] * b[1][j] + a[i][2] * b[2][j];
+      if (j == 3) out[i][j] += a[i][3];
+    }
+}
+transform transform::operator*(transform const& rhs) const {
+  double m[3][4], inv[3][4];
+  multiply(m_, rhs.m_, m);
+  multiply(rhs.inv_, inv_, inv);
+  return transform{m, inv};
+}
+bool transform::is_identity() const {
+  for (int i = 0; i < 3; i++)
+    for (int j = 0; j < 4; j++)
+      if (m_[i][j] != (i == j ? 1 : 0)) return false;
+  return true;
+}
+bool transform::is_rigid() const {
+  // A^T A = I, up to rounding of the factories
+  for (int i = 0; i < 3; i++)
+    for (int j = 0; j < 3; j++) {
+      auto d = m_[0][i] * m_[0][j] + m_[1][i] * m_[1][j] + m_[2][i] * m_[2][j];
+      if (fabs(d - (i == j ? 1 : 0)) > 1e-9) return false;
+    }
+  return true;
+}
+
+point3d transform::point(point3d const& p) const {
+  return point3d{
+      m_[0][0] * p[0] + m_[0][1] * p[1] + m_[0][2] * p[2] + m_[0][3],
+      m_[1][0] * p[0] + m_[1][1] * p[1] + m_[1][2] * p[2] + m_[1][3],
+      m_[2][0] * p[0] + m_[2][1] * p[1] + m_[2][2] * p[2] + m_[2][3]};
+}
+vec3d transform::vector(vec3d const& v) const {
+  return vec3d{m_[0][0] * v[0] + m_[0][1] * v[1] + m_[0][2] * v[2],
+               m_[1][0] * v[0] + m_[1][1] * v[1] + m_[1][2] * v[2],
+               m_[2][0] * v[0] + m_[2][1] * v[1] + m_[2][2] * v[2]};
+}
+vec3d transform::normal(vec3d const& n) const {
+  return vec3d{inv_[0][0] * n[0] + inv_[1][0] * n[1] + inv_[2][0] * n[2],
+               inv_[0][1] * n[0] + inv_[1][1] * n[1] + inv_[2][1] * n[2],
+               inv_[0][2] * n[0] + inv_[1][2] * n[1] + inv_[2][2] * n[2]};
+}
+point3d transform::inv_point(point3d const& p) const {
+  return point3d{
+      inv_[0][0] * p[0] + inv_[0][1] * p[1] + inv_[0][2] * p[2] + inv_[0][3],
+      inv_[1][0] * p[0] + inv_[1][1] * p[1] + inv_[1][2] * p[2] + inv_[1][3],
+      inv_[2][0] * p[0] + inv_[2][1] * p[1] + inv_[2][2] * p[2] + inv_[2][3]};
+}
+vec3d transform::inv_vector(vec3d const& v) const {
+  return vec3d{inv_[0][0] * v[0] + inv_[0][1] * v[1] + inv_[0][2] * v[2],
+               inv_[1][0] * v[0] + inv_[1][1] * v[1] + inv_[1][2] * v[2],
+               inv_[2][0] * v[0] + inv_[2][1] * v[1] + inv_[2][2] * v[2]};
+}
+aabb transform::bounds(aabb const& box) const {
+  point3d lo, hi;
+  for (int i = 0; i < 3; i++) {
+    lo[i] = hi[i] = m_[i][3];
+    for (int j = 0; j < 3; j++) {
+      auto a = m_[i][j] * box.min()[j];
+      auto b = m_[i][j] * box.max()[j];
+      lo[i] += fmin(a, b);
+      hi[i] += fmax(a, b);
+    }
+  }
+  return aabb{lo, hi};
+}
+
+#endif
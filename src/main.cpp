@@ -3,259 +3,303 @@ in windows
 .\build\slowpt.exe 2 | Out-File ./image.ppm -Encoding ascii
 in linux
 ./build/slowpt > out.ppm
+./build/slowpt scenes/cornell.scene out.jpg
+
+the scene is a file (see src/scene/sceneparser.h for the format),
+a binary scene written by sceneconv, or an index 0-12 of one under scenes/
+
+options, anywhere after the program name
+  --env <image>  light the scene with a lat-long environment map
+  --wavefront    trace a row of samples together, shading sorted by material
+  --frames <first>:<last>
+                 render the keyframed frames as <path>_NNNN.jpg,
+                 <path> is the output path without extension or frame
+  --bvh-cache <dir>
+                 keep the bvh of a still in <dir>, keyed by the scene
+                 bounds, and map it instead of building when it matches
+  --stats <file.json>
+                 also write the counters summed up at the end as json
+  --aov          also write albedo, normal, depth, time, bvh steps and
+                 bounces per pixel as <image>_<aov>.hdr, see src/render/aov.h,
+                 <image> is the output path without extension or "image"
+  --denoise <strength>
+                 filter the noise out after rendering, guided by albedo,
+                 normal and depth, see src/render/denoise.h, 1 is a good
+                 start and larger is smoother
 */
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <ctime>
 #include <iomanip>
 #include <iostream>
+#include <string>
 #include <vector>
 
+#include "animation.h"
+#include "aov.h"
 #include "baseobject.h"
 #include "bvh.h"
 #include "camera.h"
 #include "colorRGB.h"
+#include "denoise.h"
+#include "flatbvh.h"
+#include "integrator.h"
 #include "objectlist.h"
-#include "prefabs.h"
 #include "rt_utils.h"
 #include "pdf.h"
+#include "sceneparser.h"
+#include "stats.h"
 constexpr int PPM_OUT = 0;
 constexpr int JPG_OUT = 1;
-/**
- * cast a ray to the world and get its color
- */
-color_rgb ray_color(ray const &r_in, color_rgb const &background,
-                    base_object const &world, shared_ptr<base_object> lights,
-                    int bounce_depth) {
-  hit_record h_rec;
-
-  // if ray reaches max bounce it gets nothing
-  if (bounce_depth <= 0) return color_rgb{0, 0, 0};
-  // if ray does not hit anything it gets backround color
-  if (!world.hit(r_in, 0.001, INF_DBL, h_rec)) return background;
-
-  scatter_record s_rec;
-  color_rgb emit_color =
-      h_rec.mat_ptr->emit(r_in, h_rec, h_rec.u, h_rec.v, h_rec.p);
-
-  // if the material scatters light this ray gets scatter and emit
-  if (!h_rec.mat_ptr->scatter(r_in, h_rec, s_rec)) return emit_color;
-
-  // clang-format off
-  if (s_rec.is_specular) {
-    return s_rec.attenuation
-            * ray_color(s_rec.ray_specular, background, world,
-                        lights,             bounce_depth - 1);
-  }
-  // clang-format on
-
-  auto light_pdf_ptr = make_shared<obj_pdf>(lights, h_rec.p);
-  // mixture importance sampling
-  mixture_pdf sample_pdf{light_pdf_ptr, s_rec.pdf_ptr, -0.5};
-
-  ray scattered = ray{h_rec.p, sample_pdf.generate(r_in.time()), r_in.time()};
-  auto sample_pdf_val = sample_pdf.value(scattered.direction());
-
-  // clang-format off
-  return emit_color
-         + s_rec.attenuation
-            * h_rec.mat_ptr->scatter_pdf(r_in, h_rec, scattered)
-            * ray_color(scattered, background, world,
-                        lights,    bounce_depth - 1) / sample_pdf_val;
-  // clang-format on
+// paths traced together by --wavefront
+constexpr int WAVEFRONT_SIZE = 1 << 16;
+// animation refits the bvh until it is this much looser than when built
+constexpr double REBUILD_AREA_RATIO = 1.5;
+// path without the extension of its file name
+std::string strip_extension(std::string path) {
+  auto dot = path.rfind('.'), slash = path.rfind('/');
+  if (dot != std::string::npos && (slash == std::string::npos || dot > slash))
+    path.erase(dot);
+  return path;
 }
 int main(int argc, char *argv[]) {
-  int scene_idx = 0;
-  char *path;
+  char *path = nullptr;
   int OUT_FORMAT = PPM_OUT;
-  if (argc > 1) {
-    scene_idx = atoi(argv[1]);
-    std::cout << "Scene index: " << scene_idx << std::endl;
+  char const *env_path = nullptr;
+  bool wavefront = false;
+  int first_frame = 0, last_frame = -1;  // no animation
+  char *bvh_cache_dir = nullptr;
+  char const *stats_path = nullptr;
+  bool aov = false;
+  double denoise = 0;  // strength, 0 is off
+  auto startup = std::chrono::steady_clock::now();
+  // split options from positional arguments
+  std::vector<char *> args;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--env") == 0 && i + 1 < argc)
+      env_path = argv[++i];
+    else if (strcmp(argv[i], "--wavefront") == 0)
+      wavefront = true;
+    else if (strcmp(argv[i], "--bvh-cache") == 0 && i + 1 < argc)
+      bvh_cache_dir = argv[++i];
+    else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc)
+      stats_path = argv[++i];
+    else if (strcmp(argv[i], "--aov") == 0)
+      aov = true;
+    else if (strcmp(argv[i], "--denoise") == 0 && i + 1 < argc)
+      denoise = std::max(0.0, atof(argv[++i]));
+    else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+      if (sscanf(argv[++i], "%d:%d", &first_frame, &last_frame) != 2)
+        last_frame = first_frame;
+    }
+    else
+      args.push_back(argv[i]);
   }
-  if (argc > 2) {
-    path = argv[2];
+  // a scene file, or one of the old scene indices
+  std::string scene_path = "scenes/one_sphere.scene";
+  if (args.size() > 0) {
+    char *end;
+    long idx = strtol(args[0], &end, 10);
+    if (*end)
+      scene_path = args[0];
+    else if (idx >= 0 && idx < NUM_SCENE_FILES)
+      scene_path = std::string("scenes/") + SCENE_FILES[idx] + ".scene";
+    std::cout << "Scene: " << scene_path << std::endl;
+  }
+  if (args.size() > 1) {
+    path = args[1];
     OUT_FORMAT = JPG_OUT;
     std::cout << "Output as jpg" << std::endl;
   }
 
   std::srand(std::time(nullptr));
+  scene sc;
+  {
+    STAT_TIMER(load_timer, STAGE_LOAD);
+    if (!scene_parser::load(scene_path.c_str(), sc)) return 1;
+  }
   /******** Image config ********/
-  double aspect_ratio = 16.0 / 9.0;
-  int image_w = 400;
-  int spp = 100;
-  int max_bounce = 20;
-  color_rgb background_color{0, 0, 0};
+  double aspect_ratio = sc.aspect_ratio;
+  int image_w = sc.image_w;
+  int spp = sc.spp;
+  int max_bounce = sc.max_bounce;
+  color_rgb background_color = sc.background;
 
   /******** Objects wolrd ********/
-  object_list world;
-  auto lights = make_shared<object_list>();
+  object_list &world = sc.world;
+  animation &anim = sc.anim;
   /******** Camera ********/
-  point3d lookfrom{13, 2, 3};
-  point3d lookat{0, 0, 0};
-  vec3d vup{0, 1, 0};
-  auto dist_to_focus = 10.0;
-  auto aperture = 0.0;
-  auto apt_open = 0.0, apt_close = 1.0;
-  auto vfov = 40.0;
-  switch (scene_idx) {
-    case 1:
-      world = random_scene();
-      lookfrom = point3d(13, 2, 3);
-      lookat = point3d(0, 0, 0);
-      vfov = 20.0;
-      aperture = 0.1;
-      background_color = color_rgb{0.7, 0.8, 1.0};
-      break;
-    case 2:
-      world = two_spheres();
-      lookfrom = point3d(13, 2, 3);
-      lookat = point3d(0, 0, 0);
-      vfov = 20.0;
-      background_color = color_rgb{0.7, 0.8, 1.0};
-      break;
-    case 3:
-      world = two_perlin_spheres();
-      lookfrom = point3d(13, 2, 3);
-      lookat = point3d(0, 0, 0);
-      vfov = 20.0;
-      background_color = color_rgb{0.7, 0.8, 1.0};
-      break;
-      break;
-    case 5:
-      world = simple_light();
-      background_color = color_rgb{0, 0, 0};
-      lookfrom = point3d(26, 3, 6);
-      lookat = point3d(0, 2, 0);
-      vfov = 20.0;
-      break;
-    case 6:
-      world = cornell_box();
-      lights->add(make_shared<xz_rectangle>(213, 343, 227, 332, 554,
-                                            shared_ptr<base_material>()));
-      lights->add(make_shared<sphere>(point3d{190, 190, 190}, 90,
-                                      shared_ptr<base_material>()));
-
-      aspect_ratio = 1.0;
-      image_w = 500;
-      spp = 2000;
-      max_bounce = 50;
-      background_color = color_rgb(0, 0, 0);
-
-      lookfrom = point3d(278, 278, -800);
-      lookat = point3d(278, 278, 0);
-      vup = vec3d{0, 1, 0};
-      dist_to_focus = 10.0;
-      aperture = 0.0;
-      vfov = 40.0;
-
-      apt_open = 0.0;
-      apt_close = 1.0;
-      break;
-    case 7:
-      world = cornell_smoke();
-      lights->add(make_shared<xz_rectangle>(113, 443, 127, 432, 554,
-                                            shared_ptr<base_material>()));
-
-      aspect_ratio = 1.0;
-      image_w = 500;
-      spp = 200;
-      max_bounce = 50;
-      background_color = color_rgb(0, 0, 0);
-
-      lookfrom = point3d(278, 278, -800);
-      lookat = point3d(278, 278, 0);
-      vup = vec3d{0, 1, 0};
-      dist_to_focus = 10.0;
-      aperture = 0.0;
-      vfov = 40.0;
-
-      apt_open = 0.0;
-      apt_close = 1.0;
-      break;
-    case 8:
-      world = final_scene();
-      aspect_ratio = 1.0;
-      image_w = 800;
-      spp = 10000;
-      max_bounce = 50;
-      background_color = color_rgb(0, 0, 0);
-      lookfrom = point3d(478, 278, -600);
-      lookat = point3d(278, 278, 0);
-      vfov = 40.0;
-      break;
-    case 9:
-      world = earth();
-      lookfrom = point3d{13, 2, 3};
-      lookat = point3d{0, 0, 0};
-      background_color = color_rgb(0, 0, 0);
-      vfov = 40.0;
-      break;
-    case 10:
-      world = cornell_glass();
-      lights->add(make_shared<xz_rectangle>(213, 343, 227, 332, 554,
-                                            shared_ptr<base_material>()));
-      lights->add(make_shared<sphere>(point3d{190, 190, 190}, 90,
-                                      shared_ptr<base_material>()));
-
-      aspect_ratio = 1.0;
-      image_w = 800;
-      spp = 4000;
-      max_bounce = 50;
-      background_color = color_rgb(0, 0, 0);
-
-      lookfrom = point3d(278, 278, -800);
-      lookat = point3d(278, 278, 0);
-      vup = vec3d{0, 1, 0};
-      dist_to_focus = 10.0;
-      aperture = 0.0;
-      vfov = 40.0;
-
-      apt_open = 0.0;
-      apt_close = 1.0;
-      break;
-    default:
-      world = one_sphere();
-      lookfrom = point3d{13, 2, 3};
-      lookat = point3d{0, 0, 0};
-      vfov = 20.0;
-      background_color = color_rgb{1.0, 1.0, 1.0};
-  }
-  int image_h = static_cast<int>(image_w / aspect_ratio);
-  camera cam{lookfrom, lookat,        vup,      vfov,     aspect_ratio,
-             aperture, dist_to_focus, apt_open, apt_close};
+  point3d lookfrom = sc.lookfrom;
+  point3d lookat = sc.lookat;
+  vec3d vup = sc.vup;
+  auto dist_to_focus = sc.dist_to_focus;
+  auto aperture = sc.aperture;
+  auto apt_open = sc.time0, apt_close = sc.time1;
+  auto vfov = sc.vfov;
+  // --env wins over the scene's environment
+  if (env_path) sc.env_path = env_path;
 
   /******** Render ********/
-  bvh_node world_bvh{world, apt_open, apt_close};
-
-  char *data;
-  if (OUT_FORMAT == JPG_OUT)
-    data = (char *)malloc(image_w * image_h * 3 * sizeof(char));
-  else
-    std::cout << "P3\n" << image_w << ' ' << image_h << "\n255\n";
+  /**
+   * animation refits a bvh_node in place, stills may
+   * map a flat tree from the cache instead
+   */
+  bool animated = last_frame >= first_frame;
+  if (bvh_cache_dir && animated)
+    std::cerr << "--bvh-cache is ignored when rendering frames\n";
+  bool cached = bvh_cache_dir && !animated;
+  auto still = prepare_still(sc, !cached);
+  shared_ptr<flat_bvh> world_flat;
+  if (cached) {
+    STAT_TIMER(bvh_timer, STAGE_BVH);
+    world_flat = make_shared<flat_bvh>(world.objects_, apt_open, apt_close,
+                                       bvh_cache_dir);
+  }
+  base_object const &world_accel =
+      world_flat ? static_cast<base_object const &>(*world_flat)
+                 : *still.world;
+  std::cerr << "Startup: scene and bvh ready after "
+            << std::chrono::duration<double, std::milli>(
+                   std::chrono::steady_clock::now() - startup)
+                   .count()
+            << " ms\n";
+  int image_h = still.image_h;
+  auto ds = still.ds, dt = still.dt;
+  auto env = still.env;
+  auto lights = still.lights;
 
-  for (int i = image_h - 1; i >= 0; i--) {
-    std::cerr << "\rScanlines remaining: " << std::setw(3) << i << "/"
-              << image_h << std::flush;
-    for (int j = 0; j < image_w; j++) {
-      color_rgb pixel_color{0, 0, 0};  // sample a pixel
-      for (int si = 0; si < spp; si++) {
-        auto u = (j + random_double()) / (image_w - 1);
-        auto v = (i + random_double()) / (image_h - 1);
-        ray r = cam.ray_at(u, v);
-        pixel_color +=
-            ray_color(r, background_color, world_bvh, lights, max_bounce);
+  wavefront_integrator wavefront_tracer{background_color, env.get(),
+                                        world_accel, lights, max_bounce};
+  std::vector<ray> rays;
+  std::vector<color_rgb> radiance;
+  std::vector<first_hit> first_hits;
+  // one image, as jpg to out_path or as ppm to stdout
+  auto render = [&](camera &cam, char const *out_path) {
+    STAT_TIMER(render_timer, STAGE_RENDER);
+    std::unique_ptr<aov_buffers> aovs;
+    if (aov) aovs.reset(new aov_buffers{image_w, image_h, !wavefront});
+    std::unique_ptr<denoiser> filter;
+    if (denoise > 0) filter.reset(new denoiser{image_w, image_h});
+    bool want_first = aovs || filter;
+    first_hit first;
+    // sum of the samples of each pixel, rows from the top
+    std::vector<color_rgb> sums(size_t(image_w) * image_h, color_rgb{0, 0, 0});
+    for (int i = image_h - 1; i >= 0; i--) {
+      std::cerr << "\rScanlines remaining: " << std::setw(3) << i << "/"
+                << image_h << std::flush;
+      int y = image_h - 1 - i;
+      color_rgb *row = &sums[size_t(y) * image_w];
+      if (wavefront) {
+        // as many samples per pixel per pass as fit in a wavefront
+        int pass_spp = std::max(1, std::min(spp, WAVEFRONT_SIZE / image_w));
+        for (int s0 = 0; s0 < spp; s0 += pass_spp) {
+          int ns = std::min(pass_spp, spp - s0);
+          rays.clear();
+          for (int j = 0; j < image_w; j++) {
+            for (int si = 0; si < ns; si++) {
+              auto u = (j + random_double()) / (image_w - 1);
+              auto v = (i + random_double()) / (image_h - 1);
+              rays.push_back(cam.ray_at(u, v, ds, dt));
+            }
+          }
+          STAT_ADD(STAT_CAMERA_RAYS, rays.size());
+          wavefront_tracer.trace(rays, radiance,
+                                 want_first ? &first_hits : nullptr);
+          for (size_t k = 0; k < radiance.size(); k++) {
+            row[k / ns] += radiance[k];
+            if (aovs) aovs->add(int(k / ns), y, first_hits[k], spp);
+            if (filter) filter->add(int(k / ns), y, radiance[k], first_hits[k]);
+          }
+        }
+        continue;
+      }
+      for (int j = 0; j < image_w; j++) {
+        if (aovs) aovs->begin_pixel();
+        for (int si = 0; si < spp; si++) {
+          auto u = (j + random_double()) / (image_w - 1);
+          auto v = (i + random_double()) / (image_h - 1);
+          ray r = cam.ray_at(u, v, ds, dt);
+          STAT_COUNT(STAT_CAMERA_RAYS);
+          auto c = ray_color(r, background_color, env.get(), world_accel,
+                             lights, max_bounce, want_first ? &first : nullptr);
+          row[j] += c;
+          if (aovs) aovs->add(j, y, first, spp);
+          if (filter) filter->add(j, y, c, first);
+        }
+        if (aovs) aovs->end_pixel(j, y, spp);
       }
-      if (OUT_FORMAT == JPG_OUT)
-        // index correction
-        write_color(data, pixel_color, spp, image_w, image_h, (image_h - 1 - i),
-                    j);
-      else
+    }
+    if (filter) {
+      STAT_TIMER(denoise_timer, STAGE_DENOISE);
+      std::cerr << "\nDenoising";
+      filter->run(sums, spp, denoise);
+    }
+    if (out_path) {
+      STAT_TIMER(write_timer, STAGE_WRITE);
+      std::cerr << "\nWriting into " << out_path;
+      std::vector<char> data(size_t(image_w) * image_h * 3);
+      for (int y = 0; y < image_h; y++)
+        for (int j = 0; j < image_w; j++)
+          write_color(data.data(), sums[size_t(y) * image_w + j], spp, image_w,
+                      image_h, y, j);
+      stbi_write_jpg(out_path, image_w, image_h, 3, data.data(), 95);
+    } else {
+      std::cout << "P3\n" << image_w << ' ' << image_h << "\n255\n";
+      for (auto const &pixel_color : sums)
         write_color(std::cout, pixel_color, spp);
     }
+    if (aovs) {
+      STAT_TIMER(write_timer, STAGE_WRITE);
+      std::string prefix = out_path ? strip_extension(out_path) : "image";
+      std::cerr << "\nWriting aovs into " << prefix << "_*.hdr";
+      aovs->write(prefix);
+    }
+    std::cerr << "\n";
+  };
+
+  if (!animated) render(*still.cam, OUT_FORMAT == JPG_OUT ? path : nullptr);
+  /**
+   * Only transforms change between frames, so the bvh is refit
+   * and rebuilt only once it got too loose. The nested bvhs stay
+   * refit, a rebuild sorts the top level objects again.
+   */
+  double built_area = animated ? still.world->area_sum() : 0;
+  for (int frame = first_frame; frame <= last_frame; frame++) {
+    auto start = std::chrono::steady_clock::now();
+    bool rebuild;
+    {
+      STAT_TIMER(bvh_timer, STAGE_BVH);
+      anim.apply(frame);
+      still.world->refit();
+      rebuild = still.world->area_sum() > REBUILD_AREA_RATIO * built_area;
+      if (rebuild) {
+        *still.world = bvh_node{world, apt_open, apt_close};
+        built_area = still.world->area_sum();
+      }
+    }
+    auto ms = std::chrono::duration<double, std::milli>(
+                  std::chrono::steady_clock::now() - start)
+                  .count();
+    std::cerr << "Frame " << frame << ": bvh " << (rebuild ? "rebuilt" : "refit")
+              << " in " << ms << " ms\n";
+    if (anim.has_camera()) {
+      auto key = anim.camera_at(frame);
+      lookfrom = key.lookfrom;
+      lookat = key.lookat;
+      vfov = key.vfov;
+    }
+    camera cam{lookfrom, lookat,        vup,      vfov,     aspect_ratio,
+               aperture, dist_to_focus, apt_open, apt_close};
+    char frame_path[512];
+    snprintf(frame_path, sizeof(frame_path), "%s_%04d.jpg",
+             args.size() > 1 ? strip_extension(path).c_str() : "frame", frame);
+    render(cam, frame_path);
   }
-  if (OUT_FORMAT == JPG_OUT) {
-    std::cerr << "\nWriting into " << path;
-    stbi_write_jpg(path, image_w, image_h, 3, data, 95);
-    free(data);
-  }
-  std::cerr << "\nDone.\n";
+  tex_cache::instance().report(std::cerr);
+  render_stats::instance().report(std::cerr);
+  if (stats_path && !render_stats::instance().write_json(stats_path)) return 1;
+  std::cerr << "Done.\n";
   return 0;
 }
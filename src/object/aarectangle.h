@@ -3,6 +3,7 @@
 
 #include "baseobject.h"
 #include "rt_utils.h"
+#include "sphericalrect.h"
 
 class xy_rectangle : public base_object {
  private:
@@ -45,6 +46,9 @@ class xy_rectangle : public base_object {
     if (x < x0_ || x > x1_ || y < y0_ || y > y1_) return false;
     rec.u = (x - x0_) / (x1_ - x0_);
     rec.v = (y - y0_) / (y1_ - y0_);
+    rec.dpdu = vec3d{x1_ - x0_, 0, 0};
+    rec.dpdv = vec3d{0, y1_ - y0_, 0};
+    rec.dndu = rec.dndv = vec3d{0, 0, 0};
     rec.t = t;
     auto outward_normal = normal_;
     rec.set_face_normal(r, outward_normal);
@@ -60,21 +64,23 @@ class xy_rectangle : public base_object {
     return true;
   }
 
-  virtual double pdf_value(point3d const& origin,
-                           vec3d const& dir) const override {
-    hit_record rec;
-    if (!this->hit(ray(origin, dir), 0.001, INF_DBL, rec)) return 0;
-
-    auto area = (x1_ - x0_) * (y1_ - y0_);
-    auto distance_squared = rec.t * rec.t * dir.norm2();
-    auto cosine = fabs(dot(dir, rec.normal) / dir.norm());
-
-    return distance_squared / (cosine * area);
+  /**
+   * Sampled uniformly in solid angle, see sphericalrect.h.
+   * Only the plane is intersected to check the direction.
+   */
+  virtual double pdf_value(point3d const& origin, vec3d const& dir,
+                           double t) const override {
+    auto hit_t = (z_ - origin.z()) / dir.z();
+    if (!(hit_t >= 0.001 && hit_t < INF_DBL)) return 0;
+    auto x = origin.x() + hit_t * dir.x();
+    auto y = origin.y() + hit_t * dir.y();
+    if (!(x >= x0_ && x <= x1_ && y >= y0_ && y <= y1_)) return 0;
+    return rectangle_pdf(point3d{x0_, y0_, z_}, vec3d{x1_ - x0_, 0, 0},
+                         vec3d{0, y1_ - y0_, 0}, origin, dir, hit_t);
   }
   virtual vec3d random_sample(point3d const& origin, double t) const override {
-    auto random_point =
-        point3d{random_double(x0_, x1_), random_double(y0_, y1_), z_};
-    return random_point - origin;
+    return rectangle_sample(point3d{x0_, y0_, z_}, vec3d{x1_ - x0_, 0, 0},
+                            vec3d{0, y1_ - y0_, 0}, origin);
   }
 };
 class xz_rectangle : public base_object {
@@ -118,6 +124,9 @@ class xz_rectangle : public base_object {
     if (x < x0_ || x > x1_ || z < z0_ || z > z1_) return false;
     rec.u = (x - x0_) / (x1_ - x0_);
     rec.v = (z - z0_) / (z1_ - z0_);
+    rec.dpdu = vec3d{x1_ - x0_, 0, 0};
+    rec.dpdv = vec3d{0, 0, z1_ - z0_};
+    rec.dndu = rec.dndv = vec3d{0, 0, 0};
     rec.t = t;
     auto outward_normal = normal_;
     rec.set_face_normal(r, outward_normal);
@@ -132,22 +141,19 @@ class xz_rectangle : public base_object {
         aabb{point3d{x0_, y_ - 0.0001, z0_}, point3d{x1_, y_ + 0.0001, z1_}};
     return true;
   }
-  virtual double pdf_value(point3d const& origin,
-                           vec3d const& dir) const override {
-    hit_record rec;
-    if (!this->hit(ray(origin, dir), 0.001, INF_DBL, rec)) return 0;
-
-    auto area = (x1_ - x0_) * (z1_ - z0_);
-    auto distance_squared = rec.t * rec.t * dir.norm2();
-    auto cosine = fabs(dot(dir, rec.normal) / dir.norm());
-
-    return distance_squared / (cosine * area);
+  virtual double pdf_value(point3d const& origin, vec3d const& dir,
+                           double t) const override {
+    auto hit_t = (y_ - origin.y()) / dir.y();
+    if (!(hit_t >= 0.001 && hit_t < INF_DBL)) return 0;
+    auto x = origin.x() + hit_t * dir.x();
+    auto z = origin.z() + hit_t * dir.z();
+    if (!(x >= x0_ && x <= x1_ && z >= z0_ && z <= z1_)) return 0;
+    return rectangle_pdf(point3d{x0_, y_, z0_}, vec3d{x1_ - x0_, 0, 0},
+                         vec3d{0, 0, z1_ - z0_}, origin, dir, hit_t);
   }
-
   virtual vec3d random_sample(point3d const& origin, double t) const override {
-    auto random_point =
-        point3d{random_double(x0_, x1_), y_, random_double(z0_, z1_)};
-    return random_point - origin;
+    return rectangle_sample(point3d{x0_, y_, z0_}, vec3d{x1_ - x0_, 0, 0},
+                            vec3d{0, 0, z1_ - z0_}, origin);
   }
 };
 class yz_rectangle : public base_object {
@@ -191,6 +197,9 @@ class yz_rectangle : public base_object {
     if (y < y0_ || y > y1_ || z < z0_ || z > z1_) return false;
     rec.u = (y - y0_) / (y1_ - y0_);
     rec.v = (z - z0_) / (z1_ - z0_);
+    rec.dpdu = vec3d{0, y1_ - y0_, 0};
+    rec.dpdv = vec3d{0, 0, z1_ - z0_};
+    rec.dndu = rec.dndv = vec3d{0, 0, 0};
     rec.t = t;
     auto outward_normal = this->normal_;
     rec.set_face_normal(r, outward_normal);
@@ -206,21 +215,19 @@ class yz_rectangle : public base_object {
     return true;
   }
 
-  virtual double pdf_value(point3d const& origin,
-                           vec3d const& dir) const override {
-    hit_record rec;
-    if (!this->hit(ray(origin, dir), 0.001, INF_DBL, rec)) return 0;
-
-    auto area = (y1_ - y0_) * (z1_ - z0_);
-    auto distance_squared = rec.t * rec.t * dir.norm2();
-    auto cosine = fabs(dot(dir, rec.normal) / dir.norm());
-
-    return distance_squared / (cosine * area);
+  virtual double pdf_value(point3d const& origin, vec3d const& dir,
+                           double t) const override {
+    auto hit_t = (x_ - origin.x()) / dir.x();
+    if (!(hit_t >= 0.001 && hit_t < INF_DBL)) return 0;
+    auto y = origin.y() + hit_t * dir.y();
+    auto z = origin.z() + hit_t * dir.z();
+    if (!(y >= y0_ && y <= y1_ && z >= z0_ && z <= z1_)) return 0;
+    return rectangle_pdf(point3d{x_, y0_, z0_}, vec3d{0, y1_ - y0_, 0},
+                         vec3d{0, 0, z1_ - z0_}, origin, dir, hit_t);
   }
   virtual vec3d random_sample(point3d const& origin, double t) const override {
-    auto random_point =
-        point3d{x_, random_double(y0_, y1_), random_double(z0_, z1_)};
-    return random_point - origin;
+    return rectangle_sample(point3d{x_, y0_, z0_}, vec3d{0, y1_ - y0_, 0},
+                            vec3d{0, 0, z1_ - z0_}, origin);
   }
 };
 
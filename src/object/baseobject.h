@@ -3,6 +3,7 @@
 #include "aabb.h"
 #include "ray.h"
 #include "rt_utils.h"
+#include "transform.h"
 class base_material;
 struct hit_record {
   double t;                                // time ray hit an object
@@ -11,6 +12,12 @@ struct hit_record {
   bool front_face;  // true if ray comes from outside of object
   point3d p;        // hit point
   vec3d normal;     // normal, always points against ray
+  // partial derivatives of p and the OUTWARD normal on uv, set in hit()
+  vec3d dpdu, dpdv;
+  vec3d dndu, dndv;
+  // screen space differentials, set in compute_differentials()
+  vec3d dpdx, dpdy;
+  double dudx, dvdx, dudy, dvdy;
   /**
    * The normal is always point to where ray comes
    * So we need to know the ray hit object at inside or outside
@@ -19,7 +26,56 @@ struct hit_record {
     front_face = dot(r.direction(), outward_normal) < 0;
     normal = front_face ? outward_normal : -outward_normal;
   }
+  void compute_differentials(ray const& r);
+  // derivatives of the facing normal in screen space
+  vec3d dndx() const {
+    auto dn = dndu * dudx + dndv * dvdx;
+    return front_face ? dn : -dn;
+  }
+  vec3d dndy() const {
+    auto dn = dndu * dudy + dndv * dvdy;
+    return front_face ? dn : -dn;
+  }
 };
+/**
+ * Intersect the offset rays with the tangent plane at p,
+ * then solve dp = dpdu * du + dpdv * dv in least squares
+ * on the two axes the normal is least aligned with.
+ * Without differentials everything is zero, a point sample.
+ */
+void hit_record::compute_differentials(ray const& r) {
+  dpdx = dpdy = vec3d{0, 0, 0};
+  dudx = dvdx = dudy = dvdy = 0;
+  if (!r.has_differentials()) return;
+  auto d = dot(normal, p);
+  auto tx = -(dot(normal, r.rx_origin()) - d) / dot(normal, r.rx_direction());
+  auto ty = -(dot(normal, r.ry_origin()) - d) / dot(normal, r.ry_direction());
+  if (!std::isfinite(tx) || !std::isfinite(ty)) return;
+  dpdx = r.rx_origin() + tx * r.rx_direction() - p;
+  dpdy = r.ry_origin() + ty * r.ry_direction() - p;
+
+  int dim0 = 0, dim1 = 1;
+  if (fabs(normal.x()) > fabs(normal.y()) &&
+      fabs(normal.x()) > fabs(normal.z())) {
+    dim0 = 1;
+    dim1 = 2;
+  } else if (fabs(normal.y()) > fabs(normal.z())) {
+    dim0 = 0;
+    dim1 = 2;
+  }
+  auto a00 = dpdu[dim0], a01 = dpdv[dim0];
+  auto a10 = dpdu[dim1], a11 = dpdv[dim1];
+  auto det = a00 * a11 - a01 * a10;
+  if (fabs(det) < 1e-12) return;
+  auto solve = [&](vec3d const& b, double& du, double& dv) {
+    du = (a11 * b[dim0] - a01 * b[dim1]) / det;
+    dv = (a00 * b[dim1] - a10 * b[dim0]) / det;
+    if (!std::isfinite(du)) du = 0;
+    if (!std::isfinite(dv)) dv = 0;
+  };
+  solve(dpdx, dudx, dvdx);
+  solve(dpdy, dudy, dvdy);
+}
 class base_object {
  private:
  public:
@@ -31,130 +87,111 @@ class base_object {
   virtual bool hit(const ray& r, double t_min, double t_max,
                    hit_record& rec) const = 0;
   virtual bool bounding_box(double tm0, double tm1, aabb& buf_aabb) const = 0;
-  // TODO pdf_value() and random_sample() are only implemented
-  //      in class xz_rectangle, need to copy for more complement
-  virtual double pdf_value(point3d const &origin, vec3d const &direction) const {
+  // pdf_value() and random_sample() are implemented by objects
+  // that can be sampled as lights, t is the time of the ray
+  virtual double pdf_value(point3d const &origin, vec3d const &direction,
+                           double t) const {
     return 0.0;
   }
   virtual vec3d random_sample(vec3d const &origin, double t) const {
     return vec3d{1, 0, 0};
   }
+  // bounds of whatever is inside changed, see bvh_node::refit()
+  virtual void refit() {}
 };
 
-class translate : public base_object {
-  // Instead of moving the objects,
-  // we move the rays
+/**
+ * An object placed by an affine transform.
+ * Instead of moving the object, we move the rays into its space
+ * and the hit record back out, once for the whole transform.
+ * Wrapping another instance collapses the two into one,
+ * so stacked translate/rotate_y cost a single matrix.
+ * An animated instance, one set_transform() was called on,
+ * is never collapsed into its wrapper.
+ */
+class transform_instance : public base_object {
  private:
   shared_ptr<base_object> obj_ptr_;
-  vec3d offset_;
+  transform xf_;  // object to world
+  bool rigid_;    // normals can skip the inverse transpose
+  bool animated_;
 
  public:
-  translate(shared_ptr<base_object> obj, vec3d const& offset)
-      : obj_ptr_{obj}, offset_{offset} {}
-  virtual void get_uv(double const t, point3d const& p, double& u,
-                      double& v) const override {
-    obj_ptr_->get_uv(t, p, u, v);
-  }
-  virtual bool hit(ray const& r, double t_min, double t_max,
-                   hit_record& rec) const override {
-    // Move the ray
-    ray moved_r{r.origin() - offset_, r.direction(), r.time()};
-    if (!obj_ptr_->hit(moved_r, t_min, t_max, rec)) return false;
-    // move back the hit record
-    rec.p += offset_;
-    // Just move back, I think we don't need to reset the normal.
-    // Plus, the normal of rec is always against ray direction
-    // rec.set_face_normal(moved_r, rec.normal);
-    return true;
-  }
-  virtual bool bounding_box(double tm0, double tm1,
-                            aabb& buf_aabb) const override {
-    // If original object has no bb, translated does not have either
-    if (!obj_ptr_->bounding_box(tm0, tm1, buf_aabb)) return false;
-    // If it has, we translate it
-    buf_aabb = aabb{buf_aabb.min() + offset_, buf_aabb.max() + offset_};
-    return true;
-  }
-};
-
-class rotate_y : public base_object {
- private:
-  shared_ptr<base_object> obj_ptr_;
-  double cos_theta_, sin_theta_;  // for less computing
-  bool has_box_;
-  aabb bbox_;
-
- public:
-  rotate_y(shared_ptr<base_object> obj, double angle);
+  transform_instance(shared_ptr<base_object> obj, transform const& xf);
+  // for keyframes, the bvh holding this needs a refit() after
+  void set_transform(transform const& xf);
   // get uv in hit()
   virtual bool hit(const ray& r, double t_min, double t_max,
                    hit_record& rec) const override;
   virtual bool bounding_box(double tm0, double tm1,
-                            aabb& buf_aabb) const override {
-    buf_aabb = bbox_;
-    return has_box_;
-  }
+                            aabb& buf_aabb) const override;
+  virtual void refit() override { obj_ptr_->refit(); }
 };
-rotate_y::rotate_y(shared_ptr<base_object> obj, double angle) : obj_ptr_{obj} {
-  // rotate all the xz coords and take max of them as new bounding box
-  auto radians = deg_to_rad(angle);  // convert
-  // record for saving time
-  sin_theta_ = sin(radians);
-  cos_theta_ = cos(radians);
-  // prepare for bouding_box(), save time
-  has_box_ = obj_ptr_->bounding_box(0, 1, bbox_);
-  // hold the max and min on all axis
-  point3d minp{INF_DBL, INF_DBL, INF_DBL};
-  point3d maxp{-INF_DBL, -INF_DBL, -INF_DBL};
-  // loop to update the eight vertices of bbox_
-  for (int i = 0; i < 2; i++) {
-    for (int j = 0; j < 2; j++) {
-      for (int k = 0; k < 2; k++) {
-        // extract the three coordinates
-        auto x = i * bbox_.max().x() + (1 - i) * bbox_.min().x();
-        auto y = j * bbox_.max().y() + (1 - j) * bbox_.min().y();
-        auto z = k * bbox_.max().z() + (1 - k) * bbox_.min().z();
-        // based on math
-        auto rot_x = cos_theta_ * x + sin_theta_ * z;
-        auto rot_z = -sin_theta_ * x + cos_theta_ * z;
-        vec3d rot_v{rot_x, y, rot_z};
-        // update bb
-        for (int ii = 0; ii < 3; ii++) {
-          minp[ii] = fmin(minp[ii], rot_v[ii]);
-          maxp[ii] = fmax(maxp[ii], rot_v[ii]);
-        }
-      }
-    }
+transform_instance::transform_instance(shared_ptr<base_object> obj,
+                                       transform const& xf)
+    : obj_ptr_{obj}, xf_{xf}, animated_{false} {
+  auto inner = std::dynamic_pointer_cast<transform_instance>(obj);
+  if (inner && !inner->animated_) {
+    obj_ptr_ = inner->obj_ptr_;
+    xf_ = xf * inner->xf_;
   }
-  bbox_ = aabb{minp, maxp};
+  rigid_ = xf_.is_rigid();
 }
-bool rotate_y::hit(const ray& r, double t_min, double t_max,
-                   hit_record& rec) const {
-  auto origin = r.origin();
-  auto dir = r.direction();
-  // rotate the ray
-  // rotate the origin of ray, note the sign
-  origin[0] = cos_theta_ * r.origin()[0] - sin_theta_ * r.origin()[2];
-  origin[2] = sin_theta_ * r.origin()[0] + cos_theta_ * r.origin()[2];
-  // rotate the direction too
-  dir[0] = cos_theta_ * r.direction()[0] - sin_theta_ * r.direction()[2];
-  dir[2] = sin_theta_ * r.direction()[0] + cos_theta_ * r.direction()[2];
-  ray rot_r{origin, dir, r.time()};
-  // then do the regular hit, the uv is also done
-  if (!obj_ptr_->hit(rot_r, t_min, t_max, rec)) return false;
-  // rotate BACK the record, note the sign
-  auto p = rec.p;
-  auto normal = rec.normal;
-  p[0] = cos_theta_ * rec.p[0] + sin_theta_ * rec.p[2];
-  p[2] = -sin_theta_ * rec.p[0] + cos_theta_ * rec.p[2];
-
-  normal[0] = cos_theta_ * rec.normal[0] + sin_theta_ * rec.normal[2];
-  normal[2] = -sin_theta_ * rec.normal[0] + cos_theta_ * rec.normal[2];
-
-  rec.p = p;
-  // It's a rotation, so we MUST reset the normal
-  rec.set_face_normal(rot_r, normal);
-
+void transform_instance::set_transform(transform const& xf) {
+  xf_ = xf;
+  rigid_ = xf_.is_rigid();
+  animated_ = true;
+}
+/**
+ * The object space ray keeps t, its direction is not normalized.
+ * The normal goes by the inverse transpose, an affine map keeps
+ * the sign of dot(dir, normal) so it still faces the ray,
+ * and dndu, dndv pick up the derivative of the normalization.
+ */
+bool transform_instance::hit(const ray& r, double t_min, double t_max,
+                             hit_record& rec) const {
+  ray local_r{xf_.inv_point(r.origin()), xf_.inv_vector(r.direction()),
+              r.time()};
+  if (!obj_ptr_->hit(local_r, t_min, t_max, rec)) return false;
+  rec.p = xf_.point(rec.p);
+  rec.dpdu = xf_.vector(rec.dpdu);
+  rec.dpdv = xf_.vector(rec.dpdv);
+  if (rigid_) {
+    rec.normal = xf_.vector(rec.normal);
+    rec.dndu = xf_.vector(rec.dndu);
+    rec.dndv = xf_.vector(rec.dndv);
+    return true;
+  }
+  auto n = xf_.normal(rec.normal);
+  auto len = n.norm();
+  rec.normal = n / len;
+  auto outward = rec.front_face ? rec.normal : -rec.normal;
+  auto normal_derivative = [&](vec3d const& dn) {
+    auto m = xf_.normal(dn);
+    return (m - dot(outward, m) * outward) / len;
+  };
+  rec.dndu = normal_derivative(rec.dndu);
+  rec.dndv = normal_derivative(rec.dndv);
   return true;
 }
+bool transform_instance::bounding_box(double tm0, double tm1,
+                                      aabb& buf_aabb) const {
+  // If original object has no bb, transformed does not have either
+  if (!obj_ptr_->bounding_box(tm0, tm1, buf_aabb)) return false;
+  buf_aabb = xf_.bounds(buf_aabb);
+  return true;
+}
+
+class translate : public transform_instance {
+ public:
+  translate(shared_ptr<base_object> obj, vec3d const& offset)
+      : transform_instance(obj, transform::translation(offset)) {}
+};
+
+// angle in degrees
+class rotate_y : public transform_instance {
+ public:
+  rotate_y(shared_ptr<base_object> obj, double angle)
+      : transform_instance(obj, transform::rotation(vec3d{0, 1, 0}, angle)) {}
+};
 #endif
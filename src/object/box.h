@@ -1,14 +1,20 @@
 #ifndef BOX_H
 #define BOX_H
 
-#include "aarectangle.h"
-#include "objectlist.h"
+#include "baseobject.h"
 #include "rt_utils.h"
+#include "sphericalrect.h"
 
+/**
+ * Axis aligned box, intersected as one slab test.
+ * Each face is parametrized as the rectangle it used to be:
+ * faces normal to z take uv from (x, y), normal to y from (x, z),
+ * normal to x from (y, z).
+ */
 class box : public base_object {
  private:
-  object_list faces_;
   point3d box_min_, box_max_;  // diagonal of a box
+  shared_ptr<base_material> mat_ptr_;
 
  public:
   box() {}
@@ -20,37 +26,143 @@ class box : public base_object {
                    hit_record& rec) const override;
   virtual bool bounding_box(double tm0, double tm1,
                             aabb& buf_aabb) const override;
+  virtual double pdf_value(point3d const& origin, vec3d const& dir,
+                           double t) const override;
+  virtual vec3d random_sample(point3d const& origin, double t) const override;
+
+ private:
+  /**
+   * Faces that can be seen from origin, encoded as axis * 2 + (is max side).
+   * From inside the box all six faces are seen.
+   * @return number of faces
+   */
+  int visible_faces(point3d const& origin, int faces[6]) const;
+  // corner and edges of a face, for spherical_rectangle
+  void face_rectangle(int face, point3d& s, vec3d& ex, vec3d& ey) const;
+  // the axes u and v run along on a face normal to axis
+  static int u_axis(int axis) { return axis == 0 ? 1 : 0; }
+  static int v_axis(int axis) { return axis == 2 ? 1 : 2; }
 };
 box::box(point3d const& p0, point3d const& p1,
-         shared_ptr<base_material> mat_ptr) {
-  box_min_ = p0;
-  box_max_ = p1;
-
-  faces_.add(make_shared<xy_rectangle>(box_min_.x(), box_max_.x(), box_min_.y(),
-                                       box_max_.y(), box_min_.z(), mat_ptr, vec3d{0, 0, -1}));
-  faces_.add(make_shared<xy_rectangle>(box_min_.x(), box_max_.x(), box_min_.y(),
-                                       box_max_.y(), box_max_.z(), mat_ptr, vec3d{0, 0, 1}));
-
-  faces_.add(make_shared<xz_rectangle>(box_min_.x(), box_max_.x(), box_min_.z(),
-                                       box_max_.z(), box_min_.y(), mat_ptr, vec3d{0, -1, 0}));
-  faces_.add(make_shared<xz_rectangle>(box_min_.x(), box_max_.x(), box_min_.z(),
-                                       box_max_.z(), box_max_.y(), mat_ptr, vec3d{0, 1, 0}));
-
-  faces_.add(make_shared<yz_rectangle>(box_min_.y(), box_max_.y(), box_min_.z(),
-                                       box_max_.z(), box_min_.x(), mat_ptr, vec3d{-1, 0, 0}));
-  faces_.add(make_shared<yz_rectangle>(box_min_.y(), box_max_.y(), box_min_.z(),
-                                       box_max_.z(), box_max_.x(), mat_ptr, vec3d{1, 0, 0}));
-}
+         shared_ptr<base_material> mat_ptr)
+    : box_min_{p0}, box_max_{p1}, mat_ptr_{mat_ptr} {}
 
 void box::get_uv(double const t, point3d const& p, double& u, double& v) const {
-  // We get uv in each faces' hit()
+  // We get uv in hit()
 }
+/**
+ * The ray is inside all three slabs between t_near and t_far,
+ * it enters through the face of the last slab it enters and leaves
+ * through the first it leaves. The entry is taken if in range, else
+ * the exit, which is what a ray from inside the box sees.
+ */
 bool box::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-  return faces_.hit(r, t_min, t_max, rec);
+  auto t_near = -INF_DBL, t_far = INF_DBL;
+  int near_axis = -1, far_axis = -1;
+  for (int axis = 0; axis < 3; axis++) {
+    auto inv_d = 1 / r.direction()[axis];
+    auto t0 = (box_min_[axis] - r.origin()[axis]) * inv_d;
+    auto t1 = (box_max_[axis] - r.origin()[axis]) * inv_d;
+    if (inv_d < 0) std::swap(t0, t1);
+    // NaN, from a ray in the plane of a face, is never taken
+    if (t0 > t_near) {
+      t_near = t0;
+      near_axis = axis;
+    }
+    if (t1 < t_far) {
+      t_far = t1;
+      far_axis = axis;
+    }
+  }
+  if (t_near > t_far) return false;
+  double t;
+  int axis;
+  bool is_max;
+  if (near_axis >= 0 && t_near >= t_min && t_near <= t_max) {
+    t = t_near;
+    axis = near_axis;
+    is_max = r.direction()[axis] < 0;
+  } else if (far_axis >= 0 && t_far >= t_min && t_far <= t_max) {
+    t = t_far;
+    axis = far_axis;
+    is_max = r.direction()[axis] > 0;
+  } else {
+    return false;
+  }
+
+  rec.t = t;
+  rec.p = r.at(t);
+  int ua = u_axis(axis), va = v_axis(axis);
+  auto du = box_max_[ua] - box_min_[ua], dv = box_max_[va] - box_min_[va];
+  rec.u = (rec.p[ua] - box_min_[ua]) / du;
+  rec.v = (rec.p[va] - box_min_[va]) / dv;
+  rec.dpdu = rec.dpdv = rec.dndu = rec.dndv = vec3d{0, 0, 0};
+  rec.dpdu[ua] = du;
+  rec.dpdv[va] = dv;
+  vec3d outward_normal{0, 0, 0};
+  outward_normal[axis] = is_max ? 1 : -1;
+  rec.set_face_normal(r, outward_normal);
+  rec.mat_ptr = mat_ptr_;
+  return true;
 }
 bool box::bounding_box(double tm0, double tm1, aabb& buf_aabb) const {
    buf_aabb = aabb(box_min_, box_max_);
    return true;
 }
 
+int box::visible_faces(point3d const& origin, int faces[6]) const {
+  int count = 0;
+  for (int axis = 0; axis < 3; axis++) {
+    if (origin[axis] < box_min_[axis]) faces[count++] = axis * 2;
+    if (origin[axis] > box_max_[axis]) faces[count++] = axis * 2 + 1;
+  }
+  if (count > 0) return count;
+  for (int face = 0; face < 6; face++) faces[face] = face;
+  return 6;
+}
+void box::face_rectangle(int face, point3d& s, vec3d& ex,
+                         vec3d& ey) const {
+  int axis = face / 2;
+  int a1 = (axis + 1) % 3, a2 = (axis + 2) % 3;
+  s = box_min_;
+  if (face % 2) s[axis] = box_max_[axis];
+  ex = ey = vec3d{0, 0, 0};
+  ex[a1] = box_max_[a1] - box_min_[a1];
+  ey[a2] = box_max_[a2] - box_min_[a2];
+}
+/**
+ * Pick one visible face uniformly, then sample it in solid angle.
+ * The box is convex, so a direction crosses at most one visible face.
+ */
+double box::pdf_value(point3d const& origin, vec3d const& dir,
+                      double t) const {
+  int faces[6];
+  int count = visible_faces(origin, faces);
+  for (int i = 0; i < count; i++) {
+    int axis = faces[i] / 2;
+    int a1 = (axis + 1) % 3, a2 = (axis + 2) % 3;
+    auto k = (faces[i] % 2) ? box_max_[axis] : box_min_[axis];
+    auto hit_t = (k - origin[axis]) / dir[axis];
+    if (!(hit_t >= 0.001 && hit_t < INF_DBL)) continue;
+    auto p1 = origin[a1] + hit_t * dir[a1];
+    auto p2 = origin[a2] + hit_t * dir[a2];
+    if (!(p1 >= box_min_[a1] && p1 <= box_max_[a1] && p2 >= box_min_[a2] &&
+          p2 <= box_max_[a2]))
+      continue;
+    point3d s;
+    vec3d ex, ey;
+    face_rectangle(faces[i], s, ex, ey);
+    return rectangle_pdf(s, ex, ey, origin, dir, hit_t) / count;
+  }
+  return 0;
+}
+vec3d box::random_sample(point3d const& origin, double t) const {
+  int faces[6];
+  int count = visible_faces(origin, faces);
+  point3d s;
+  vec3d ex, ey;
+  face_rectangle(faces[random_int(0, count)], s, ex, ey);
+  return rectangle_sample(s, ex, ey, origin);
+}
+
 #endif
@@ -1,60 +1,163 @@
 #ifndef BVH_H
 #define BVH_H
 
+#include <chrono>
+#include <thread>
+
 #include "baseobject.h"
 #include "objectlist.h"
+#include "parallel.h"
 #include "ray.h"
 #include "rt_utils.h"
+#include "stats.h"
 
-inline bool box_compare(std::shared_ptr<base_object> const a,
-                        std::shared_ptr<base_object> const b, int axis) {
-  aabb boxa, boxb;
-  // time 0, 0 just to test the existence of bounding box
-  if (!a->bounding_box(0, 0, boxa) || !b->bounding_box(0, 0, boxb))
-    std::cerr << "bvh_node::box_compare: No bounding box.\n";
-  return boxa.min()[axis] < boxb.min()[axis];
-}
-bool box_compare_x(std::shared_ptr<base_object> const a,
-                   std::shared_ptr<base_object> const b) {
-  return box_compare(a, b, 0);
-}
-bool box_compare_y(std::shared_ptr<base_object> const a,
-                   std::shared_ptr<base_object> const b) {
-  return box_compare(a, b, 1);
-}
-bool box_compare_z(std::shared_ptr<base_object> a,
-                   std::shared_ptr<base_object> b) {
-  return box_compare(a, b, 2);
-}
+// what the builder knows of an object, gathered once
+struct bvh_prim {
+  point3d lo, hi;    // bounds over the shutter
+  point3d centroid;  // of the bounds at mid shutter
+  size_t index;      // into the objects
+};
+// shape and size of a tree, see bvh_node::stats()
+struct bvh_stats {
+  size_t nodes = 0, leaves = 0;
+  size_t leaf_prims = 0;  // objects in leaves, not counting lone children
+  size_t bytes = 0;       // nodes and the leaf object array
+  int depth = 0;
+};
 /**
  * store the hierachy structure.
  * take a object_list and build the tree
  * over a given time interval
+ *
+ * Each node keeps its bounds at shutter open and close. Moving objects
+ * move linearly, so the bounds at ray.time() are the lerp of the two,
+ * instead of one box swept over the whole shutter.
+ *
+ * The tree is built top down with binned SAH, subtrees on their own
+ * threads near the top and the binning itself in parallel on big nodes.
+ *
+ * A node stops splitting when testing its objects one by one costs
+ * less than the SAH split, and has at most max_leaf of them.
+ * Leaf objects sit in one array shared by the tree, a leaf is a range.
+ * A lone object is still a child by itself, without a node of its own.
+ *
+ * When objects below only move (animation keyframes), refit() updates
+ * the bounds bottom up and keeps the tree, much cheaper than a rebuild
+ * but looser the further things move from where they were sorted.
  */
 class bvh_node : public base_object {
  public:
-  aabb self_box_;
+  aabb self_box_;      // over the whole shutter
+  aabb box0_, box1_;   // at time0_ and time1_
+  double time0_, time1_, inv_dt_;
+  bool moving_;        // box0_ and box1_ differ
+  uint8_t lone_children_ = 0;  // objects rather than nodes, for the stats
+  // inner nodes
   std::shared_ptr<base_object> left_, right_;
+  // leaves, objects [first_, first_ + count_) of leaf_objects_
+  std::shared_ptr<std::vector<std::shared_ptr<base_object>>> leaf_objects_;
+  uint32_t first_ = 0, count_ = 0;
 
  public:
-  bvh_node() {}
-  bvh_node(object_list &obj_list, double time0, double time1)
-      : bvh_node{obj_list.objects_, 0, obj_list.objects_.size(), time0, time1} {
-  }
+  // objects a leaf may hold
+  static size_t const MAX_LEAF_ = 8;
+
+  // empty, to be assigned a built tree later
+  bvh_node() : bvh_node{0, 0} {}
+  bvh_node(object_list &obj_list, double time0, double time1,
+           size_t max_leaf = MAX_LEAF_)
+      : bvh_node{obj_list.objects_, 0, obj_list.objects_.size(), time0, time1,
+                 max_leaf} {}
+  // the objects are not reordered, the build time and shape are logged
   bvh_node(std::vector<std::shared_ptr<base_object>> &leaf_objects, size_t st,
-           size_t ed, double time0, double time1);
+           size_t ed, double time0, double time1,
+           size_t max_leaf = MAX_LEAF_);
   virtual bool hit(ray const &r, double t_min, double t_max,
                    hit_record &rec) const override;
   virtual bool bounding_box(double tm0, double tm1,
                             aabb &buf_aabb) const override;
   virtual void get_uv(double const t, point3d const &p, double &u,
                       double &v) const override;
+  // bounds from the children again, nested bvh_nodes first
+  virtual void refit() override;
+  // sum of the node areas down the tree, a measure of how loose it is
+  double area_sum() const;
+  // added to s, depth is that of this node
+  void stats(bvh_stats &s, int depth = 1) const;
+
+  /**
+   * builder pieces, flat_bvh sorts with the same ones
+   * @param boxes0, boxes1 if given, get the bounds at time0 and time1
+   */
+  static std::vector<bvh_prim> gather_prims(
+      std::vector<std::shared_ptr<base_object>> const &objects, size_t st,
+      size_t ed, double time0, double time1,
+      std::vector<aabb> *boxes0 = nullptr, std::vector<aabb> *boxes1 = nullptr);
+  /**
+   * SAH split over centroid bins on the longest centroid axis,
+   * reorders prims
+   * @param split_axis set to the axis binned along
+   * @param split_cost set to the SAH cost of the split, objects tested
+   *        per ray through the node, n when nothing was found
+   * @return the count going left, in (0, n)
+   */
+  static size_t sah_partition(bvh_prim *prims, size_t n, bool parallel,
+                              int *split_axis = nullptr,
+                              double *split_cost = nullptr);
+
+ private:
+  static int const SAH_BINS_ = 12;
+  /**
+   * a node visit against one object test, for the leaf decision.
+   * A visit is a box test and a call on each child, and bvhleaf_bench
+   * ran fastest on spheres with this.
+   */
+  static constexpr double TRAVERSAL_COST_ = 4.0;
+  // nodes with fewer prims are built on the calling thread
+  static size_t const PARALLEL_BUILD_MIN_ = 1 << 12;
+  // nodes with more prims bin in parallel
+  static size_t const PARALLEL_BIN_MIN_ = 1 << 16;
+
+  size_t max_leaf_ = MAX_LEAF_;
+
+  bvh_node(double time0, double time1);
+  /**
+   * children or a leaf over prims[0, n), then own bounds
+   * @param first where prims[0] goes in leaf_objects_
+   * @param spawn_depth levels left that may start a thread
+   * @param alone no other thread is building, binning may go parallel
+   */
+  void build(std::vector<std::shared_ptr<base_object>> const &objects,
+             bvh_prim *prims, size_t n, size_t first, int spawn_depth,
+             bool alone);
+  // own bounds from the bounds of the children or leaf objects
+  void fit_bounds();
+  // bounds at time, clamped to the shutter
+  aabb box_at(double time) const;
 };
 
+size_t const bvh_node::MAX_LEAF_;
+constexpr double bvh_node::TRAVERSAL_COST_;
+
 bool bvh_node::hit(ray const &r, double t_min, double t_max,
                    hit_record &rec) const {
+  STAT_COUNT(STAT_BVH_NODES);
   // if not hit self_box, jump
-  if (!self_box_.hit(r, t_min, t_max)) return false;
+  if (!(moving_ ? box_at(r.time()) : self_box_).hit(r, t_min, t_max))
+    return false;
+  if (count_) {
+    bool hit_any = false;
+    auto objects = leaf_objects_->data() + first_;
+    STAT_ADD(STAT_BVH_TESTS, count_);
+    for (uint32_t i = 0; i < count_; i++) {
+      if (objects[i]->hit(r, t_min, t_max, rec)) {
+        hit_any = true;
+        t_max = rec.t;
+      }
+    }
+    return hit_any;
+  }
+  STAT_ADD(STAT_BVH_TESTS, lone_children_);
   // test both "branch"
   bool hit_left = left_->hit(r, t_min, t_max, rec);
   // adjust the time interval
@@ -62,48 +165,276 @@ bool bvh_node::hit(ray const &r, double t_min, double t_max,
   return hit_left || hit_right;
 }
 bool bvh_node::bounding_box(double tm0, double tm1, aabb &buf_aabb) const {
-  buf_aabb = this->self_box_;
+  buf_aabb = moving_ ? surrounding_aabb(box_at(tm0), box_at(tm1)) : self_box_;
   return true;
 }
+aabb bvh_node::box_at(double time) const {
+  auto s = clamp((time - time0_) * inv_dt_, 0.0, 1.0);
+  return aabb{(1 - s) * box0_.min() + s * box1_.min(),
+              (1 - s) * box0_.max() + s * box1_.max()};
+}
+bvh_node::bvh_node(double time0, double time1)
+    : time0_{time0},
+      time1_{time1},
+      inv_dt_{time1 > time0 ? 1 / (time1 - time0) : 0},
+      moving_{false} {}
+bvh_node::bvh_node(std::vector<std::shared_ptr<base_object>> &leaf_objects,
+                   size_t st, size_t ed, double time0, double time1,
+                   size_t max_leaf)
+    : bvh_node{time0, time1} {
+  if (ed <= st) return;
+  auto start = std::chrono::steady_clock::now();
+  size_t n = ed - st;
+  max_leaf_ = std::max<size_t>(max_leaf, 1);
+  auto prims = gather_prims(leaf_objects, st, ed, time0, time1);
+  leaf_objects_ = std::make_shared<std::vector<std::shared_ptr<base_object>>>(n);
+  // a subtree per thread, and a bit more to balance
+  int spawn_depth = 1;
+  while ((1 << spawn_depth) < 2 * thread_count()) spawn_depth++;
+  if (thread_count() == 1) spawn_depth = 0;
+  build(leaf_objects, prims.data(), n, 0, spawn_depth, true);
+
+  auto ms = std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - start)
+                .count();
+  bvh_stats s;
+  stats(s);
+  std::cerr << "bvh: " << n << " primitives in " << ms << " ms, "
+            << n / std::max(ms, 1e-3) / 1e3 << " M primitives/s, "
+            << thread_count() << " threads, " << s.nodes << " nodes, "
+            << s.leaves << " leaves, depth " << s.depth << ", "
+            << s.bytes / 1024.0 << " KB\n";
+}
+std::vector<bvh_prim> bvh_node::gather_prims(
+    std::vector<std::shared_ptr<base_object>> const &objects, size_t st,
+    size_t ed, double time0, double time1, std::vector<aabb> *boxes0,
+    std::vector<aabb> *boxes1) {
+  std::vector<bvh_prim> prims(ed - st);
+  if (boxes0) boxes0->resize(ed - st);
+  if (boxes1) boxes1->resize(ed - st);
+  auto mid_time = 0.5 * (time0 + time1);
+  parallel_for(0, ed - st, [&](size_t i) {
+    aabb box0, box1, box_mid;
+    auto const &obj = objects[st + i];
+    if (!obj->bounding_box(time0, time0, box0) ||
+        !obj->bounding_box(time1, time1, box1) ||
+        !obj->bounding_box(mid_time, mid_time, box_mid))
+      std::cerr << "bvh_node::bvh_node: No bounding box.\n";
+    auto swept = surrounding_aabb(box0, box1);
+    prims[i] = bvh_prim{swept.min(), swept.max(),
+                        0.5 * (box_mid.min() + box_mid.max()), st + i};
+    if (boxes0) (*boxes0)[i] = box0;
+    if (boxes1) (*boxes1)[i] = box1;
+  }, 256);
+  return prims;
+}
 /**
- * select an axis randomly
- * sort the objects ascending by their min val of that axis
- * split into two
- * corner case:
- *    one object: dulplicate, no sorting
- *    two objects: split, no sorting
+ * A leaf when n objects one by one cost no more than a split,
+ * the SAH cost plus the visit of the node itself.
+ * A child of one object is the object itself, not a node,
+ * only a tree of one object is a leaf of one.
  */
-bvh_node::bvh_node(std::vector<std::shared_ptr<base_object>> &leaf_objects,
-                   size_t st, size_t ed, double time0, double time1) {
-  if (ed - st <= 0) return;
-  int axis = random_int(0, 3);
-  auto comparator = (axis == 0)   ? box_compare_x
-                    : (axis == 1) ? box_compare_y
-                                  : box_compare_z;
-  size_t obj_count = ed - st;
-  // build bvh tree/leaf
-  if (obj_count == 1) {
-    left_ = right_ = leaf_objects[st];
-  } else if (obj_count == 2) {
-    if (comparator(leaf_objects[st], leaf_objects[st + 1])) {
-      left_ = leaf_objects[st];
-      right_ = leaf_objects[st + 1];
+void bvh_node::build(std::vector<std::shared_ptr<base_object>> const &objects,
+                     bvh_prim *prims, size_t n, size_t first, int spawn_depth,
+                     bool alone) {
+  double split_cost = n;
+  size_t mid = n > 1 ? sah_partition(prims, n, alone, nullptr, &split_cost) : 0;
+  if (n == 1 || (n <= max_leaf_ && n <= TRAVERSAL_COST_ + split_cost)) {
+    for (size_t i = 0; i < n; i++)
+      (*leaf_objects_)[first + i] = objects[prims[i].index];
+    first_ = static_cast<uint32_t>(first);
+    count_ = static_cast<uint32_t>(n);
+  } else {
+    bool spawn = spawn_depth > 0 && n >= PARALLEL_BUILD_MIN_;
+    auto child = [&](bvh_prim *sub, size_t m,
+                     size_t sub_first) -> std::shared_ptr<base_object> {
+      if (m == 1) return objects[sub[0].index];
+      std::shared_ptr<bvh_node> node{new bvh_node{time0_, time1_}};
+      node->max_leaf_ = max_leaf_;
+      node->leaf_objects_ = leaf_objects_;
+      node->build(objects, sub, m, sub_first, spawn_depth - 1,
+                  alone && !spawn);
+      return node;
+    };
+    if (spawn) {
+      std::thread left_thread{[&]() { left_ = child(prims, mid, first); }};
+      right_ = child(prims + mid, n - mid, first + mid);
+      left_thread.join();
     } else {
-      left_ = leaf_objects[st + 1];
-      right_ = leaf_objects[st];
+      left_ = child(prims, mid, first);
+      right_ = child(prims + mid, n - mid, first + mid);
     }
+    lone_children_ = (mid == 1) + (n - mid == 1);
+  }
+  fit_bounds();
+}
+size_t bvh_node::sah_partition(bvh_prim *prims, size_t n, bool parallel,
+                               int *split_axis, double *split_cost) {
+  struct bin {
+    point3d lo{INF_DBL, INF_DBL, INF_DBL}, hi{-INF_DBL, -INF_DBL, -INF_DBL};
+    size_t count = 0;
+    void grow(point3d const &plo, point3d const &phi) {
+      for (int a = 0; a < 3; a++) {
+        lo[a] = std::min(lo[a], plo[a]);
+        hi[a] = std::max(hi[a], phi[a]);
+      }
+    }
+    double area() const {
+      return count ? aabb{lo, hi}.surface_area() : 0;
+    }
+  };
+  // chunks of prims, summed by separate threads on big nodes
+  size_t chunk = parallel && n >= PARALLEL_BIN_MIN_ ? PARALLEL_BIN_MIN_ / 4 : n;
+  size_t n_chunks = (n + chunk - 1) / chunk;
+  auto chunk_end = [&](size_t c) { return std::min(n, (c + 1) * chunk); };
+
+  bin cb;
+  std::vector<bin> chunk_cb(n_chunks > 1 ? n_chunks : 0);
+  if (n_chunks == 1) {
+    for (size_t i = 0; i < n; i++) cb.grow(prims[i].centroid, prims[i].centroid);
+  } else {
+    parallel_for(0, n_chunks, [&](size_t c) {
+      for (size_t i = c * chunk; i < chunk_end(c); i++)
+        chunk_cb[c].grow(prims[i].centroid, prims[i].centroid);
+    });
+    for (auto const &b : chunk_cb) cb.grow(b.lo, b.hi);
+  }
+  int axis = 0;
+  for (int a = 1; a < 3; a++)
+    if (cb.hi[a] - cb.lo[a] > cb.hi[axis] - cb.lo[axis]) axis = a;
+  if (split_axis) *split_axis = axis;
+  if (split_cost) *split_cost = n;
+  auto extent = cb.hi[axis] - cb.lo[axis];
+  // every centroid in one place, any split is as good
+  if (extent <= 0) return n / 2;
+
+  auto scale = SAH_BINS_ / extent;
+  auto bin_of = [&](bvh_prim const &p) {
+    int b = static_cast<int>((p.centroid[axis] - cb.lo[axis]) * scale);
+    return std::max(0, std::min(SAH_BINS_ - 1, b));
+  };
+  auto fill = [&](size_t st, size_t ed, bin *out) {
+    for (size_t i = st; i < ed; i++) {
+      auto &b = out[bin_of(prims[i])];
+      b.grow(prims[i].lo, prims[i].hi);
+      b.count++;
+    }
+  };
+  bin bins[SAH_BINS_];
+  if (n_chunks == 1) {
+    fill(0, n, bins);
   } else {
-    std::sort(leaf_objects.begin() + st, leaf_objects.begin() + ed, comparator);
-    size_t mid = st + obj_count / 2;
-    left_ = std::make_shared<bvh_node>(leaf_objects, st, mid, time0, time1);
-    right_ = std::make_shared<bvh_node>(leaf_objects, mid, ed, time0, time1);
+    std::vector<bin> chunk_bins(n_chunks * SAH_BINS_);
+    parallel_for(0, n_chunks, [&](size_t c) {
+      fill(c * chunk, chunk_end(c), &chunk_bins[c * SAH_BINS_]);
+    });
+    for (size_t c = 0; c < n_chunks; c++)
+      for (int b = 0; b < SAH_BINS_; b++) {
+        auto const &part = chunk_bins[c * SAH_BINS_ + b];
+        if (part.count == 0) continue;
+        bins[b].grow(part.lo, part.hi);
+        bins[b].count += part.count;
+      }
+  }
+
+  // cost of splitting after bin b, right side swept from the end
+  double right_cost[SAH_BINS_];
+  bin right;
+  for (int b = SAH_BINS_ - 1; b > 0; b--) {
+    right.grow(bins[b].lo, bins[b].hi);
+    right.count += bins[b].count;
+    right_cost[b - 1] = right.count * right.area();
+  }
+  bin left, all = right;
+  all.grow(bins[0].lo, bins[0].hi);
+  int best = -1;
+  double best_cost = INF_DBL;
+  for (int b = 0; b < SAH_BINS_ - 1; b++) {
+    left.grow(bins[b].lo, bins[b].hi);
+    left.count += bins[b].count;
+    if (left.count == 0 || left.count == n) continue;
+    auto cost = left.count * left.area() + right_cost[b];
+    if (cost < best_cost) {
+      best_cost = cost;
+      best = b;
+    }
   }
-  // merge
-  aabb box_left, box_right;
-  if (!left_->bounding_box(time0, time1, box_left) ||
-      !right_->bounding_box(time0, time1, box_right))
+  if (best < 0) return n / 2;
+  // flat nodes have no area, nothing to weigh the sides by
+  if (split_cost && all.area() > 0) *split_cost = best_cost / all.area();
+  auto mid = std::partition(prims, prims + n, [&](bvh_prim const &p) {
+               return bin_of(p) <= best;
+             }) -
+             prims;
+  return static_cast<size_t>(mid);
+}
+void bvh_node::fit_bounds() {
+  // merge, at both ends of the shutter
+  bool ok = true;
+  auto bounds = [&](base_object const &obj, aabb &b0, aabb &b1) {
+    ok = obj.bounding_box(time0_, time0_, b0) &&
+         obj.bounding_box(time1_, time1_, b1) && ok;
+  };
+  if (count_) {
+    auto objects = leaf_objects_->data() + first_;
+    bounds(*objects[0], box0_, box1_);
+    for (uint32_t i = 1; i < count_; i++) {
+      aabb b0, b1;
+      bounds(*objects[i], b0, b1);
+      box0_ = surrounding_aabb(box0_, b0);
+      box1_ = surrounding_aabb(box1_, b1);
+    }
+  } else {
+    aabb left0, left1, right0, right1;
+    bounds(*left_, left0, left1);
+    bounds(*right_, right0, right1);
+    box0_ = surrounding_aabb(left0, right0);
+    box1_ = surrounding_aabb(left1, right1);
+  }
+  if (!ok)
     std::cerr << "bvh_node::bvh_node: Missing bounding box when merging.\n";
-  self_box_ = surrounding_aabb(box_left, box_right);
+  self_box_ = surrounding_aabb(box0_, box1_);
+  moving_ = false;
+  for (int axis = 0; axis < 3; axis++)
+    if (box0_.min()[axis] != box1_.min()[axis] ||
+        box0_.max()[axis] != box1_.max()[axis])
+      moving_ = true;
+}
+void bvh_node::refit() {
+  if (count_) {
+    for (uint32_t i = 0; i < count_; i++) (*leaf_objects_)[first_ + i]->refit();
+  } else if (left_) {
+    left_->refit();
+    if (right_ != left_) right_->refit();
+  } else {
+    // empty tree
+    return;
+  }
+  fit_bounds();
+}
+double bvh_node::area_sum() const {
+  auto sum = self_box_.surface_area();
+  auto left = dynamic_cast<bvh_node const *>(left_.get());
+  auto right = dynamic_cast<bvh_node const *>(right_.get());
+  if (left) sum += left->area_sum();
+  if (right && right_ != left_) sum += right->area_sum();
+  return sum;
+}
+void bvh_node::stats(bvh_stats &s, int depth) const {
+  s.nodes++;
+  s.bytes += sizeof(bvh_node);
+  s.depth = std::max(s.depth, depth);
+  // the shared array, once for the tree
+  if (depth == 1 && leaf_objects_)
+    s.bytes += leaf_objects_->capacity() * sizeof(leaf_objects_->front());
+  if (count_) {
+    s.leaves++;
+    s.leaf_prims += count_;
+  }
+  for (auto const &child : {left_, right_}) {
+    auto node = dynamic_cast<bvh_node const *>(child.get());
+    if (node && (child == left_ || right_ != left_)) node->stats(s, depth + 1);
+  }
 }
 void bvh_node::get_uv(double const t, point3d const &p, double &u,
                       double &v) const {
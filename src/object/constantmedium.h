@@ -25,6 +25,7 @@ class constant_medium : public base_object {
                    hit_record& rec) const override;
   virtual bool bounding_box(double tm0, double tm1,
                             aabb& buf_aabb) const override;
+  virtual void refit() override { bound_->refit(); }
 };
 bool constant_medium::hit(const ray& r, double t_min, double t_max,
                           hit_record& rec) const {
@@ -80,6 +81,8 @@ bool constant_medium::hit(const ray& r, double t_min, double t_max,
   // set the hit record
   rec.normal = vec3d{1, 0, 0};  // arbitrary
   rec.front_face = true;        // also arbitrary
+  // no surface, no uv derivatives
+  rec.dpdu = rec.dpdv = rec.dndu = rec.dndv = vec3d{0, 0, 0};
   rec.mat_ptr = mat_ptr_;
 
   return true;
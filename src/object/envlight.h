@@ -0,0 +1,205 @@
+#ifndef ENV_LIGHT_H
+#define ENV_LIGHT_H
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "baseobject.h"
+#include "distribution.h"
+#include "image_utils.h"
+#include "rt_utils.h"
+
+/**
+ * Image based lighting from a lat-long (equirectangular) map.
+ * Used as the background on miss, and put into the light list
+ * to be importance sampled by its luminance.
+ *
+ * u (column) is phi in [-pi, pi) from -X to +Z to +X,
+ * v (row) is theta in [0, pi] from +Y down to -Y.
+ */
+class env_light : public base_object {
+ private:
+  float *data_;  // rgb, linear
+  int width_, height_;
+  double intensity_;
+  distribution_2d dist_;
+
+  // maps at least this large cache their distribution on disk
+  static int const CACHE_MIN_PIXELS_ = 1024 * 512;
+  static char const CACHE_MAGIC_[8];
+  static uint32_t const CACHE_VERSION_ = 1;
+
+  void build_distribution();
+  bool read_cache(std::string const &cache_path, struct stat const &src);
+  void write_cache(std::string const &cache_path, struct stat const &src) const;
+
+ public:
+  /**
+   * @param filename image, usually .hdr, LDR images are linearized by stb
+   * @param intensity scale of the radiance
+   */
+  env_light(char const *filename, double intensity = 1.0);
+  ~env_light() { stbi_image_free(data_); }
+  env_light(env_light const &) = delete;
+  env_light &operator=(env_light const &) = delete;
+
+  // radiance coming from direction dir
+  color_rgb value(vec3d const &dir) const;
+  /**
+   * false for an all black map, its pdf is 0 everywhere
+   * and it must not go into the light list
+   */
+  bool samplable() const { return dist_.integral() > 0; }
+
+  // the environment is infinitely far, rays never hit it
+  virtual bool hit(ray const &r, double t_min, double t_max,
+                   hit_record &rec) const override {
+    return false;
+  }
+  virtual bool bounding_box(double tm0, double tm1,
+                            aabb &buf_aabb) const override {
+    return false;
+  }
+  virtual double pdf_value(point3d const &origin, vec3d const &dir,
+                           double t) const override;
+  virtual vec3d random_sample(point3d const &origin, double t) const override;
+};
+char const env_light::CACHE_MAGIC_[8] = {'S', 'P', 'T', 'E', 'N', 'V', 0, 0};
+uint32_t const env_light::CACHE_VERSION_;
+
+env_light::env_light(char const *filename, double intensity)
+    : intensity_{intensity} {
+  int channels = 3;
+  data_ = stbi_loadf(filename, &width_, &height_, &channels, 3);
+  if (!data_) {
+    std::cerr << "ERROR: Could not load environment map '" << filename
+              << "'.\n";
+    width_ = height_ = 0;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  struct stat src;
+  bool cacheable = data_ && width_ * height_ >= CACHE_MIN_PIXELS_ &&
+                   stat(filename, &src) == 0;
+  std::string cache_path = std::string(filename) + ".envdist";
+  bool cached = cacheable && read_cache(cache_path, src);
+  if (!cached) {
+    build_distribution();
+    if (cacheable) write_cache(cache_path, src);
+  }
+  auto ms = std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - start)
+                .count();
+  std::cerr << "env_light: " << width_ << "x" << height_ << " distribution "
+            << (cached ? "read from cache" : "built") << " in " << ms
+            << " ms\n";
+}
+/**
+ * the function to sample is luminance of each texel,
+ * times sin(theta) for the lat-long distortion
+ */
+void env_light::build_distribution() {
+  if (!data_) {
+    double one = 1;
+    dist_.build(&one, 1, 1);
+    return;
+  }
+  std::vector<double> func(static_cast<size_t>(width_) * height_);
+  parallel_for(0, height_, [&](size_t j) {
+    auto sin_theta = sin(PI * (j + 0.5) / height_);
+    for (int i = 0; i < width_; i++) {
+      auto px = data_ + (j * width_ + i) * 3;
+      func[j * width_ + i] =
+          (0.2126 * px[0] + 0.7152 * px[1] + 0.0722 * px[2]) * sin_theta;
+    }
+  });
+  dist_.build(func.data(), width_, height_);
+}
+/**
+ * cache layout: magic, version, source size and mtime, width, height,
+ * then the distribution. Any mismatch means a rebuild.
+ */
+bool env_light::read_cache(std::string const &cache_path,
+                           struct stat const &src) {
+  FILE *fp = fopen(cache_path.c_str(), "rb");
+  if (!fp) return false;
+  char magic[8];
+  uint32_t version;
+  int64_t size, mtime;
+  int w, h;
+  bool ok = fread(magic, 1, 8, fp) == 8 &&
+            memcmp(magic, CACHE_MAGIC_, 8) == 0 &&
+            fread(&version, sizeof(version), 1, fp) == 1 &&
+            version == CACHE_VERSION_ &&
+            fread(&size, sizeof(size), 1, fp) == 1 && size == src.st_size &&
+            fread(&mtime, sizeof(mtime), 1, fp) == 1 &&
+            mtime == static_cast<int64_t>(src.st_mtime) &&
+            fread(&w, sizeof(w), 1, fp) == 1 && w == width_ &&
+            fread(&h, sizeof(h), 1, fp) == 1 && h == height_ &&
+            dist_.read(fp);
+  fclose(fp);
+  return ok;
+}
+void env_light::write_cache(std::string const &cache_path,
+                            struct stat const &src) const {
+  /**
+   * written aside and renamed, a reader never sees half a file,
+   * aside by process so two writing the same cache do not mix
+   */
+  std::string tmp_path = cache_path + ".tmp." + std::to_string(getpid());
+  FILE *fp = fopen(tmp_path.c_str(), "wb");
+  if (!fp) return;
+  int64_t size = src.st_size;
+  int64_t mtime = static_cast<int64_t>(src.st_mtime);
+  bool ok = fwrite(CACHE_MAGIC_, 1, 8, fp) == 8 &&
+            fwrite(&CACHE_VERSION_, sizeof(CACHE_VERSION_), 1, fp) == 1 &&
+            fwrite(&size, sizeof(size), 1, fp) == 1 &&
+            fwrite(&mtime, sizeof(mtime), 1, fp) == 1 &&
+            fwrite(&width_, sizeof(width_), 1, fp) == 1 &&
+            fwrite(&height_, sizeof(height_), 1, fp) == 1 && dist_.write(fp);
+  ok = fclose(fp) == 0 && ok;
+  if (!ok || rename(tmp_path.c_str(), cache_path.c_str()) != 0)
+    remove(tmp_path.c_str());
+}
+
+color_rgb env_light::value(vec3d const &dir) const {
+  // If we have no data, then return solid cyan as a debugging aid.
+  if (data_ == nullptr) return color_rgb{0, 1, 1};
+  auto d = unit_vector(dir);
+  auto u = (atan2(d.z(), d.x()) + PI) / (2 * PI);
+  auto v = acos(clamp(d.y(), -1.0, 1.0)) / PI;
+  auto i = std::min(width_ - 1, static_cast<int>(u * width_));
+  auto j = std::min(height_ - 1, static_cast<int>(v * height_));
+  auto px = data_ + (static_cast<size_t>(j) * width_ + i) * 3;
+  return intensity_ * color_rgb{px[0], px[1], px[2]};
+}
+/**
+ * density on [0, 1)^2 to solid angle:
+ * d(omega) = sin(theta) d(theta) d(phi) = 2 pi^2 sin(theta) du dv
+ */
+double env_light::pdf_value(point3d const &origin, vec3d const &dir,
+                            double t) const {
+  auto d = unit_vector(dir);
+  auto theta = acos(clamp(d.y(), -1.0, 1.0));
+  auto sin_theta = sin(theta);
+  if (sin_theta == 0) return 0;
+  auto u = (atan2(d.z(), d.x()) + PI) / (2 * PI);
+  auto v = theta / PI;
+  return dist_.pdf(u, v) / (2 * PI * PI * sin_theta);
+}
+vec3d env_light::random_sample(point3d const &origin, double t) const {
+  double pdf, u, v;
+  dist_.sample(random_double(), random_double(), pdf, u, v);
+  auto theta = v * PI;
+  auto phi = u * 2 * PI - PI;
+  auto sin_theta = sin(theta);
+  return vec3d{sin_theta * cos(phi), cos(theta), sin_theta * sin(phi)};
+}
+
+#endif
@@ -0,0 +1,379 @@
+#ifndef FLAT_BVH_H
+#define FLAT_BVH_H
+
+/**
+ * A bvh as one array of nodes in depth first order, cached on disk.
+ *
+ * The file <cache_dir>/<hash>.bvh holds a header, the nodes and the
+ * order of the objects under the leaves. It is mmap()ed as it is and
+ * traversed in place, nothing is parsed or allocated per node.
+ *
+ * A tree only depends on the bounds of the objects, so the key is a
+ * hash of every object's bounds at shutter open, close and middle.
+ * The objects themselves still come from the scene, the cache saves
+ * the sort. A missing, stale or broken file means a rebuild.
+ */
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "baseobject.h"
+#include "bvh.h"
+#include "parallel.h"
+#include "rt_utils.h"
+#include "stats.h"
+
+// one node as it is on disk
+struct flat_bvh_node {
+  double lo0[3], hi0[3];  // bounds at shutter open
+  double lo1[3], hi1[3];  // and close
+  uint32_t offset;  // leaf: first in the object order, inner: second child
+  uint16_t count;   // objects in a leaf, 0 for an inner node
+  uint8_t axis;     // split axis of an inner node
+  uint8_t moving;   // the two boxes differ
+};
+static_assert(sizeof(flat_bvh_node) == 104, "flat_bvh_node is the file layout");
+
+class flat_bvh : public base_object {
+ private:
+  struct header {
+    char magic[8];
+    uint32_t version;
+    uint32_t node_count;
+    uint64_t object_count;
+    uint64_t hash;
+    double time0, time1;
+  };
+  static char const MAGIC_[8];
+  static uint32_t const VERSION_ = 1;
+  // leaves stop splitting at this many objects
+  static size_t const LEAF_SIZE_ = 2;
+  // of the traversal stack, the build keeps the tree within it
+  static int const MAX_DEPTH_ = 64;
+
+  std::vector<std::shared_ptr<base_object>> objects_;
+  double time0_, time1_, inv_dt_;
+  // either into the mapped file or into the vectors below
+  flat_bvh_node const *nodes_;
+  uint32_t const *order_;
+  uint32_t node_count_;
+  void *map_;
+  size_t map_bytes_;
+  std::vector<flat_bvh_node> built_nodes_;
+  std::vector<uint32_t> built_order_;
+
+  uint64_t content_hash(std::vector<bvh_prim> const &prims,
+                        std::vector<aabb> const &box0,
+                        std::vector<aabb> const &box1) const;
+  bool map_cache(std::string const &cache_path, uint64_t hash);
+  void write_cache(std::string const &cache_path, uint64_t hash) const;
+  // nodes over prims[0, n), prims[0] is at first in the order
+  uint32_t build(bvh_prim *prims, size_t n, size_t first, int depth,
+                 std::vector<aabb> const &box0, std::vector<aabb> const &box1);
+  bool node_hit(flat_bvh_node const &node, ray const &r,
+                vec3d const &inv_dir, double t_min, double t_max) const;
+
+ public:
+  /**
+   * @param cache_dir where trees are cached, nullptr to always build
+   * cold or warm, the time to a usable tree is logged
+   */
+  flat_bvh(std::vector<std::shared_ptr<base_object>> const &objects,
+           double time0, double time1, char const *cache_dir);
+  ~flat_bvh() {
+    if (map_) munmap(map_, map_bytes_);
+  }
+  flat_bvh(flat_bvh const &) = delete;
+  flat_bvh &operator=(flat_bvh const &) = delete;
+
+  virtual bool hit(ray const &r, double t_min, double t_max,
+                   hit_record &rec) const override;
+  virtual bool bounding_box(double tm0, double tm1,
+                            aabb &buf_aabb) const override;
+};
+char const flat_bvh::MAGIC_[8] = {'S', 'P', 'T', 'B', 'V', 'H', 0, 0};
+uint32_t const flat_bvh::VERSION_;
+size_t const flat_bvh::LEAF_SIZE_;
+int const flat_bvh::MAX_DEPTH_;
+
+flat_bvh::flat_bvh(std::vector<std::shared_ptr<base_object>> const &objects,
+                   double time0, double time1, char const *cache_dir)
+    : objects_{objects},
+      time0_{time0},
+      time1_{time1},
+      inv_dt_{time1 > time0 ? 1 / (time1 - time0) : 0},
+      nodes_{nullptr},
+      order_{nullptr},
+      node_count_{0},
+      map_{nullptr},
+      map_bytes_{0} {
+  if (objects_.empty()) return;
+  auto start = std::chrono::steady_clock::now();
+  size_t n = objects_.size();
+  std::vector<aabb> box0, box1;
+  auto prims =
+      bvh_node::gather_prims(objects_, 0, n, time0, time1, &box0, &box1);
+  auto hash = content_hash(prims, box0, box1);
+
+  std::string cache_path;
+  if (cache_dir) {
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.bvh",
+             static_cast<unsigned long long>(hash));
+    cache_path = std::string(cache_dir) + name;
+  }
+  bool cached = cache_dir && map_cache(cache_path, hash);
+  if (!cached) {
+    built_nodes_.reserve(2 * n / LEAF_SIZE_ + 1);
+    built_order_.resize(n);
+    build(prims.data(), n, 0, 0, box0, box1);
+    nodes_ = built_nodes_.data();
+    order_ = built_order_.data();
+    node_count_ = static_cast<uint32_t>(built_nodes_.size());
+    if (cache_dir) write_cache(cache_path, hash);
+  }
+  auto ms = std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - start)
+                .count();
+  std::cerr << "flat_bvh: " << n << " primitives, " << node_count_
+            << " nodes " << (cached ? "mapped from " : "built")
+            << (cached ? cache_path : "") << " in " << ms << " ms\n";
+}
+/**
+ * FNV-1a over the words of every box, in object order.
+ * The version is hashed too, a new layout never matches an old file.
+ */
+uint64_t flat_bvh::content_hash(std::vector<bvh_prim> const &prims,
+                                std::vector<aabb> const &box0,
+                                std::vector<aabb> const &box1) const {
+  uint64_t h = 14695981039346656037ull;
+  auto mix = [&](double x) {
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    h = (h ^ bits) * 1099511628211ull;
+  };
+  mix(VERSION_);
+  mix(time0_);
+  mix(time1_);
+  mix(static_cast<double>(prims.size()));
+  for (size_t i = 0; i < prims.size(); i++) {
+    for (int a = 0; a < 3; a++) {
+      mix(box0[i].min()[a]);
+      mix(box0[i].max()[a]);
+      mix(box1[i].min()[a]);
+      mix(box1[i].max()[a]);
+      mix(prims[i].centroid[a]);
+    }
+  }
+  return h;
+}
+/**
+ * depth first, the first child right after its parent.
+ * Same binned SAH as bvh_node, on one thread apart from the binning.
+ */
+uint32_t flat_bvh::build(bvh_prim *prims, size_t n, size_t first, int depth,
+                         std::vector<aabb> const &box0,
+                         std::vector<aabb> const &box1) {
+  auto idx = static_cast<uint32_t>(built_nodes_.size());
+  built_nodes_.emplace_back();
+  flat_bvh_node node;
+  for (int a = 0; a < 3; a++) {
+    node.lo0[a] = node.lo1[a] = INF_DBL;
+    node.hi0[a] = node.hi1[a] = -INF_DBL;
+  }
+  auto grow = [&](double *lo, double *hi, double const *plo,
+                  double const *phi) {
+    for (int a = 0; a < 3; a++) {
+      lo[a] = std::min(lo[a], plo[a]);
+      hi[a] = std::max(hi[a], phi[a]);
+    }
+  };
+  if (n <= LEAF_SIZE_) {
+    node.offset = static_cast<uint32_t>(first);
+    node.count = static_cast<uint16_t>(n);
+    node.axis = 0;
+    for (size_t i = 0; i < n; i++) {
+      auto k = prims[i].index;
+      built_order_[first + i] = static_cast<uint32_t>(k);
+      point3d lo0 = box0[k].min(), hi0 = box0[k].max();
+      point3d lo1 = box1[k].min(), hi1 = box1[k].max();
+      grow(node.lo0, node.hi0, &lo0[0], &hi0[0]);
+      grow(node.lo1, node.hi1, &lo1[0], &hi1[0]);
+    }
+  } else {
+    // past half the stack, median splits bound the depth
+    int axis = 0;
+    auto mid = depth < MAX_DEPTH_ / 2
+                   ? bvh_node::sah_partition(prims, n, true, &axis)
+                   : n / 2;
+    auto left = build(prims, mid, first, depth + 1, box0, box1);
+    auto right =
+        build(prims + mid, n - mid, first + mid, depth + 1, box0, box1);
+    for (auto child : {left, right}) {
+      auto const &c = built_nodes_[child];
+      grow(node.lo0, node.hi0, c.lo0, c.hi0);
+      grow(node.lo1, node.hi1, c.lo1, c.hi1);
+    }
+    node.offset = right;
+    node.count = 0;
+    node.axis = static_cast<uint8_t>(axis);
+  }
+  node.moving = 0;
+  for (int a = 0; a < 3; a++)
+    if (node.lo0[a] != node.lo1[a] || node.hi0[a] != node.hi1[a])
+      node.moving = 1;
+  built_nodes_[idx] = node;
+  return idx;
+}
+/**
+ * layout: header, nodes, object order, checked against the header
+ * and the file size before anything is used
+ */
+bool flat_bvh::map_cache(std::string const &cache_path, uint64_t hash) {
+  int fd = open(cache_path.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  void *map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size >= static_cast<off_t>(sizeof(header)))
+    map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // the mapping outlives the descriptor
+  close(fd);
+  if (map == MAP_FAILED) return false;
+
+  auto const *head = static_cast<header const *>(map);
+  size_t bytes = sizeof(header) + head->node_count * sizeof(flat_bvh_node) +
+                 head->object_count * sizeof(uint32_t);
+  bool ok = memcmp(head->magic, MAGIC_, 8) == 0 &&
+            head->version == VERSION_ && head->hash == hash &&
+            head->object_count == objects_.size() && head->time0 == time0_ &&
+            head->time1 == time1_ && head->node_count > 0 &&
+            bytes == static_cast<size_t>(st.st_size);
+  if (!ok) {
+    munmap(map, st.st_size);
+    return false;
+  }
+  map_ = map;
+  map_bytes_ = st.st_size;
+  node_count_ = head->node_count;
+  nodes_ = reinterpret_cast<flat_bvh_node const *>(head + 1);
+  order_ = reinterpret_cast<uint32_t const *>(nodes_ + node_count_);
+  return true;
+}
+void flat_bvh::write_cache(std::string const &cache_path,
+                           uint64_t hash) const {
+  header head;
+  memcpy(head.magic, MAGIC_, 8);
+  head.version = VERSION_;
+  head.node_count = node_count_;
+  head.object_count = objects_.size();
+  head.hash = hash;
+  head.time0 = time0_;
+  head.time1 = time1_;
+  /**
+   * written aside and renamed, a reader never sees half a file,
+   * aside by process so two writing the same tree do not mix
+   */
+  std::string tmp_path = cache_path + ".tmp." + std::to_string(getpid());
+  FILE *fp = fopen(tmp_path.c_str(), "wb");
+  if (!fp) {
+    std::cerr << "flat_bvh: Could not write cache '" << cache_path << "'.\n";
+    return;
+  }
+  bool ok = fwrite(&head, sizeof(head), 1, fp) == 1 &&
+            fwrite(nodes_, sizeof(flat_bvh_node), node_count_, fp) ==
+                node_count_ &&
+            fwrite(order_, sizeof(uint32_t), objects_.size(), fp) ==
+                objects_.size();
+  ok = fclose(fp) == 0 && ok;
+  if (!ok || rename(tmp_path.c_str(), cache_path.c_str()) != 0)
+    remove(tmp_path.c_str());
+}
+
+bool flat_bvh::node_hit(flat_bvh_node const &node, ray const &r,
+                        vec3d const &inv_dir, double t_min,
+                        double t_max) const {
+  double lo[3], hi[3];
+  if (node.moving) {
+    // the bounds at ray time, moving objects move linearly
+    auto s = clamp((r.time() - time0_) * inv_dt_, 0.0, 1.0);
+    for (int a = 0; a < 3; a++) {
+      lo[a] = (1 - s) * node.lo0[a] + s * node.lo1[a];
+      hi[a] = (1 - s) * node.hi0[a] + s * node.hi1[a];
+    }
+  } else {
+    for (int a = 0; a < 3; a++) {
+      lo[a] = node.lo0[a];
+      hi[a] = node.hi0[a];
+    }
+  }
+  for (int a = 0; a < 3; a++) {
+    auto t_0 = (lo[a] - r.origin()[a]) * inv_dir[a];
+    auto t_1 = (hi[a] - r.origin()[a]) * inv_dir[a];
+    if (inv_dir[a] < 0) std::swap(t_0, t_1);
+    t_min = t_0 > t_min ? t_0 : t_min;
+    t_max = t_1 < t_max ? t_1 : t_max;
+    if (t_min >= t_max) return false;
+  }
+  return true;
+}
+/**
+ * a stack of nodes to visit, the child nearer along the split axis
+ * first so hits shrink t_max before the far side is tested
+ */
+bool flat_bvh::hit(ray const &r, double t_min, double t_max,
+                   hit_record &rec) const {
+  if (node_count_ == 0) return false;
+  vec3d dir = r.direction();
+  vec3d inv_dir{1 / dir[0], 1 / dir[1], 1 / dir[2]};
+  uint32_t stack[MAX_DEPTH_];
+  int top = 0;
+  uint32_t idx = 0;
+  bool hit_any = false;
+  while (true) {
+    auto const &node = nodes_[idx];
+    STAT_COUNT(STAT_BVH_NODES);
+    if (node_hit(node, r, inv_dir, t_min, t_max)) {
+      if (node.count) {
+        STAT_ADD(STAT_BVH_TESTS, node.count);
+        for (uint32_t i = 0; i < node.count; i++) {
+          if (objects_[order_[node.offset + i]]->hit(r, t_min, t_max, rec)) {
+            hit_any = true;
+            t_max = rec.t;
+          }
+        }
+      } else if (inv_dir[node.axis] < 0) {
+        stack[top++] = idx + 1;
+        idx = node.offset;
+        continue;
+      } else {
+        stack[top++] = node.offset;
+        idx = idx + 1;
+        continue;
+      }
+    }
+    if (top == 0) break;
+    idx = stack[--top];
+  }
+  return hit_any;
+}
+bool flat_bvh::bounding_box(double tm0, double tm1, aabb &buf_aabb) const {
+  if (node_count_ == 0) return false;
+  auto const &root = nodes_[0];
+  buf_aabb = surrounding_aabb(
+      aabb{point3d{root.lo0[0], root.lo0[1], root.lo0[2]},
+           point3d{root.hi0[0], root.hi0[1], root.hi0[2]}},
+      aabb{point3d{root.lo1[0], root.lo1[1], root.lo1[2]},
+           point3d{root.hi1[0], root.hi1[1], root.hi1[2]}});
+  return true;
+}
+
+#endif
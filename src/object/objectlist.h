@@ -21,9 +21,12 @@ class object_list : public base_object {
                             aabb& buf_aabb) const override;
   virtual void get_uv(double const t, point3d const& p, double& u,
                       double& v) const override;
-  virtual double pdf_value(point3d const& origin,
-                           vec3d const& dir) const override;
+  virtual double pdf_value(point3d const& origin, vec3d const& dir,
+                           double t) const override;
   virtual vec3d random_sample(point3d const& origin, double t) const override;
+  virtual void refit() override {
+    for (auto const& obj : objects_) obj->refit();
+  }
 };
 
 bool object_list::hit(const ray& r, double t_min, double t_max,
@@ -59,13 +62,14 @@ void object_list::get_uv(double const t, point3d const& p, double& u,
   std::cerr << "object_list::get_uv: This class cannot get uv.\n";
 }
 
-double object_list::pdf_value(point3d const& origin, vec3d const& dir) const {
+double object_list::pdf_value(point3d const& origin, vec3d const& dir,
+                              double t) const {
   if (objects_.empty()) return 0.;
   // uniform distribution
   auto weight = 1.0 / objects_.size();
   auto sum = 0.0;
   for (auto const& obj : objects_) {
-    sum += obj->pdf_value(origin, dir);
+    sum += obj->pdf_value(origin, dir, t);
   }
   return sum * weight;
 }
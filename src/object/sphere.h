@@ -3,6 +3,7 @@
 
 #include "aabb.h"
 #include "baseobject.h"
+#include "onb.h"
 #include "rt_utils.h"
 class sphere : public base_object {
  private:
@@ -10,6 +11,8 @@ class sphere : public base_object {
   double time0_, time1_;
   double radius_;
   std::shared_ptr<base_material> mat_ptr_;
+  // keeps the same spheres in arrays
+  friend class sphere_set;
 
  public:
   sphere() {}
@@ -34,11 +37,21 @@ class sphere : public base_object {
                             aabb& buf_aabb) const override;
   virtual void get_uv(double const t, point3d const& p, double& u,
                       double& v) const override;
-  virtual double pdf_value(point3d const& origin,
-                           vec3d const& dir) const override;
+  virtual double pdf_value(point3d const& origin, vec3d const& dir,
+                           double t) const override;
   virtual vec3d random_sample(vec3d const& origin, double t) const override;
   vec3d center(double time) const;
   double radius() const;
+  /**
+   * the hit record of a sphere hit at root, shared with sphere_set
+   * so either gives the same record for the same hit
+   */
+  static void record(ray const& r, double root, point3d const& center,
+                     double radius,
+                     std::shared_ptr<base_material> const& mat,
+                     hit_record& rec);
+  // see get_uv(), p is the outward normal
+  static void uv(point3d const& p, double& u, double& v);
 };
 
 bool sphere::hit(const ray& r, double t_min, double t_max,
@@ -64,18 +77,35 @@ bool sphere::hit(const ray& r, double t_min, double t_max,
       // still not in range
       return false;
   }
-  /** record the hit **/
+  record(r, root, center(r.time()), radius_, mat_ptr_, rec);
+  return true;
+}
+void sphere::record(ray const& r, double root, point3d const& center,
+                    double radius, std::shared_ptr<base_material> const& mat,
+                    hit_record& rec) {
   rec.t = root;
   rec.p = r.at(root);
   // NOTE: only correct for sphere
   // this is normalized
-  vec3d outward_normal = (rec.p - center(r.time())) / radius_;
+  vec3d outward_normal = (rec.p - center) / radius;
   rec.set_face_normal(r, outward_normal);
-  rec.mat_ptr = mat_ptr_;
+  rec.mat_ptr = mat;
   // get texture
-  this->get_uv(rec.t, outward_normal, rec.u, rec.v);
-
-  return true;
+  uv(outward_normal, rec.u, rec.v);
+  /**
+   * derivatives of the uv mapping in get_uv(), with n the outward normal
+   *   n = (-sin(theta)cos(phi), -cos(theta), sin(theta)sin(phi))
+   * written back in n to save the trigonometry
+   */
+  auto const& n = outward_normal;
+  auto sin_theta = sqrt(n.x() * n.x() + n.z() * n.z());
+  rec.dndu = 2 * PI * vec3d{n.z(), 0, -n.x()};
+  rec.dndv = vec3d{0, 0, 0};
+  if (sin_theta > 0)
+    rec.dndv = PI / sin_theta *
+               vec3d{-n.y() * n.x(), sin_theta * sin_theta, -n.y() * n.z()};
+  rec.dpdu = radius * rec.dndu;
+  rec.dpdv = radius * rec.dndv;
 }
 bool sphere::bounding_box(double tm0, double tm1, aabb& buf_aabb) const {
   aabb box0{center(tm0) - vec3d{radius(), radius(), radius()},
@@ -93,6 +123,9 @@ vec3d sphere::center(double time) const {
 double sphere::radius() const { return this->radius_; }
 void sphere::get_uv(double const t, point3d const& p, double& u,
                     double& v) const {
+  uv(p, u, v);
+}
+void sphere::uv(point3d const& p, double& u, double& v) {
   /**
    * u (longtitude) v (latitude) coordinate is set as:
    *  a point on a unit sphere(center at origin)
@@ -110,23 +143,44 @@ void sphere::get_uv(double const t, point3d const& p, double& u,
   u = phi / (2 * PI);
   v = theta / PI;
 }
-// TODO implemention need check
-double sphere::pdf_value(point3d const& origin, vec3d const& dir) const {
-  hit_record rec;
-  if (!this->hit(ray(origin, dir), 0.001, INF_DBL, rec)) return 0;
+/**
+ * The sphere is sampled uniformly in the cone it subtends from origin,
+ * so a direction has density iff it is inside the cone.
+ * No intersection needed, and the cone follows the sphere at time t.
+ * From inside the sphere every direction hits, we fall back to
+ * uniform sampling on the unit sphere.
+ */
+double sphere::pdf_value(point3d const& origin, vec3d const& dir,
+                         double t) const {
+  vec3d oc = center(t) - origin;
+  auto distance_squared = oc.norm2();
+  auto sin2_theta_max = radius_ * radius_ / distance_squared;
+  if (sin2_theta_max >= 1.0) return 0.25 / PI;
 
-  auto cos_theta_max =
-      sqrt(1 - radius_ * radius_ / (center(rec.t) - origin).norm2());
-  auto solid_angle = 2 * PI * (1 - cos_theta_max);
+  auto cos_theta_max = sqrt(1 - sin2_theta_max);
+  auto cos_theta = dot(oc, dir) / sqrt(distance_squared * dir.norm2());
+  if (cos_theta < cos_theta_max) return 0;
+  // 1 - cos_theta_max, without cancellation for far and small spheres
+  auto one_minus_cos = sin2_theta_max / (1 + cos_theta_max);
 
-  return 1 / solid_angle;
+  return 1 / (2 * PI * one_minus_cos);
 }
 
 vec3d sphere::random_sample(point3d const& origin, double t) const {
-  vec3d direction = center(t) - origin;
-  auto distance_squared = direction.norm2();
+  vec3d oc = center(t) - origin;
+  auto distance_squared = oc.norm2();
+  auto sin2_theta_max = radius_ * radius_ / distance_squared;
+  if (sin2_theta_max >= 1.0) return random_unit_vector();
+
+  auto cos_theta_max = sqrt(1 - sin2_theta_max);
+  auto one_minus_cos = sin2_theta_max / (1 + cos_theta_max);
+  // uniform in [cos_theta_max, 1]
+  auto z = 1 - random_double() * one_minus_cos;
+  auto phi = 2 * PI * random_double();
+  auto sin_theta = sqrt(fmax(0.0, 1 - z * z));
+
   onb uvw;
-  uvw.build_from_w(direction);
-  return uvw.local(random_to_sphere(radius_, distance_squared));
+  uvw.build_from_unit_w(oc / sqrt(distance_squared));
+  return uvw.local(cos(phi) * sin_theta, sin(phi) * sin_theta, z);
 }
 #endif
@@ -0,0 +1,156 @@
+#ifndef TRIANGLE_MESH_H
+#define TRIANGLE_MESH_H
+
+#include <cstdint>
+#include <vector>
+
+#include "baseobject.h"
+#include "bvh.h"
+#include "rt_utils.h"
+
+class triangle_mesh;
+
+/**
+ * one triangle of a mesh, only an index into its buffers
+ */
+class mesh_triangle : public base_object {
+ private:
+  triangle_mesh const *mesh_;
+  uint32_t index_;
+
+ public:
+  mesh_triangle(triangle_mesh const *mesh, uint32_t index)
+      : mesh_{mesh}, index_{index} {}
+  virtual bool hit(ray const &r, double t_min, double t_max,
+                   hit_record &rec) const override;
+  virtual bool bounding_box(double tm0, double tm1,
+                            aabb &buf_aabb) const override;
+};
+
+/**
+ * Triangles straight from buffers: xyz floats per vertex,
+ * three vertex indices and one material id per triangle.
+ * The buffers are not copied, owner keeps them alive,
+ * be it the vectors of an OBJ or a mapped binary scene.
+ *
+ * uv is barycentric, flat shaded, a bvh over the triangles inside.
+ */
+class triangle_mesh : public base_object {
+ private:
+  float const *positions_;
+  uint32_t const *indices_;
+  uint32_t const *material_ids_;
+  size_t vertex_count_, triangle_count_;
+  // by material id, ids past the end take the first
+  std::vector<shared_ptr<base_material>> materials_;
+  shared_ptr<void const> owner_;
+  shared_ptr<bvh_node> bvh_;
+
+ public:
+  triangle_mesh(float const *positions, size_t vertex_count,
+                uint32_t const *indices, uint32_t const *material_ids,
+                size_t triangle_count,
+                std::vector<shared_ptr<base_material>> materials,
+                shared_ptr<void const> owner);
+  triangle_mesh(triangle_mesh const &) = delete;
+  triangle_mesh &operator=(triangle_mesh const &) = delete;
+
+  point3d vertex(uint32_t i) const {
+    auto p = positions_ + 3 * static_cast<size_t>(i);
+    return point3d{p[0], p[1], p[2]};
+  }
+  uint32_t const *triangle(uint32_t i) const {
+    return indices_ + 3 * static_cast<size_t>(i);
+  }
+  shared_ptr<base_material> const &material(uint32_t i) const {
+    auto id = material_ids_[i];
+    return materials_[id < materials_.size() ? id : 0];
+  }
+  size_t triangle_count() const { return triangle_count_; }
+
+  virtual bool hit(ray const &r, double t_min, double t_max,
+                   hit_record &rec) const override {
+    return bvh_->hit(r, t_min, t_max, rec);
+  }
+  virtual bool bounding_box(double tm0, double tm1,
+                            aabb &buf_aabb) const override {
+    return bvh_->bounding_box(tm0, tm1, buf_aabb);
+  }
+};
+
+triangle_mesh::triangle_mesh(float const *positions, size_t vertex_count,
+                             uint32_t const *indices,
+                             uint32_t const *material_ids,
+                             size_t triangle_count,
+                             std::vector<shared_ptr<base_material>> materials,
+                             shared_ptr<void const> owner)
+    : positions_{positions},
+      indices_{indices},
+      material_ids_{material_ids},
+      vertex_count_{vertex_count},
+      triangle_count_{triangle_count},
+      materials_{std::move(materials)},
+      owner_{owner} {
+  std::vector<shared_ptr<base_object>> triangles(triangle_count);
+  for (size_t i = 0; i < triangle_count; i++)
+    triangles[i] = make_shared<mesh_triangle>(this, static_cast<uint32_t>(i));
+  bvh_ = make_shared<bvh_node>(triangles, 0, triangles.size(), 0, 1);
+}
+
+/**
+ * Moller-Trumbore, the barycentrics of p1 and p2 are (u, v)
+ */
+bool mesh_triangle::hit(ray const &r, double t_min, double t_max,
+                        hit_record &rec) const {
+  auto idx = mesh_->triangle(index_);
+  auto p0 = mesh_->vertex(idx[0]);
+  auto e1 = mesh_->vertex(idx[1]) - p0;
+  auto e2 = mesh_->vertex(idx[2]) - p0;
+  auto pvec = cross(r.direction(), e2);
+  auto det = dot(e1, pvec);
+  // parallel to the plane
+  if (det == 0) return false;
+  auto inv_det = 1 / det;
+  auto tvec = r.origin() - p0;
+  auto u = dot(tvec, pvec) * inv_det;
+  if (u < 0 || u > 1) return false;
+  auto qvec = cross(tvec, e1);
+  auto v = dot(r.direction(), qvec) * inv_det;
+  if (v < 0 || u + v > 1) return false;
+  auto t = dot(e2, qvec) * inv_det;
+  if (t < t_min || t > t_max) return false;
+
+  rec.t = t;
+  rec.p = r.at(t);
+  rec.u = u;
+  rec.v = v;
+  rec.dpdu = e1;
+  rec.dpdv = e2;
+  rec.dndu = rec.dndv = vec3d{0, 0, 0};
+  rec.set_face_normal(r, unit_vector(cross(e1, e2)));
+  rec.mat_ptr = mesh_->material(index_);
+  return true;
+}
+bool mesh_triangle::bounding_box(double tm0, double tm1,
+                                 aabb &buf_aabb) const {
+  auto idx = mesh_->triangle(index_);
+  point3d lo = mesh_->vertex(idx[0]), hi = lo;
+  for (int k = 1; k < 3; k++) {
+    auto p = mesh_->vertex(idx[k]);
+    for (int a = 0; a < 3; a++) {
+      lo[a] = std::min(lo[a], p[a]);
+      hi[a] = std::max(hi[a], p[a]);
+    }
+  }
+  // a little padding on flat axes, as the rectangles do
+  for (int a = 0; a < 3; a++) {
+    if (hi[a] - lo[a] < 0.0001) {
+      lo[a] -= 0.00005;
+      hi[a] += 0.00005;
+    }
+  }
+  buf_aabb = aabb{lo, hi};
+  return true;
+}
+
+#endif
@@ -0,0 +1,118 @@
+#ifndef ANIMATION_H
+#define ANIMATION_H
+
+#include <utility>
+#include <vector>
+
+#include "baseobject.h"
+#include "rt_utils.h"
+#include "transform.h"
+
+/**
+ * Keyframes, linear between keys and held before the first
+ * and after the last. Time is in frames.
+ */
+struct transform_key {
+  double time;
+  vec3d offset;
+  vec3d axis;    // rotation about axis by angle degrees
+  double angle;
+  vec3d scale;
+};
+struct camera_key {
+  double time;
+  point3d lookfrom, lookat;
+  double vfov;
+};
+
+// index of the last key at or before time, and the fraction to the next
+template <typename Key>
+size_t locate_key(std::vector<Key> const& keys, double time, double& s) {
+  size_t i = 0;
+  while (i + 1 < keys.size() && keys[i + 1].time <= time) i++;
+  s = 0;
+  if (i + 1 < keys.size() && time > keys[i].time)
+    s = (time - keys[i].time) / (keys[i + 1].time - keys[i].time);
+  return i;
+}
+
+/**
+ * Key values interpolated separately then composed as
+ * translate * rotate * scale, so a turn stays a turn.
+ * The axis is lerped and normalized, keep it fixed to spin.
+ */
+class transform_track {
+ private:
+  std::vector<transform_key> keys_;  // sorted by time
+
+ public:
+  transform_track() {}
+  void add(transform_key const& key);
+  transform at(double time) const;
+};
+
+class animation {
+ private:
+  std::vector<std::pair<shared_ptr<transform_instance>, transform_track>>
+      tracks_;
+  std::vector<camera_key> camera_keys_;  // sorted by time
+
+ public:
+  /**
+   * instance follows track from now on.
+   * Register before wrapping the instance in another transform,
+   * an animated instance is not collapsed into its wrapper.
+   */
+  void animate(shared_ptr<transform_instance> instance,
+               transform_track const& track);
+  void add_camera_key(camera_key const& key);
+  bool has_camera() const { return !camera_keys_.empty(); }
+  camera_key camera_at(double time) const;
+  // set every instance to its transform at time, bvhs need a refit() after
+  void apply(double time) const;
+};
+
+void transform_track::add(transform_key const& key) {
+  auto it = keys_.begin();
+  while (it != keys_.end() && it->time <= key.time) it++;
+  keys_.insert(it, key);
+}
+transform transform_track::at(double time) const {
+  if (keys_.empty()) return transform{};
+  double s;
+  auto i = locate_key(keys_, time, s);
+  auto const& k0 = keys_[i];
+  auto const& k1 = keys_[std::min(i + 1, keys_.size() - 1)];
+  auto offset = (1 - s) * k0.offset + s * k1.offset;
+  auto axis = (1 - s) * k0.axis + s * k1.axis;
+  auto angle = (1 - s) * k0.angle + s * k1.angle;
+  auto scale = (1 - s) * k0.scale + s * k1.scale;
+  return transform::translation(offset) * transform::rotation(axis, angle) *
+         transform::scaling(scale);
+}
+
+void animation::animate(shared_ptr<transform_instance> instance,
+                        transform_track const& track) {
+  instance->set_transform(track.at(0));
+  tracks_.emplace_back(instance, track);
+}
+void animation::add_camera_key(camera_key const& key) {
+  auto it = camera_keys_.begin();
+  while (it != camera_keys_.end() && it->time <= key.time) it++;
+  camera_keys_.insert(it, key);
+}
+camera_key animation::camera_at(double time) const {
+  double s;
+  auto i = locate_key(camera_keys_, time, s);
+  auto const& k0 = camera_keys_[i];
+  auto const& k1 = camera_keys_[std::min(i + 1, camera_keys_.size() - 1)];
+  return camera_key{time, (1 - s) * k0.lookfrom + s * k1.lookfrom,
+                    (1 - s) * k0.lookat + s * k1.lookat,
+                    (1 - s) * k0.vfov + s * k1.vfov};
+}
+void animation::apply(double time) const {
+  for (auto const& track : tracks_)
+    track.first->set_transform(track.second.at(time));
+}
+
+#endif
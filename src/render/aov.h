@@ -0,0 +1,120 @@
+#ifndef AOV_H
+#define AOV_H
+
+/**
+ * Images of things other than radiance (AOVs), written next to the
+ * beauty pass as float .hdr files:
+ *   albedo   see first_hit
+ *   normal   of the first hit, facing the camera, as n / 2 + 0.5
+ *            since .hdr holds no negatives
+ *   depth    distance to the first hit, 0 on a miss
+ *   time     ms spent on the pixel
+ *   steps    bvh nodes visited per sample
+ *   bounces  rays traced per sample, the path length
+ * The first three are averaged over the camera rays of a pixel.
+ * steps and bounces come from the stats counters and are left out
+ * without SLOWPT_STATS. The last three need the pixels rendered one
+ * at a time, --wavefront traces a row at once and leaves them out.
+ */
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "image_utils.h"
+#include "integrator.h"
+#include "rt_utils.h"
+#include "stats.h"
+
+class aov_buffers {
+ public:
+  enum kind { ALBEDO, NORMAL, DEPTH, TIME, STEPS, BOUNCES, KIND_COUNT };
+
+  // per_pixel if begin_pixel() and end_pixel() are called
+  aov_buffers(int w, int h, bool per_pixel);
+  // one sample of pixel (x, y), x from the left and y from the top
+  void add(int x, int y, first_hit const &f, int spp);
+  /**
+   * around the samples of one pixel, the clock and the counters are
+   * read before and what they moved is stored after
+   */
+  void begin_pixel();
+  void end_pixel(int x, int y, int spp);
+  // <prefix>_<kind>.hdr, false after reporting
+  bool write(std::string const &prefix) const;
+
+ private:
+  static int const CHANNELS_[KIND_COUNT];
+  static char const *const NAMES_[KIND_COUNT];
+
+  int w_, h_;
+  bool per_pixel_;
+  std::vector<float> images_[KIND_COUNT];
+  std::chrono::steady_clock::time_point start_;
+  uint64_t nodes_ = 0, traced_ = 0;
+
+  float *pixel(kind k, int x, int y) {
+    return &images_[k][(size_t(y) * w_ + x) * CHANNELS_[k]];
+  }
+  bool written(kind k) const;
+};
+int const aov_buffers::CHANNELS_[KIND_COUNT] = {3, 3, 1, 1, 1, 1};
+char const *const aov_buffers::NAMES_[KIND_COUNT] = {
+    "albedo", "normal", "depth", "time", "steps", "bounces"};
+
+aov_buffers::aov_buffers(int w, int h, bool per_pixel)
+    : w_{w}, h_{h}, per_pixel_{per_pixel} {
+  for (int k = 0; k < KIND_COUNT; k++)
+    if (written(kind(k))) images_[k].assign(size_t(w) * h * CHANNELS_[k], 0.0f);
+}
+void aov_buffers::add(int x, int y, first_hit const &f, int spp) {
+  float scale = 1.0f / spp;
+  auto albedo = pixel(ALBEDO, x, y), normal = pixel(NORMAL, x, y);
+  for (int c = 0; c < 3; c++) {
+    albedo[c] += scale * f.albedo[c];
+    // a miss has no normal, it stays 0 rather than 0.5
+    if (f.depth > 0) normal[c] += scale * (0.5 * f.normal[c] + 0.5);
+  }
+  *pixel(DEPTH, x, y) += scale * f.depth;
+}
+void aov_buffers::begin_pixel() {
+#ifdef SLOWPT_STATS
+  auto const &counts = render_stats::local().counts;
+  nodes_ = counts[STAT_BVH_NODES];
+  traced_ = counts[STAT_TRACED_RAYS];
+#endif
+  start_ = std::chrono::steady_clock::now();
+}
+void aov_buffers::end_pixel(int x, int y, int spp) {
+  *pixel(TIME, x, y) = std::chrono::duration<float, std::milli>(
+                           std::chrono::steady_clock::now() - start_)
+                           .count();
+#ifdef SLOWPT_STATS
+  auto const &counts = render_stats::local().counts;
+  *pixel(STEPS, x, y) = float(counts[STAT_BVH_NODES] - nodes_) / spp;
+  *pixel(BOUNCES, x, y) = float(counts[STAT_TRACED_RAYS] - traced_) / spp;
+#endif
+}
+bool aov_buffers::written(kind k) const {
+  if (k < TIME) return true;
+#ifdef SLOWPT_STATS
+  return per_pixel_;
+#else
+  return per_pixel_ && k == TIME;
+#endif
+}
+bool aov_buffers::write(std::string const &prefix) const {
+  for (int k = 0; k < KIND_COUNT; k++) {
+    if (!written(kind(k))) continue;
+    auto path = prefix + "_" + NAMES_[k] + ".hdr";
+    if (!stbi_write_hdr(path.c_str(), w_, h_, CHANNELS_[k],
+                        images_[k].data())) {
+      std::cerr << "ERROR: Could not write '" << path << "'.\n";
+      return false;
+    }
+  }
+  return true;
+}
+
+#endif
@@ -0,0 +1,231 @@
+#ifndef DENOISE_H
+#define DENOISE_H
+
+/**
+ * Edge-avoiding A-Trous wavelet filter over the finished image, as in
+ * SVGF (Schied et al. 2017) without the temporal part.
+ *
+ * The radiance is divided by the albedo of the first hit, so texture
+ * stays sharp and only the lighting is blurred, and multiplied back
+ * after. The lighting goes through ITERATIONS_ passes of a 5x5 B3
+ * spline kernel whose taps are 1, 2, 4... pixels apart. A tap counts
+ * less the more its normal, depth and luminance differ from the
+ * center. How much luminance may differ comes from its variance,
+ * counted over the samples of each pixel and filtered along, so noisy
+ * pixels are blurred and converged ones are left alone.
+ *
+ * With fewer than MIN_SPP_ samples the variance is that of the pixels
+ * around instead. Glass and mirrors give the guides of their own
+ * surface, what is seen in them blurs along with it. Each pass runs
+ * over tiles on all cores.
+ */
+
+#include <cmath>
+#include <vector>
+
+#include "colorRGB.h"
+#include "integrator.h"
+#include "parallel.h"
+#include "rt_utils.h"
+
+class denoiser {
+ public:
+  denoiser(int w, int h);
+  // one sample of pixel (x, y), x from the left and y from the top
+  void add(int x, int y, color_rgb const &c, first_hit const &f);
+  /**
+   * filters sums, the spp samples of each pixel summed as the render
+   * loop does and rows from the top, in place
+   * @param strength how far luminance may differ, 1 is as SVGF,
+   *                 larger is smoother
+   */
+  void run(std::vector<color_rgb> &sums, int spp, double strength) const;
+
+ private:
+  static int const ITERATIONS_ = 5;
+  static int const TILE_ = 32;
+  // samples per pixel to tell their variance by
+  static int const MIN_SPP_ = 4;
+  // below it the albedo is not divided out, or noise would blow up
+  static constexpr float ALBEDO_MIN_ = 0.01f;
+  // exponent of the normal weight and scale of the depth one, as SVGF
+  static int const NORMAL_POWER_LOG2_ = 7;
+  static constexpr float SIGMA_DEPTH_ = 1.0f;
+  static constexpr float SIGMA_LUM_ = 4.0f;
+
+  int w_, h_;
+  // sums over the samples of each pixel
+  std::vector<color_rgb> albedo_;
+  std::vector<vec3d> normal_;
+  std::vector<float> depth_;
+  std::vector<float> lum_, lum2_;  // of the lighting, albedo divided out
+
+  static float luminance(color_rgb const &c) {
+    return float(0.2126 * c[0] + 0.7152 * c[1] + 0.0722 * c[2]);
+  }
+  static color_rgb albedo_floor(color_rgb a) {
+    for (int c = 0; c < 3; c++) a[c] = std::max(double(ALBEDO_MIN_), a[c]);
+    return a;
+  }
+  static color_rgb divide(color_rgb c, color_rgb const &a) {
+    for (int i = 0; i < 3; i++) c[i] /= a[i];
+    return c;
+  }
+  // f(x, y) for the pixels of each tile, the tiles on all cores
+  template <typename Func>
+  void for_tiles(Func func) const;
+};
+int const denoiser::ITERATIONS_;
+int const denoiser::TILE_;
+int const denoiser::MIN_SPP_;
+constexpr float denoiser::ALBEDO_MIN_;
+int const denoiser::NORMAL_POWER_LOG2_;
+constexpr float denoiser::SIGMA_DEPTH_;
+constexpr float denoiser::SIGMA_LUM_;
+
+denoiser::denoiser(int w, int h)
+    : w_{w},
+      h_{h},
+      albedo_(size_t(w) * h, color_rgb{0, 0, 0}),
+      normal_(size_t(w) * h, vec3d{0, 0, 0}),
+      depth_(size_t(w) * h, 0.0f),
+      lum_(size_t(w) * h, 0.0f),
+      lum2_(size_t(w) * h, 0.0f) {}
+void denoiser::add(int x, int y, color_rgb const &c, first_hit const &f) {
+  size_t p = size_t(y) * w_ + x;
+  albedo_[p] += f.albedo;
+  normal_[p] += f.normal;
+  depth_[p] += float(f.depth);
+  // NaN as write_color() does, dropped
+  float l = luminance(divide(c, albedo_floor(f.albedo)));
+  if (l != l) return;
+  lum_[p] += l;
+  lum2_[p] += l * l;
+}
+template <typename Func>
+void denoiser::for_tiles(Func func) const {
+  int tiles_x = (w_ + TILE_ - 1) / TILE_, tiles_y = (h_ + TILE_ - 1) / TILE_;
+  parallel_for(0, size_t(tiles_x) * tiles_y, [&](size_t t) {
+    int x0 = int(t % tiles_x) * TILE_, y0 = int(t / tiles_x) * TILE_;
+    for (int y = y0; y < std::min(h_, y0 + TILE_); y++)
+      for (int x = x0; x < std::min(w_, x0 + TILE_); x++) func(x, y);
+  });
+}
+void denoiser::run(std::vector<color_rgb> &sums, int spp,
+                   double strength) const {
+  size_t n = size_t(w_) * h_;
+  float inv_spp = 1.0f / spp;
+  std::vector<color_rgb> albedo(n), light(n), light_out(n);
+  std::vector<vec3d> normal(n);
+  std::vector<float> depth(n), var(n), var_out(n);
+  // the means, the lighting and the variance of its mean luminance
+  for_tiles([&](int x, int y) {
+    size_t p = size_t(y) * w_ + x;
+    albedo[p] = albedo_floor(albedo_[p] * inv_spp);
+    auto mean = sums[p] * inv_spp;
+    for (int c = 0; c < 3; c++)
+      if (mean[c] != mean[c]) mean[c] = 0;
+    light[p] = divide(mean, albedo[p]);
+    // a miss has no normal and stays 0
+    auto len = normal_[p].norm();
+    normal[p] = len > 0 ? normal_[p] / len : normal_[p];
+    depth[p] = depth_[p] * inv_spp;
+    float m = lum_[p] * inv_spp;
+    var[p] = std::max(0.0f, lum2_[p] * inv_spp - m * m) * inv_spp;
+  });
+  // of the 7x7 luminances around, those of a hit or a miss alike
+  if (spp < MIN_SPP_) {
+    for_tiles([&](int x, int y) {
+      size_t p = size_t(y) * w_ + x;
+      float m = 0, m2 = 0;
+      int count = 0;
+      for (int yy = std::max(0, y - 3); yy <= std::min(h_ - 1, y + 3); yy++)
+        for (int xx = std::max(0, x - 3); xx <= std::min(w_ - 1, x + 3); xx++) {
+          size_t q = size_t(yy) * w_ + xx;
+          if ((depth[p] == 0) != (depth[q] == 0)) continue;
+          float l = luminance(light[q]);
+          m += l;
+          m2 += l * l;
+          count++;
+        }
+      m /= count;
+      var[p] = std::max(0.0f, m2 / count - m * m);
+    });
+  }
+  /**
+   * change of depth per pixel, the smaller side of each axis
+   * so a silhouette does not count as a slope
+   */
+  std::vector<float> slope_x(n), slope_y(n);
+  for_tiles([&](int x, int y) {
+    size_t p = size_t(y) * w_ + x;
+    auto side = [&](int dx, int dy) {
+      int xx = x + dx, yy = y + dy;
+      if (xx < 0 || yy < 0 || xx >= w_ || yy >= h_) return float(INF_DBL);
+      return std::fabs(depth[size_t(yy) * w_ + xx] - depth[p]);
+    };
+    slope_x[p] = std::min(side(-1, 0), side(1, 0));
+    slope_y[p] = std::min(side(0, -1), side(0, 1));
+  });
+
+  float const kernel[3] = {3.0f / 8, 1.0f / 4, 1.0f / 16};
+  float const sigma_lum = float(SIGMA_LUM_ * strength);
+  for (int it = 0; it < ITERATIONS_; it++) {
+    int step = 1 << it;
+    for_tiles([&](int x, int y) {
+      size_t p = size_t(y) * w_ + x;
+      // the variance is blurred over 3x3 first, one pixel's is noisy
+      float var_p = 0, var_w = 0;
+      for (int dy = -1; dy <= 1; dy++)
+        for (int dx = -1; dx <= 1; dx++) {
+          int xx = x + dx, yy = y + dy;
+          if (xx < 0 || yy < 0 || xx >= w_ || yy >= h_) continue;
+          float k = (dx ? 0.5f : 1.0f) * (dy ? 0.5f : 1.0f);
+          var_p += k * var[size_t(yy) * w_ + xx];
+          var_w += k;
+        }
+      float lum_scale = sigma_lum * std::sqrt(var_p / var_w) + 1e-6f;
+      float lum_p = luminance(light[p]);
+      bool miss_p = depth[p] == 0;
+
+      color_rgb sum{0, 0, 0};
+      float weight_sum = 0, var_sum = 0;
+      for (int ky = -2; ky <= 2; ky++)
+        for (int kx = -2; kx <= 2; kx++) {
+          int xx = x + kx * step, yy = y + ky * step;
+          if (xx < 0 || yy < 0 || xx >= w_ || yy >= h_) continue;
+          size_t q = size_t(yy) * w_ + xx;
+          float w = kernel[std::abs(kx)] * kernel[std::abs(ky)];
+          if (q != p) {
+            // misses are alike, a miss and a hit are not
+            if (miss_p != (depth[q] == 0)) continue;
+            if (!miss_p) {
+              float nd = float(std::max(0.0, dot(normal[p], normal[q])));
+              for (int i = 0; i < NORMAL_POWER_LOG2_; i++) nd *= nd;
+              float dz = std::fabs(depth[p] - depth[q]);
+              float dz_scale = SIGMA_DEPTH_ * (slope_x[p] * std::abs(kx) +
+                                               slope_y[p] * std::abs(ky)) *
+                                   step +
+                               1e-3f * depth[p];
+              w *= nd * std::exp(-dz / dz_scale);
+            }
+            w *= std::exp(-std::fabs(lum_p - luminance(light[q])) / lum_scale);
+          }
+          sum += w * light[q];
+          weight_sum += w;
+          var_sum += w * w * var[q];
+        }
+      // the center always counts, weight_sum > 0
+      light_out[p] = sum / weight_sum;
+      var_out[p] = var_sum / (weight_sum * weight_sum);
+    });
+    light.swap(light_out);
+    var.swap(var_out);
+  }
+  for_tiles([&](int x, int y) {
+    size_t p = size_t(y) * w_ + x;
+    sums[p] = light[p] * albedo[p] * double(spp);
+  });
+}
+
+#endif
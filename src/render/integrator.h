@@ -0,0 +1,272 @@
+#ifndef INTEGRATOR_H
+#define INTEGRATOR_H
+
+#include <algorithm>
+#include <vector>
+
+#include "baseobject.h"
+#include "envlight.h"
+#include "material.h"
+#include "pdf.h"
+#include "rt_utils.h"
+#include "stats.h"
+
+/**
+ * what a camera ray hits first, for the aov images.
+ * The albedo is the attenuation of the scatter, or the emission
+ * of what does not scatter, or the sky on a miss.
+ */
+struct first_hit {
+  color_rgb albedo{0, 0, 0};
+  vec3d normal{0, 0, 0};  // facing the ray
+  double depth = 0;       // distance, 0 on a miss
+  void set(ray const &r, hit_record const &h_rec, color_rgb const &color) {
+    for (int c = 0; c < 3; c++) albedo[c] = clamp(color[c], 0.0, 1.0);
+    normal = unit_vector(h_rec.normal);
+    depth = h_rec.t * r.direction().norm();
+  }
+};
+
+/**
+ * direction of a non specular scatter from p and its density. With
+ * lights, a fair coin picks a point on them or the material_pdf of
+ * s_rec, and the density is the average of the two.
+ */
+inline vec3d sample_scatter(scatter_record const &s_rec, point3d const &p,
+                            double time, base_object const *lights,
+                            double &pdf_val) {
+  if (!lights) {
+    auto dir = s_rec.pdf.generate();
+    pdf_val = s_rec.pdf.value(dir);
+    return dir;
+  }
+  auto dir = random_double() < 0.5 ? lights->random_sample(p, time)
+                                   : s_rec.pdf.generate();
+  pdf_val = 0.5 * lights->pdf_value(p, dir, time) + 0.5 * s_rec.pdf.value(dir);
+  return dir;
+}
+
+/**
+ * cast a ray to the world and get its color
+ * @param first if given, gets what the ray hits first
+ */
+color_rgb ray_color(ray const &r_in, color_rgb const &background,
+                    env_light const *env, base_object const &world,
+                    shared_ptr<base_object> lights, int bounce_depth,
+                    first_hit *first = nullptr) {
+  hit_record h_rec;
+
+  // if ray reaches max bounce it gets nothing
+  if (bounce_depth <= 0) return color_rgb{0, 0, 0};
+  STAT_COUNT(STAT_TRACED_RAYS);
+  // if ray does not hit anything it gets backround color,
+  // or the environment in that direction
+  if (!world.hit(r_in, 0.001, INF_DBL, h_rec)) {
+    STAT_COUNT(STAT_ESCAPED_RAYS);
+    auto sky = env ? env->value(r_in.direction()) : background;
+    if (first) first->albedo = sky;
+    return sky;
+  }
+  // texture footprint, zero if the ray carries no differentials
+  h_rec.compute_differentials(r_in);
+
+  scatter_record s_rec;
+  color_rgb emit_color =
+      h_rec.mat_ptr->emit(r_in, h_rec, h_rec.u, h_rec.v, h_rec.p);
+
+  // if the material scatters light this ray gets scatter and emit
+  STAT_SCATTER(h_rec.mat_ptr->name(), 1);
+  bool scattered = h_rec.mat_ptr->scatter(r_in, h_rec, s_rec);
+  if (first) first->set(r_in, h_rec, scattered ? s_rec.attenuation : emit_color);
+  if (!scattered) return emit_color;
+
+  // clang-format off
+  if (s_rec.is_specular) {
+    STAT_COUNT(STAT_SPECULAR_RAYS);
+    return s_rec.attenuation
+            * ray_color(s_rec.ray_specular, background, env,
+                        world, lights,      bounce_depth - 1);
+  }
+  // clang-format on
+
+  // mixture importance sampling,
+  // with no lights to sample we use the material only
+  double sample_pdf_val;
+  ray r_out{h_rec.p,
+            sample_scatter(s_rec, h_rec.p, r_in.time(), lights.get(),
+                           sample_pdf_val),
+            r_in.time()};
+  STAT_COUNT(STAT_SCATTERED_RAYS);
+
+  // clang-format off
+  return emit_color
+         + s_rec.attenuation
+            * h_rec.mat_ptr->scatter_pdf(r_in, h_rec, r_out)
+            * ray_color(r_out, background, env,
+                        world,     lights, bounce_depth - 1) / sample_pdf_val;
+  // clang-format on
+}
+/**
+ * The same estimate as ray_color() for a batch of camera rays,
+ * one bounce of every path at a time. Throughput is carried
+ * forward instead of recursing.
+ *
+ * Each bounce the hits are sorted by (shading cost, material id),
+ * so every material shades all its hits in one scatter_batch()
+ * call and cheap materials go first. The order does not depend on
+ * addresses, a seeded render draws the same numbers every run.
+ *
+ * The buffers are kept between batches, make one per thread.
+ */
+class wavefront_integrator {
+ private:
+  struct path {
+    ray r;
+    color_rgb throughput;
+    size_t index;  // into radiance
+  };
+  // sort keys are cost, material id and hit index in these bits
+  static int const HIT_BITS_ = 24, ID_BITS_ = 24;
+  color_rgb background_;
+  env_light const *env_;
+  base_object const &world_;
+  shared_ptr<base_object> lights_;
+  int max_bounce_;
+
+  std::vector<path> paths_, next_;
+  // paths_ that hit, by index, and what they hit
+  std::vector<uint32_t> alive_;
+  std::vector<hit_record> hits_;
+  std::vector<uint64_t> order_;  // sort keys
+  // the hits of this bounce in shading order
+  std::vector<ray> batch_rays_;
+  std::vector<hit_record> batch_hits_;
+  std::vector<scatter_record> s_recs_;
+  std::vector<unsigned char> scattered_;
+  shade_scratch scratch_;
+  // filled on the first bounce, when asked for
+  std::vector<first_hit> *first_ = nullptr;
+
+  // intersect and shade, paths_ holds the next bounce after
+  void bounce(std::vector<color_rgb> &radiance);
+
+ public:
+  wavefront_integrator(color_rgb const &background, env_light const *env,
+                       base_object const &world,
+                       shared_ptr<base_object> lights, int max_bounce)
+      : background_{background},
+        env_{env},
+        world_(world),
+        lights_{lights},
+        max_bounce_{max_bounce} {}
+  /**
+   * @param camera_rays fewer than 2^HIT_BITS_
+   * @param radiance one color per camera ray
+   * @param first if given, what each camera ray hits first
+   */
+  void trace(std::vector<ray> const &camera_rays,
+             std::vector<color_rgb> &radiance,
+             std::vector<first_hit> *first = nullptr);
+};
+
+void wavefront_integrator::trace(std::vector<ray> const &camera_rays,
+                                 std::vector<color_rgb> &radiance,
+                                 std::vector<first_hit> *first) {
+  radiance.assign(camera_rays.size(), color_rgb{0, 0, 0});
+  if (first) first->assign(camera_rays.size(), first_hit{});
+  paths_.resize(camera_rays.size());
+  for (size_t i = 0; i < paths_.size(); i++)
+    paths_[i] = path{camera_rays[i], color_rgb{1, 1, 1}, i};
+  first_ = first;
+  for (int depth = max_bounce_; depth > 0 && !paths_.empty(); depth--) {
+    bounce(radiance);
+    first_ = nullptr;
+  }
+}
+void wavefront_integrator::bounce(std::vector<color_rgb> &radiance) {
+  // intersect, the misses end here
+  alive_.clear();
+  hits_.clear();
+  STAT_ADD(STAT_TRACED_RAYS, paths_.size());
+  for (size_t i = 0; i < paths_.size(); i++) {
+    auto const &pa = paths_[i];
+    // a fresh record as ray_color() has, made in place
+    hits_.emplace_back();
+    if (!world_.hit(pa.r, 0.001, INF_DBL, hits_.back())) {
+      hits_.pop_back();
+      STAT_COUNT(STAT_ESCAPED_RAYS);
+      auto sky = env_ ? env_->value(pa.r.direction()) : background_;
+      if (first_) (*first_)[pa.index].albedo = sky;
+      radiance[pa.index] += pa.throughput * sky;
+      continue;
+    }
+    hits_.back().compute_differentials(pa.r);
+    alive_.push_back(static_cast<uint32_t>(i));
+  }
+  size_t n = hits_.size();
+
+  // group the hits by material, cheapest first, one key each is
+  // sorted much faster than structs compared field by field
+  uint64_t const hit_mask = (uint64_t(1) << HIT_BITS_) - 1;
+  uint64_t const id_mask = (uint64_t(1) << ID_BITS_) - 1;
+  order_.resize(n);
+  for (size_t i = 0; i < n; i++) {
+    auto mat = hits_[i].mat_ptr.get();
+    uint64_t cost = std::min(mat->shading_cost(), 0xffff);
+    order_[i] = cost << (HIT_BITS_ + ID_BITS_) |
+                (mat->id() & id_mask) << HIT_BITS_ | i;
+  }
+  std::sort(order_.begin(), order_.end());
+  batch_rays_.resize(n);
+  batch_hits_.resize(n);
+  for (size_t k = 0; k < n; k++) {
+    batch_rays_[k] = paths_[alive_[order_[k] & hit_mask]].r;
+    batch_hits_[k] = std::move(hits_[order_[k] & hit_mask]);
+  }
+  // every field a material reads is set by its scatter
+  s_recs_.resize(n);
+  scattered_.resize(n);
+  for (size_t b = 0, e; b < n; b = e) {
+    auto mat = batch_hits_[b].mat_ptr.get();
+    for (e = b + 1; e < n && batch_hits_[e].mat_ptr.get() == mat;) e++;
+    STAT_SCATTER(mat->name(), e - b);
+    mat->scatter_batch(&batch_rays_[b], &batch_hits_[b], &s_recs_[b],
+                       &scattered_[b], e - b, scratch_);
+  }
+
+  // emit, then continue the paths that scattered
+  next_.clear();
+  for (size_t k = 0; k < n; k++) {
+    auto const &pa = paths_[alive_[order_[k] & hit_mask]];
+    auto const &r_in = batch_rays_[k];
+    auto const &h_rec = batch_hits_[k];
+    auto const &s_rec = s_recs_[k];
+    auto emit_color =
+        h_rec.mat_ptr->emit(r_in, h_rec, h_rec.u, h_rec.v, h_rec.p);
+    radiance[pa.index] += pa.throughput * emit_color;
+    if (first_)
+      (*first_)[pa.index].set(r_in, h_rec,
+                              scattered_[k] ? s_rec.attenuation : emit_color);
+    if (!scattered_[k]) continue;
+    if (s_rec.is_specular) {
+      STAT_COUNT(STAT_SPECULAR_RAYS);
+      next_.push_back(path{s_rec.ray_specular,
+                            pa.throughput * s_rec.attenuation, pa.index});
+      continue;
+    }
+    double sample_pdf_val;
+    ray r_out{h_rec.p,
+              sample_scatter(s_rec, h_rec.p, r_in.time(), lights_.get(),
+                             sample_pdf_val),
+              r_in.time()};
+    STAT_COUNT(STAT_SCATTERED_RAYS);
+    next_.push_back(path{r_out,
+                         pa.throughput * s_rec.attenuation *
+                             h_rec.mat_ptr->scatter_pdf(r_in, h_rec, r_out) /
+                             sample_pdf_val,
+                         pa.index});
+  }
+  paths_.swap(next_);
+}
+
+#endif
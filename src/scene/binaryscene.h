@@ -0,0 +1,312 @@
+#ifndef BINARY_SCENE_H
+#define BINARY_SCENE_H
+
+/**
+ * A scene as one file to mmap() and render from.
+ *
+ * A header, a table of sections, then the sections, each 64 byte aligned:
+ *   TEXT          the scene text without its meshes, includes flattened
+ *   MESHES        vertex, triangle and usemtl name ranges of each mesh
+ *   VERTICES      xyz floats of all meshes
+ *   INDICES       3 per triangle, from the first vertex of its mesh
+ *   MATERIAL_IDS  1 per triangle, from the first name of its mesh
+ *   NAMES         usemtl names of the meshes, then scene material names
+ *   INSTANCES     a mesh, its default material and an object to world
+ * The geometry sections are handed to triangle_mesh as they are mapped,
+ * nothing is copied. sceneconv writes these from .scene or .obj files.
+ */
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+class binary_scene {
+ public:
+  enum section_kind : uint32_t {
+    TEXT,
+    MESHES,
+    VERTICES,
+    INDICES,
+    MATERIAL_IDS,
+    NAMES,
+    INSTANCES,
+    SECTION_COUNT
+  };
+  struct mesh {
+    uint64_t first_vertex, vertex_count;
+    uint64_t first_triangle, triangle_count;
+    // names[first_name] is "", the faces before any usemtl
+    uint32_t first_name, name_count;
+  };
+  struct instance {
+    uint32_t mesh;
+    uint32_t material;  // name of the default material
+    double xf[3][4];    // [A | b]
+  };
+  struct name {
+    char str[64];  // nul terminated
+  };
+  // everything write() puts in a file
+  struct contents {
+    std::string text;
+    std::vector<mesh> meshes;
+    std::vector<float> vertices;
+    std::vector<uint32_t> indices;
+    std::vector<uint32_t> material_ids;
+    std::vector<name> names;
+    std::vector<instance> instances;
+  };
+
+  binary_scene() : map_{nullptr}, map_bytes_{0}, sections_{} {}
+  ~binary_scene() {
+    if (map_) munmap(map_, map_bytes_);
+  }
+  binary_scene(binary_scene const &) = delete;
+  binary_scene &operator=(binary_scene const &) = delete;
+
+  // the file starts with the magic
+  static bool is_binary(char const *path);
+  /**
+   * map and check the whole file, false after reporting.
+   * Pages are faulted in here, the MB/s logged is the real read.
+   */
+  bool open(char const *path);
+  static bool write(char const *path, contents const &c);
+
+  // nul terminated
+  char const *text() const { return section<char>(TEXT); }
+  size_t text_bytes() const { return count(TEXT); }
+  mesh const *meshes() const { return section<mesh>(MESHES); }
+  size_t mesh_count() const { return count(MESHES); }
+  float const *vertices() const { return section<float>(VERTICES); }
+  uint32_t const *indices() const { return section<uint32_t>(INDICES); }
+  uint32_t const *material_ids() const {
+    return section<uint32_t>(MATERIAL_IDS);
+  }
+  name const *names() const { return section<name>(NAMES); }
+  size_t name_count() const { return count(NAMES); }
+  instance const *instances() const { return section<instance>(INSTANCES); }
+  size_t instance_count() const { return count(INSTANCES); }
+
+ private:
+  struct header {
+    char magic[8];
+    uint32_t version;
+    uint32_t section_count;
+    uint64_t file_bytes;
+  };
+  struct section_entry {
+    uint32_t kind;
+    uint32_t element_bytes;  // a layout change is caught by its size
+    uint64_t count;
+    uint64_t offset;
+  };
+  static char const MAGIC_[8];
+  static uint32_t const VERSION_ = 1;
+  static size_t const ALIGN_ = 64;
+
+  void *map_;
+  size_t map_bytes_;
+  section_entry sections_[SECTION_COUNT];
+
+  template <typename T>
+  T const *section(section_kind kind) const {
+    return reinterpret_cast<T const *>(static_cast<char const *>(map_) +
+                                       sections_[kind].offset);
+  }
+  size_t count(section_kind kind) const { return sections_[kind].count; }
+  // the sizes write() and open() agree on
+  static uint32_t element_bytes(uint32_t kind);
+  bool check(char const *path) const;
+};
+char const binary_scene::MAGIC_[8] = {'S', 'P', 'T', 'S', 'C', 'E', 'N', 'E'};
+uint32_t const binary_scene::VERSION_;
+size_t const binary_scene::ALIGN_;
+
+uint32_t binary_scene::element_bytes(uint32_t kind) {
+  switch (kind) {
+    case TEXT:
+      return 1;
+    case MESHES:
+      return sizeof(mesh);
+    case VERTICES:
+      return 3 * sizeof(float);
+    case INDICES:
+      return 3 * sizeof(uint32_t);
+    case MATERIAL_IDS:
+      return sizeof(uint32_t);
+    case NAMES:
+      return sizeof(name);
+    case INSTANCES:
+      return sizeof(instance);
+  }
+  return 0;
+}
+bool binary_scene::is_binary(char const *path) {
+  char magic[8];
+  FILE *fp = fopen(path, "rb");
+  if (!fp) return false;
+  bool ok = fread(magic, 1, 8, fp) == 8 && memcmp(magic, MAGIC_, 8) == 0;
+  fclose(fp);
+  return ok;
+}
+bool binary_scene::open(char const *path) {
+  auto start = std::chrono::steady_clock::now();
+  int fd = ::open(path, O_RDONLY);
+  if (fd < 0) {
+    std::cerr << "ERROR: Could not open scene '" << path << "'.\n";
+    return false;
+  }
+  struct stat st;
+  void *map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size >= static_cast<off_t>(sizeof(header)))
+    map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd,
+               0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    std::cerr << "ERROR: Could not map scene '" << path << "'.\n";
+    return false;
+  }
+  map_ = map;
+  map_bytes_ = st.st_size;
+
+  auto const *head = static_cast<header const *>(map_);
+  auto fail = [&](char const *msg) {
+    std::cerr << path << ": " << msg << "\n";
+    return false;
+  };
+  if (head->version != VERSION_) return fail("unknown version");
+  if (head->file_bytes != map_bytes_) return fail("truncated");
+  if (head->section_count != SECTION_COUNT) return fail("bad section table");
+  auto const *table = reinterpret_cast<section_entry const *>(head + 1);
+  size_t table_end = sizeof(header) + SECTION_COUNT * sizeof(section_entry);
+  for (uint32_t i = 0; i < SECTION_COUNT; i++) {
+    auto const &s = table[i];
+    if (s.kind != i || s.element_bytes != element_bytes(i) ||
+        s.offset % ALIGN_ != 0 || s.offset < table_end ||
+        s.offset > map_bytes_ ||
+        s.count > (map_bytes_ - s.offset) / s.element_bytes)
+      return fail("bad section table");
+    sections_[i] = s;
+  }
+  if (!check(path)) return false;
+
+  auto ms = std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - start)
+                .count();
+  auto mb = map_bytes_ / (1024.0 * 1024.0);
+  std::cerr << "binary scene: " << path << ", " << mesh_count() << " meshes, "
+            << instance_count() << " instances, read " << mb << " MB in " << ms
+            << " ms (" << mb / (ms / 1000) << " MB/s)\n";
+  return true;
+}
+/**
+ * every range and index against what it points into,
+ * a bad file is an error here rather than a crash in a render
+ */
+bool binary_scene::check(char const *path) const {
+  auto fail = [&](char const *msg) {
+    std::cerr << path << ": " << msg << "\n";
+    return false;
+  };
+  if (text_bytes() == 0 || text()[text_bytes() - 1] != '\0')
+    return fail("scene text is not terminated");
+  for (size_t i = 0; i < name_count(); i++)
+    if (!memchr(names()[i].str, '\0', sizeof(name)))
+      return fail("name is not terminated");
+  size_t vertex_total = count(VERTICES), triangle_total = count(INDICES);
+  if (count(MATERIAL_IDS) != triangle_total)
+    return fail("material ids do not match the triangles");
+  for (size_t m = 0; m < mesh_count(); m++) {
+    auto const &me = meshes()[m];
+    if (me.first_vertex > vertex_total ||
+        me.vertex_count > vertex_total - me.first_vertex ||
+        me.first_triangle > triangle_total ||
+        me.triangle_count > triangle_total - me.first_triangle ||
+        me.triangle_count == 0 || me.name_count == 0 ||
+        me.first_name > name_count() ||
+        me.name_count > name_count() - me.first_name)
+      return fail("mesh out of range");
+    auto idx = indices() + 3 * me.first_triangle;
+    for (size_t k = 0; k < 3 * me.triangle_count; k++)
+      if (idx[k] >= me.vertex_count) return fail("vertex index out of range");
+    auto ids = material_ids() + me.first_triangle;
+    for (size_t k = 0; k < me.triangle_count; k++)
+      if (ids[k] >= me.name_count) return fail("material id out of range");
+  }
+  for (size_t i = 0; i < instance_count(); i++) {
+    auto const &in = instances()[i];
+    if (in.mesh >= mesh_count() || in.material >= name_count())
+      return fail("instance out of range");
+  }
+  return true;
+}
+bool binary_scene::write(char const *path, contents const &c) {
+  // the text goes with its terminator
+  std::vector<char const *> data = {
+      c.text.c_str(),
+      reinterpret_cast<char const *>(c.meshes.data()),
+      reinterpret_cast<char const *>(c.vertices.data()),
+      reinterpret_cast<char const *>(c.indices.data()),
+      reinterpret_cast<char const *>(c.material_ids.data()),
+      reinterpret_cast<char const *>(c.names.data()),
+      reinterpret_cast<char const *>(c.instances.data())};
+  uint64_t counts[SECTION_COUNT] = {
+      c.text.size() + 1,      c.meshes.size(),       c.vertices.size() / 3,
+      c.indices.size() / 3,   c.material_ids.size(), c.names.size(),
+      c.instances.size()};
+
+  header head;
+  memcpy(head.magic, MAGIC_, 8);
+  head.version = VERSION_;
+  head.section_count = SECTION_COUNT;
+  section_entry table[SECTION_COUNT];
+  auto align = [](uint64_t x) { return (x + ALIGN_ - 1) / ALIGN_ * ALIGN_; };
+  uint64_t offset = align(sizeof(header) + sizeof(table));
+  for (uint32_t i = 0; i < SECTION_COUNT; i++) {
+    table[i].kind = i;
+    table[i].element_bytes = element_bytes(i);
+    table[i].count = counts[i];
+    table[i].offset = offset;
+    offset = align(offset + counts[i] * element_bytes(i));
+  }
+  head.file_bytes = offset;
+
+  // written aside and renamed, a reader never sees half a file
+  std::string tmp_path = std::string(path) + ".tmp";
+  FILE *fp = fopen(tmp_path.c_str(), "wb");
+  if (!fp) {
+    std::cerr << "ERROR: Could not write '" << path << "'.\n";
+    return false;
+  }
+  static char const zeros[ALIGN_] = {};
+  uint64_t pos = 0;
+  auto put = [&](void const *p, uint64_t bytes) {
+    pos += bytes;
+    return bytes == 0 || fwrite(p, 1, bytes, fp) == bytes;
+  };
+  bool ok = put(&head, sizeof(head)) && put(table, sizeof(table));
+  for (uint32_t i = 0; ok && i < SECTION_COUNT; i++) {
+    ok = put(zeros, table[i].offset - pos) &&
+         put(data[i], table[i].count * table[i].element_bytes);
+  }
+  ok = ok && put(zeros, head.file_bytes - pos);
+  ok = fclose(fp) == 0 && ok;
+  if (!ok || rename(tmp_path.c_str(), path) != 0) {
+    remove(tmp_path.c_str());
+    std::cerr << "ERROR: Could not write '" << path << "'.\n";
+    return false;
+  }
+  return true;
+}
+
+#endif
@@ -0,0 +1,138 @@
+#ifndef OBJ_LOADER_H
+#define OBJ_LOADER_H
+
+/**
+ * Wavefront OBJ, only what a triangle_mesh needs:
+ *   v x y z            positions, a w is ignored
+ *   f a b c ...        polygons, fanned into triangles, any of
+ *                      a, a/t, a//n, a/t/n, negative is from the end
+ *   usemtl name        material of the faces after it
+ * Normals, uvs, groups and .mtl libraries are skipped.
+ */
+
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+struct obj_data {
+  std::vector<float> positions;  // xyz
+  std::vector<uint32_t> indices;  // 3 per triangle
+  std::vector<uint32_t> material_ids;  // 1 per triangle, into the names
+  // usemtl names by id, 0 is "" for faces before any usemtl
+  std::vector<std::string> material_names{""};
+
+  size_t vertex_count() const { return positions.size() / 3; }
+  size_t triangle_count() const { return material_ids.size(); }
+};
+
+// false after reporting, the parse time and MB/s are logged
+bool load_obj(char const *path, obj_data &out);
+
+bool load_obj(char const *path, obj_data &out) {
+  auto start = std::chrono::steady_clock::now();
+  FILE *fp = fopen(path, "rb");
+  if (!fp) {
+    std::cerr << "ERROR: Could not open OBJ '" << path << "'.\n";
+    return false;
+  }
+  std::string text;
+  fseek(fp, 0, SEEK_END);
+  auto size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  text.resize(size > 0 ? size : 0);
+  bool read_ok = fread(&text[0], 1, text.size(), fp) == text.size();
+  fclose(fp);
+  if (!read_ok) {
+    std::cerr << "ERROR: Could not read OBJ '" << path << "'.\n";
+    return false;
+  }
+
+  out = obj_data{};
+  uint32_t material = 0;
+  std::vector<uint32_t> face;
+  int line = 0;
+  auto fail = [&](char const *msg) {
+    std::cerr << path << ":" << line << ": " << msg << "\n";
+    return false;
+  };
+  char const *p = text.c_str();
+  char const *text_end = p + text.size();
+  while (p < text_end) {
+    line++;
+    char const *eol = static_cast<char const *>(memchr(p, '\n', text_end - p));
+    if (!eol) eol = text_end;
+    while (p < eol && (*p == ' ' || *p == '\t')) p++;
+    if (p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+      char *end;
+      p += 2;
+      for (int k = 0; k < 3; k++) {
+        out.positions.push_back(strtof(p, &end));
+        // strtof skips newlines too, the numbers must be on this line
+        if (end == p || end > eol) return fail("vertex needs three numbers");
+        p = end;
+      }
+    } else if (p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+      p += 2;
+      face.clear();
+      auto vertex_count = static_cast<long>(out.vertex_count());
+      while (true) {
+        while (p < eol && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+        if (p >= eol) break;
+        char *end;
+        long idx = strtol(p, &end, 10);
+        if (end == p || end > eol) return fail("bad face index");
+        // 1 based, negative counts back from the last vertex
+        idx = idx < 0 ? vertex_count + idx : idx - 1;
+        if (idx < 0 || idx >= vertex_count)
+          return fail("face index out of range");
+        face.push_back(static_cast<uint32_t>(idx));
+        // uv and normal indices are skipped
+        p = end;
+        while (p < eol && *p != ' ' && *p != '\t' && *p != '\r') p++;
+      }
+      if (face.size() < 3) return fail("face needs three vertices");
+      for (size_t k = 1; k + 1 < face.size(); k++) {
+        out.indices.push_back(face[0]);
+        out.indices.push_back(face[k]);
+        out.indices.push_back(face[k + 1]);
+        out.material_ids.push_back(material);
+      }
+    } else if (strncmp(p, "usemtl", 6) == 0 &&
+               (p[6] == ' ' || p[6] == '\t')) {
+      p += 6;
+      while (p < eol && (*p == ' ' || *p == '\t')) p++;
+      auto name_end = eol;
+      while (name_end > p && isspace(static_cast<unsigned char>(name_end[-1])))
+        name_end--;
+      std::string name(p, name_end);
+      material = 0;
+      while (material < out.material_names.size() &&
+             out.material_names[material] != name)
+        material++;
+      if (material == out.material_names.size())
+        out.material_names.push_back(name);
+    }
+    p = eol + 1;
+  }
+  if (out.material_ids.empty()) {
+    std::cerr << "ERROR: OBJ '" << path << "' has no faces.\n";
+    return false;
+  }
+
+  auto ms = std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - start)
+                .count();
+  auto mb = text.size() / (1024.0 * 1024.0);
+  std::cerr << "obj: " << path << ", " << out.vertex_count() << " vertices, "
+            << out.triangle_count() << " triangles, read " << mb << " MB in "
+            << ms << " ms (" << mb / (ms / 1000) << " MB/s)\n";
+  return true;
+}
+
+#endif
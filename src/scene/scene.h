@@ -0,0 +1,125 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include "animation.h"
+#include "bvh.h"
+#include "camera.h"
+#include "colorRGB.h"
+#include "envlight.h"
+#include "objectlist.h"
+#include "rt_utils.h"
+#include "sphereset.h"
+#include "stats.h"
+#include "vec3d.h"
+
+// scene files under scenes/ by the index they had as prefabs
+char const *const SCENE_FILES[] = {
+    "one_sphere",      // 0
+    "random",          // 1
+    "checker",         // 2
+    "perlin",          // 3
+    "one_sphere",      // 4
+    "simple_light",    // 5
+    "cornell",         // 6
+    "smoke",           // 7
+    "final",           // 8
+    "earth",           // 9
+    "cornell_glass",   // 10
+    "sphere_lights",   // 11
+    "random_moving",   // 12
+};
+constexpr int NUM_SCENE_FILES = sizeof(SCENE_FILES) / sizeof(SCENE_FILES[0]);
+// each of SCENE_FILES once, in index order
+std::vector<std::string> scene_names() {
+  std::vector<std::string> names;
+  for (auto name : SCENE_FILES)
+    if (std::find(names.begin(), names.end(), name) == names.end())
+      names.push_back(name);
+  return names;
+}
+
+/**
+ * Everything a scene file describes, with the defaults main()
+ * used before scenes came from files.
+ */
+struct scene {
+  object_list world;
+  // sampled by the light pdf, may be geometry the world does not have
+  shared_ptr<object_list> lights = make_shared<object_list>();
+  animation anim;
+
+  // render settings
+  double aspect_ratio = 16.0 / 9.0;
+  int image_w = 400;
+  int spp = 100;
+  int max_bounce = 20;
+  color_rgb background{0, 0, 0};
+  std::string env_path;  // empty for none
+  double env_intensity = 1.0;
+
+  // camera
+  point3d lookfrom{13, 2, 3};
+  point3d lookat{0, 0, 0};
+  vec3d vup{0, 1, 0};
+  double vfov = 40.0;
+  double aperture = 0.0;
+  double dist_to_focus = 10.0;
+  double time0 = 0.0, time1 = 1.0;  // shutter
+};
+
+// what a still of a scene is traced with, see prepare_still()
+struct still_setup {
+  shared_ptr<bvh_node> world;  // null if not asked to build it
+  shared_ptr<env_light> env;   // null without an environment
+  // null when nothing is sampled, so the light pdf is skipped
+  shared_ptr<base_object> lights;
+  shared_ptr<camera> cam;
+  int image_h;
+  // ray differentials of one sample, as camera::ray_at() takes them
+  double ds, dt;
+};
+
+/**
+ * Readies a loaded scene for a still at its image_w and spp: loose
+ * spheres packed, the bvh built unless build_bvh is false, the
+ * environment loaded and added to the lights if it has any light,
+ * and the camera. Set the render settings first to render the scene
+ * at another size.
+ */
+still_setup prepare_still(scene &sc, bool build_bvh = true);
+
+still_setup prepare_still(scene &sc, bool build_bvh) {
+  still_setup st;
+  {
+    STAT_TIMER(bvh_timer, STAGE_BVH);
+    // loose spheres go to arrays, a leaf of them is hit at once
+    pack_spheres(sc.world.objects_, sc.time0, sc.time1);
+    if (build_bvh)
+      st.world = make_shared<bvh_node>(sc.world, sc.time0, sc.time1);
+  }
+  st.lights = sc.lights;
+  if (!sc.env_path.empty()) {
+    st.env = make_shared<env_light>(sc.env_path.c_str());
+    if (st.env->samplable()) sc.lights->add(st.env);
+  }
+  if (sc.lights->objects_.empty()) st.lights = nullptr;
+  st.cam = make_shared<camera>(sc.lookfrom, sc.lookat, sc.vup, sc.vfov,
+                               sc.aspect_ratio, sc.aperture, sc.dist_to_focus,
+                               sc.time0, sc.time1);
+  st.image_h = static_cast<int>(sc.image_w / sc.aspect_ratio);
+  /**
+   * differentials span one pixel, shrunk as more samples
+   * share the pixel, as pbrt does
+   */
+  auto diff_scale = std::max(0.125, 1.0 / std::sqrt(sc.spp));
+  st.ds = diff_scale / (sc.image_w - 1);
+  st.dt = diff_scale / (st.image_h - 1);
+  return st;
+}
+
+#endif
@@ -0,0 +1,832 @@
+#ifndef SCENE_PARSER_H
+#define SCENE_PARSER_H
+
+/**
+ * Text scene files, one statement per line, # starts a comment.
+ * Vectors and colors are three numbers. Names are defined before use.
+ *
+ *   render [width n] [aspect a] [spp n] [bounce n] [background rgb]
+ *   camera [from p] [at p] [up v] [vfov deg] [aperture a] [focus d]
+ *          [shutter t0 t1]
+ *   environment <image> [intensity]
+ *   include <file>
+ * paths of files and images are relative to the scene file
+ *
+ *   texture <name> solid <rgb>
+ *   texture <name> checker <rgb|texture> <rgb|texture>
+ *   texture <name> noise <scale> [bake <lo> <hi>]
+ *   texture <name> image|tiled <image> [ewa]
+ *   material <name> lambertian|light|isotropic <rgb|texture>
+ *   material <name> metal <rgb|texture> <fuzz>
+ *   material <name> dielectric <ior>
+ *
+ * objects, each followed by any modifiers, applied left to right:
+ *   sphere <material> <center> <radius>
+ *   moving_sphere <material> <center0> <center1> <t0> <t1> <radius>
+ *   xy_rect|xz_rect|yz_rect <material> <a0> <a1> <b0> <b1> <k> [flip]
+ *   box <material> <p0> <p1>
+ *   mesh <material> <file.obj>   usemtl names are scene materials,
+ *                                the others take the given one
+ *   instance <group>
+ * modifiers:
+ *   translate <v>  rotate <axis> <deg>  scale <v>
+ *   medium <density> <rgb|texture>    fill the object with smoke instead
+ *   name <name>                       keep an instance for keyframes
+ *
+ *   group <name> ... end       objects in between go to a shared bvh,
+ *                              built at end over the shutter so far,
+ *                              its bare spheres in a sphere_set
+ *   sample <object>            light pdf only, no material, no modifiers
+ *   key <name> <frame> <offset> <axis> <deg> <scale>
+ *                              keys replace the transform of the name
+ *   camera_key <frame> <from> <at> <vfov>
+ *
+ * The parser goes through the file once, errors are reported
+ * as file:line and stop it.
+ *
+ * A binary scene (see binaryscene.h) is loaded too. convert() writes
+ * one: the text without includes and meshes, paths made absolute,
+ * and the meshes as buffers. Meshes there take only translate,
+ * rotate and scale, and not within a group.
+ */
+
+#include <cctype>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "aarectangle.h"
+#include "binaryscene.h"
+#include "box.h"
+#include "bvh.h"
+#include "constantmedium.h"
+#include "material.h"
+#include "objloader.h"
+#include "scene.h"
+#include "sphere.h"
+#include "sphereset.h"
+#include "texcache.h"
+#include "texture.h"
+#include "trianglemesh.h"
+
+class scene_parser {
+ public:
+  // text or binary, false after reporting the first error
+  static bool load(char const *path, scene &out);
+  // a text scene to a binary one at out_path
+  static bool convert(char const *path, char const *out_path);
+  // the same from text in memory, file names it and its directory
+  static bool convert_text(char const *text, char const *file,
+                           char const *out_path);
+
+ private:
+  // a color, or a texture when tex is set
+  struct color_or_texture {
+    color_rgb color;
+    shared_ptr<texture> tex;
+  };
+  static int const MAX_INCLUDE_DEPTH_ = 16;
+  // a path token of the line and what it becomes in a binary scene
+  struct path_rewrite {
+    char const *st, *ed;
+    std::string path;
+  };
+
+  scene &scene_;
+  std::unordered_map<std::string, shared_ptr<texture>> textures_;
+  std::unordered_map<std::string, shared_ptr<base_material>> materials_;
+  std::unordered_map<std::string, shared_ptr<base_object>> groups_;
+  std::unordered_map<std::string, shared_ptr<transform_instance>> named_;
+  std::map<std::string, transform_track> tracks_;
+  // OBJs by path, meshes by path and default material
+  std::unordered_map<std::string, shared_ptr<obj_data>> objs_;
+  std::map<std::pair<std::string, base_material const *>,
+           shared_ptr<triangle_mesh>>
+      meshes_;
+  // objects of the open group, or nullptr for the world
+  object_list *group_;
+  object_list group_objects_;
+  std::string group_name_;
+  // the line being parsed
+  char const *cur_;
+  std::string file_;
+  std::string dir_;  // of file_, where its relative paths start
+  int line_;
+  int depth_;
+  size_t lines_;  // over all files
+  // converting to a binary scene when set
+  binary_scene::contents *out_;
+  std::vector<path_rewrite> rewrites_;  // of the line
+  std::unordered_map<std::string, uint32_t> out_meshes_;  // by OBJ path
+  std::unordered_map<std::string, uint32_t> out_names_;  // of materials
+
+  explicit scene_parser(scene &out)
+      : scene_{out},
+        group_{nullptr},
+        cur_{nullptr},
+        line_{0},
+        depth_{0},
+        lines_{0},
+        out_{nullptr} {}
+  static bool convert(char const *file, char const *text,
+                      char const *out_path, bool from_text);
+  bool parse_file(std::string const &path);
+  // path names the text for errors and relative paths
+  bool parse_text(char const *text, std::string const &path);
+  bool load_binary(char const *path);
+  bool statement(std::string const &keyword);
+  bool error(std::string const &msg) const;
+  std::string resolve(std::string const &path) const {
+    return path[0] == '/' ? path : dir_ + path;
+  }
+
+  // tokens within the line, false at its end
+  bool token(std::string &tok);
+  bool peek(std::string &tok);
+  bool at_end();
+  bool expect_end();
+  bool number(double &x);
+  bool integer(int &x);
+  bool vec(vec3d &v);
+  bool name(std::string &tok, char const *what);
+  // a file name, resolved, absolute in a binary scene
+  bool file_path(std::string &path, char const *what);
+  bool color_or_tex(color_or_texture &ct);
+  bool material_ref(shared_ptr<base_material> &mat);
+
+  bool parse_render();
+  bool parse_camera();
+  bool parse_texture();
+  bool parse_material();
+  /**
+   * one object from its keyword on, without modifiers
+   * @param with_material false for sample, the material slot is absent
+   */
+  bool parse_object(std::string const &kind, bool with_material,
+                    shared_ptr<base_object> &obj);
+  bool parse_modifiers(shared_ptr<base_object> &obj);
+  // translate, rotate or scale after its keyword, xf is applied first
+  bool parse_transform(std::string const &mod, transform &xf);
+  // nullptr after reporting, cached
+  shared_ptr<obj_data> obj_file(std::string const &path);
+  // by usemtl id, a fallback for 0 and names that are no material
+  std::vector<shared_ptr<base_material>> mesh_materials(
+      std::vector<std::string> const &names,
+      shared_ptr<base_material> const &fallback) const;
+  // a mesh statement into the buffers of out_
+  bool convert_mesh();
+  bool out_name(std::string const &str, binary_scene::name &out);
+  bool parse_key();
+  bool parse_camera_key();
+};
+
+bool scene_parser::load(char const *path, scene &out) {
+  auto start = std::chrono::steady_clock::now();
+  scene_parser parser{out};
+  bool ok = binary_scene::is_binary(path) ? parser.load_binary(path)
+                                          : parser.parse_file(path);
+  if (!ok) return false;
+  if (parser.group_) {
+    std::cerr << path << ": group '" << parser.group_name_
+              << "' is not closed by end\n";
+    return false;
+  }
+  for (auto const &track : parser.tracks_)
+    out.anim.animate(parser.named_[track.first], track.second);
+  // groups were built before their instances moved to the first keys
+  if (!parser.tracks_.empty()) out.world.refit();
+  auto ms = std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - start)
+                .count();
+  std::cerr << "scene: " << path << ", " << parser.lines_ << " lines, "
+            << out.world.objects_.size() << " objects in " << ms << " ms\n";
+  return true;
+}
+bool scene_parser::parse_file(std::string const &path) {
+  FILE *fp = fopen(path.c_str(), "rb");
+  if (!fp) {
+    std::cerr << "ERROR: Could not open scene '" << path << "'.\n";
+    return false;
+  }
+  // the whole file at once, the parse is a single pass over it
+  std::string text;
+  char buf[1 << 16];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) text.append(buf, n);
+  fclose(fp);
+  return parse_text(text.c_str(), path);
+}
+bool scene_parser::parse_text(char const *text, std::string const &path) {
+  auto saved_file = file_;
+  auto saved_dir = dir_;
+  auto saved_line = line_;
+  auto slash = path.find_last_of('/');
+  file_ = path;
+  dir_ = slash == std::string::npos ? "" : path.substr(0, slash + 1);
+  line_ = 0;
+  char const *p = text;
+  bool ok = true;
+  while (ok && *p) {
+    line_++;
+    lines_++;
+    cur_ = p;
+    rewrites_.clear();
+    std::string keyword;
+    bool copy = token(keyword) && (ok = statement(keyword)) && out_ &&
+                keyword != "include" && keyword != "mesh";
+    auto eol = strchr(cur_, '\n');
+    if (!eol) eol = cur_ + strlen(cur_);
+    if (copy) {
+      // flattened into the binary scene, with its paths absolute
+      auto st = p;
+      for (auto const &rw : rewrites_) {
+        out_->text.append(st, rw.st);
+        out_->text += rw.path;
+        st = rw.ed;
+      }
+      auto ed = eol;
+      while (ed > st && ed[-1] == '\r') ed--;
+      out_->text.append(st, ed);
+      out_->text += '\n';
+    }
+    // on to the next line
+    p = *eol ? eol + 1 : eol;
+  }
+  file_ = saved_file;
+  dir_ = saved_dir;
+  line_ = saved_line;
+  return ok;
+}
+bool scene_parser::statement(std::string const &keyword) {
+  if (keyword == "render") return parse_render();
+  if (keyword == "camera") return parse_camera();
+  if (keyword == "texture") return parse_texture();
+  if (keyword == "material") return parse_material();
+  if (keyword == "key") return parse_key();
+  if (keyword == "camera_key") return parse_camera_key();
+  if (keyword == "environment") {
+    std::string path;
+    if (!file_path(path, "image")) return false;
+    scene_.env_path = path;
+    if (!at_end() && !number(scene_.env_intensity)) return false;
+    return expect_end();
+  }
+  if (keyword == "include") {
+    std::string path;
+    if (!file_path(path, "file") || !expect_end()) return false;
+    if (depth_ >= MAX_INCLUDE_DEPTH_) return error("includes nest too deep");
+    auto saved_cur = cur_;
+    depth_++;
+    bool ok = parse_file(path);
+    depth_--;
+    cur_ = saved_cur;
+    return ok;
+  }
+  if (keyword == "group") {
+    if (group_) return error("groups do not nest");
+    if (!name(group_name_, "group name") || !expect_end()) return false;
+    group_objects_.clear();
+    group_ = &group_objects_;
+    return true;
+  }
+  if (keyword == "end") {
+    if (!group_) return error("end without group");
+    if (!expect_end()) return false;
+    if (group_objects_.objects_.empty())
+      return error("group '" + group_name_ + "' is empty");
+    pack_spheres(group_objects_.objects_, scene_.time0, scene_.time1);
+    groups_[group_name_] =
+        make_shared<bvh_node>(group_objects_, scene_.time0, scene_.time1);
+    group_ = nullptr;
+    return true;
+  }
+  if (keyword == "sample") {
+    std::string kind;
+    shared_ptr<base_object> obj;
+    if (!name(kind, "object") || !parse_object(kind, false, obj) ||
+        !expect_end())
+      return false;
+    scene_.lights->add(obj);
+    return true;
+  }
+  if (out_ && keyword == "mesh") return convert_mesh();
+  shared_ptr<base_object> obj;
+  if (!parse_object(keyword, true, obj) || !parse_modifiers(obj)) return false;
+  (group_ ? *group_ : scene_.world).add(obj);
+  return true;
+}
+bool scene_parser::error(std::string const &msg) const {
+  std::cerr << file_ << ":" << line_ << ": " << msg << "\n";
+  return false;
+}
+
+bool scene_parser::token(std::string &tok) {
+  while (*cur_ == ' ' || *cur_ == '\t' || *cur_ == '\r') cur_++;
+  if (*cur_ == '\0' || *cur_ == '\n' || *cur_ == '#') return false;
+  auto st = cur_;
+  while (*cur_ && !isspace(static_cast<unsigned char>(*cur_))) cur_++;
+  tok.assign(st, cur_);
+  return true;
+}
+bool scene_parser::peek(std::string &tok) {
+  auto saved = cur_;
+  bool ok = token(tok);
+  cur_ = saved;
+  return ok;
+}
+bool scene_parser::at_end() {
+  std::string tok;
+  return !peek(tok);
+}
+bool scene_parser::expect_end() {
+  std::string tok;
+  if (peek(tok)) return error("unexpected '" + tok + "'");
+  return true;
+}
+bool scene_parser::number(double &x) {
+  std::string tok;
+  if (!token(tok)) return error("missing number");
+  char *end;
+  x = strtod(tok.c_str(), &end);
+  if (*end) return error("'" + tok + "' is not a number");
+  return true;
+}
+bool scene_parser::integer(int &x) {
+  double d;
+  if (!number(d)) return false;
+  x = static_cast<int>(d);
+  if (x != d) return error("expected an integer");
+  return true;
+}
+bool scene_parser::vec(vec3d &v) {
+  double x, y, z;
+  if (!number(x) || !number(y) || !number(z)) return false;
+  v = vec3d{x, y, z};
+  return true;
+}
+bool scene_parser::name(std::string &tok, char const *what) {
+  if (!token(tok)) return error(std::string("missing ") + what);
+  return true;
+}
+bool scene_parser::file_path(std::string &path, char const *what) {
+  if (!name(path, what)) return false;
+  // the token was just read, it ends at cur_
+  auto st = cur_ - path.size();
+  path = resolve(path);
+  if (out_) {
+    // the binary scene is read from anywhere
+    char abs[PATH_MAX];
+    if (realpath(path.c_str(), abs)) path = abs;
+    rewrites_.push_back({st, cur_, path});
+  }
+  return true;
+}
+bool scene_parser::color_or_tex(color_or_texture &ct) {
+  std::string tok;
+  if (!peek(tok)) return error("missing color or texture");
+  char *end;
+  strtod(tok.c_str(), &end);
+  if (!*end) return vec(ct.color);
+  token(tok);
+  auto it = textures_.find(tok);
+  if (it == textures_.end()) return error("unknown texture '" + tok + "'");
+  ct.tex = it->second;
+  return true;
+}
+bool scene_parser::material_ref(shared_ptr<base_material> &mat) {
+  std::string tok;
+  if (!name(tok, "material")) return false;
+  auto it = materials_.find(tok);
+  if (it == materials_.end()) return error("unknown material '" + tok + "'");
+  mat = it->second;
+  return true;
+}
+
+bool scene_parser::parse_render() {
+  std::string key;
+  while (token(key)) {
+    bool ok;
+    if (key == "width")
+      ok = integer(scene_.image_w);
+    else if (key == "aspect")
+      ok = number(scene_.aspect_ratio);
+    else if (key == "spp")
+      ok = integer(scene_.spp);
+    else if (key == "bounce")
+      ok = integer(scene_.max_bounce);
+    else if (key == "background")
+      ok = vec(scene_.background);
+    else
+      return error("unknown render setting '" + key + "'");
+    if (!ok) return false;
+  }
+  return true;
+}
+bool scene_parser::parse_camera() {
+  std::string key;
+  while (token(key)) {
+    bool ok;
+    if (key == "from")
+      ok = vec(scene_.lookfrom);
+    else if (key == "at")
+      ok = vec(scene_.lookat);
+    else if (key == "up")
+      ok = vec(scene_.vup);
+    else if (key == "vfov")
+      ok = number(scene_.vfov);
+    else if (key == "aperture")
+      ok = number(scene_.aperture);
+    else if (key == "focus")
+      ok = number(scene_.dist_to_focus);
+    else if (key == "shutter")
+      ok = number(scene_.time0) && number(scene_.time1);
+    else
+      return error("unknown camera setting '" + key + "'");
+    if (!ok) return false;
+  }
+  return true;
+}
+bool scene_parser::parse_texture() {
+  std::string tex_name, kind;
+  if (!name(tex_name, "texture name") || !name(kind, "texture kind"))
+    return false;
+  shared_ptr<texture> tex;
+  if (kind == "solid") {
+    color_rgb c;
+    if (!vec(c)) return false;
+    tex = make_shared<solid_texture>(c);
+  } else if (kind == "checker") {
+    color_or_texture even, odd;
+    if (!color_or_tex(even) || !color_or_tex(odd)) return false;
+    tex = make_shared<checker_texture>(
+        even.tex ? even.tex : make_shared<solid_texture>(even.color),
+        odd.tex ? odd.tex : make_shared<solid_texture>(odd.color));
+  } else if (kind == "noise") {
+    double scale;
+    if (!number(scale)) return false;
+    auto noise = make_shared<noise_texture>(scale);
+    std::string opt;
+    if (peek(opt) && opt == "bake") {
+      token(opt);
+      point3d lo, hi;
+      if (!vec(lo) || !vec(hi)) return false;
+      noise->bake(aabb{lo, hi});
+    }
+    tex = noise;
+  } else if (kind == "image" || kind == "tiled") {
+    std::string path, opt;
+    if (!file_path(path, "image")) return false;
+    auto filter = mipmap::TRILINEAR;
+    if (peek(opt) && opt == "ewa") {
+      token(opt);
+      filter = mipmap::EWA;
+    }
+    if (kind == "image")
+      tex = make_shared<image_texture>(path.c_str(), filter);
+    else
+      tex = make_shared<tiled_texture>(path.c_str(), filter);
+  } else {
+    return error("unknown texture kind '" + kind + "'");
+  }
+  textures_[tex_name] = tex;
+  return expect_end();
+}
+bool scene_parser::parse_material() {
+  std::string mat_name, kind;
+  if (!name(mat_name, "material name") || !name(kind, "material kind"))
+    return false;
+  shared_ptr<base_material> mat;
+  color_or_texture ct;
+  if (kind == "dielectric") {
+    double ior;
+    if (!number(ior)) return false;
+    mat = make_shared<dielectric>(ior);
+  } else if (kind == "lambertian" || kind == "light" || kind == "isotropic" ||
+             kind == "metal") {
+    if (!color_or_tex(ct)) return false;
+    if (kind == "lambertian")
+      mat = ct.tex ? make_shared<lambertian>(ct.tex)
+                   : make_shared<lambertian>(ct.color);
+    else if (kind == "light")
+      mat = ct.tex ? make_shared<diffuse_light>(ct.tex)
+                   : make_shared<diffuse_light>(ct.color);
+    else if (kind == "isotropic")
+      mat = ct.tex ? make_shared<isotropic_medium>(ct.tex)
+                   : make_shared<isotropic_medium>(ct.color);
+    else {
+      double fuzz;
+      if (!number(fuzz)) return false;
+      mat = ct.tex ? make_shared<metal>(ct.tex, fuzz)
+                   : make_shared<metal>(ct.color, fuzz);
+    }
+  } else {
+    return error("unknown material kind '" + kind + "'");
+  }
+  materials_[mat_name] = mat;
+  return expect_end();
+}
+bool scene_parser::parse_object(std::string const &kind, bool with_material,
+                                shared_ptr<base_object> &obj) {
+  if (kind == "instance") {
+    if (!with_material) return error("instance can not be sampled");
+    std::string group;
+    if (!name(group, "group")) return false;
+    auto it = groups_.find(group);
+    if (it == groups_.end()) return error("unknown group '" + group + "'");
+    obj = it->second;
+    return true;
+  }
+  shared_ptr<base_material> mat;
+  bool known = kind == "sphere" || kind == "moving_sphere" ||
+               kind == "xy_rect" || kind == "xz_rect" || kind == "yz_rect" ||
+               kind == "box" || kind == "mesh";
+  if (!known) return error("unknown statement '" + kind + "'");
+  if (!with_material && kind == "mesh")
+    return error("mesh can not be sampled");
+  if (with_material && !material_ref(mat)) return false;
+
+  if (kind == "sphere") {
+    point3d center;
+    double radius;
+    if (!vec(center) || !number(radius)) return false;
+    obj = make_shared<sphere>(center, radius, mat);
+  } else if (kind == "moving_sphere") {
+    point3d center0, center1;
+    double t0, t1, radius;
+    if (!vec(center0) || !vec(center1) || !number(t0) || !number(t1) ||
+        !number(radius))
+      return false;
+    obj = make_shared<sphere>(center0, center1, t0, t1, radius, mat);
+  } else if (kind == "box") {
+    point3d p0, p1;
+    if (!vec(p0) || !vec(p1)) return false;
+    obj = make_shared<box>(p0, p1, mat);
+  } else if (kind == "mesh") {
+    std::string path;
+    if (!file_path(path, "OBJ")) return false;
+    // instances of one OBJ and material share the triangles and their bvh
+    auto &mesh = meshes_[std::make_pair(path, mat.get())];
+    if (!mesh) {
+      auto data = obj_file(path);
+      if (!data) return false;
+      mesh = make_shared<triangle_mesh>(
+          data->positions.data(), data->vertex_count(), data->indices.data(),
+          data->material_ids.data(), data->triangle_count(),
+          mesh_materials(data->material_names, mat), data);
+    }
+    obj = mesh;
+  } else {
+    double a0, a1, b0, b1, k;
+    if (!number(a0) || !number(a1) || !number(b0) || !number(b1) ||
+        !number(k))
+      return false;
+    std::string opt;
+    double side = 1;
+    if (peek(opt) && opt == "flip") {
+      token(opt);
+      side = -1;
+    }
+    if (kind == "xy_rect")
+      obj = make_shared<xy_rectangle>(a0, a1, b0, b1, k, mat,
+                                      vec3d{0, 0, side});
+    else if (kind == "xz_rect")
+      obj = make_shared<xz_rectangle>(a0, a1, b0, b1, k, mat,
+                                      vec3d{0, side, 0});
+    else
+      obj = make_shared<yz_rectangle>(a0, a1, b0, b1, k, mat,
+                                      vec3d{side, 0, 0});
+  }
+  return true;
+}
+bool scene_parser::parse_modifiers(shared_ptr<base_object> &obj) {
+  std::string mod;
+  while (token(mod)) {
+    if (mod == "translate" || mod == "rotate" || mod == "scale") {
+      transform xf;
+      if (!parse_transform(mod, xf)) return false;
+      obj = make_shared<transform_instance>(obj, xf);
+    } else if (mod == "medium") {
+      double density;
+      color_or_texture ct;
+      if (!number(density) || !color_or_tex(ct)) return false;
+      if (ct.tex)
+        obj = make_shared<constant_medium>(obj, density, ct.tex);
+      else
+        obj = make_shared<constant_medium>(obj, density, ct.color);
+    } else if (mod == "name") {
+      std::string id;
+      if (!name(id, "name")) return false;
+      if (named_.count(id)) return error("name '" + id + "' is taken");
+      auto instance = make_shared<transform_instance>(obj, transform{});
+      // animated from here on, later modifiers wrap it, never merge it
+      instance->set_transform(transform{});
+      named_[id] = instance;
+      obj = instance;
+    } else {
+      return error("unknown modifier '" + mod + "'");
+    }
+  }
+  return true;
+}
+bool scene_parser::parse_transform(std::string const &mod, transform &xf) {
+  if (mod == "rotate") {
+    vec3d axis;
+    double angle;
+    if (!vec(axis) || !number(angle)) return false;
+    xf = transform::rotation(axis, angle) * xf;
+  } else {
+    vec3d v;
+    if (!vec(v)) return false;
+    xf = (mod == "translate" ? transform::translation(v)
+                             : transform::scaling(v)) *
+         xf;
+  }
+  return true;
+}
+bool scene_parser::parse_key() {
+  std::string id;
+  transform_key key;
+  if (!name(id, "name") || !number(key.time) || !vec(key.offset) ||
+      !vec(key.axis) || !number(key.angle) || !vec(key.scale) ||
+      !expect_end())
+    return false;
+  if (!named_.count(id)) return error("unknown name '" + id + "'");
+  tracks_[id].add(key);
+  return true;
+}
+bool scene_parser::parse_camera_key() {
+  camera_key key;
+  if (!number(key.time) || !vec(key.lookfrom) || !vec(key.lookat) ||
+      !number(key.vfov) || !expect_end())
+    return false;
+  scene_.anim.add_camera_key(key);
+  return true;
+}
+
+shared_ptr<obj_data> scene_parser::obj_file(std::string const &path) {
+  auto &data = objs_[path];
+  if (!data) {
+    data = make_shared<obj_data>();
+    if (!load_obj(path.c_str(), *data)) {
+      objs_.erase(path);
+      error("could not load '" + path + "'");
+      return nullptr;
+    }
+  }
+  return data;
+}
+std::vector<shared_ptr<base_material>> scene_parser::mesh_materials(
+    std::vector<std::string> const &names,
+    shared_ptr<base_material> const &fallback) const {
+  std::vector<shared_ptr<base_material>> mats(names.size(), fallback);
+  for (size_t i = 1; i < names.size(); i++) {
+    auto it = materials_.find(names[i]);
+    if (it != materials_.end()) mats[i] = it->second;
+  }
+  return mats;
+}
+
+bool scene_parser::convert(char const *path, char const *out_path) {
+  return convert(path, nullptr, out_path, false);
+}
+bool scene_parser::convert_text(char const *text, char const *file,
+                                char const *out_path) {
+  return convert(file, text, out_path, true);
+}
+/**
+ * The scene is parsed as for a render, that checks it. Lines go
+ * to the text on the way, mesh statements to the buffers instead.
+ */
+bool scene_parser::convert(char const *file, char const *text,
+                           char const *out_path, bool from_text) {
+  scene sc;
+  binary_scene::contents out;
+  scene_parser parser{sc};
+  parser.out_ = &out;
+  bool ok = from_text ? parser.parse_text(text, file) : parser.parse_file(file);
+  if (!ok) return false;
+  if (parser.group_) {
+    std::cerr << file << ": group '" << parser.group_name_
+              << "' is not closed by end\n";
+    return false;
+  }
+  if (!binary_scene::write(out_path, out)) return false;
+  std::cerr << "converted " << file << " to " << out_path << ", "
+            << out.meshes.size() << " meshes, " << out.indices.size() / 3
+            << " triangles, " << out.instances.size() << " instances\n";
+  return true;
+}
+bool scene_parser::convert_mesh() {
+  std::string mat_name, path, mod;
+  if (!name(mat_name, "material") || !file_path(path, "OBJ")) return false;
+  if (!materials_.count(mat_name))
+    return error("unknown material '" + mat_name + "'");
+  if (group_) return error("meshes of a binary scene can not be in a group");
+  binary_scene::instance in;
+  transform xf;
+  while (token(mod)) {
+    if (mod != "translate" && mod != "rotate" && mod != "scale")
+      return error("meshes of a binary scene only translate, rotate, scale");
+    if (!parse_transform(mod, xf)) return false;
+  }
+  for (int i = 0; i < 3; i++)
+    for (int j = 0; j < 4; j++) in.xf[i][j] = xf(i, j);
+
+  auto it = out_meshes_.find(path);
+  if (it != out_meshes_.end()) {
+    in.mesh = it->second;
+  } else {
+    auto data = obj_file(path);
+    if (!data) return false;
+    binary_scene::mesh me;
+    me.first_vertex = out_->vertices.size() / 3;
+    me.vertex_count = data->vertex_count();
+    me.first_triangle = out_->material_ids.size();
+    me.triangle_count = data->triangle_count();
+    me.first_name = static_cast<uint32_t>(out_->names.size());
+    me.name_count = static_cast<uint32_t>(data->material_names.size());
+    for (auto const &str : data->material_names) {
+      binary_scene::name nm;
+      if (!out_name(str, nm)) return false;
+      out_->names.push_back(nm);
+    }
+    out_->vertices.insert(out_->vertices.end(), data->positions.begin(),
+                          data->positions.end());
+    out_->indices.insert(out_->indices.end(), data->indices.begin(),
+                         data->indices.end());
+    out_->material_ids.insert(out_->material_ids.end(),
+                              data->material_ids.begin(),
+                              data->material_ids.end());
+    in.mesh = static_cast<uint32_t>(out_->meshes.size());
+    out_->meshes.push_back(me);
+    out_meshes_[path] = in.mesh;
+    // in the buffers now, the OBJ is not read again
+    objs_.erase(path);
+  }
+
+  auto name_it = out_names_.find(mat_name);
+  if (name_it != out_names_.end()) {
+    in.material = name_it->second;
+  } else {
+    binary_scene::name nm;
+    if (!out_name(mat_name, nm)) return false;
+    in.material = static_cast<uint32_t>(out_->names.size());
+    out_->names.push_back(nm);
+    out_names_[mat_name] = in.material;
+  }
+  out_->instances.push_back(in);
+  return true;
+}
+bool scene_parser::out_name(std::string const &str, binary_scene::name &out) {
+  if (str.size() >= sizeof(out.str))
+    return error("name '" + str + "' is too long for a binary scene");
+  memset(out.str, 0, sizeof(out.str));
+  memcpy(out.str, str.c_str(), str.size());
+  return true;
+}
+/**
+ * The text of a binary scene is parsed in place, then every instance
+ * gets a triangle_mesh over the mapped buffers, one per mesh and
+ * default material. The meshes keep the mapping alive.
+ */
+bool scene_parser::load_binary(char const *path) {
+  auto bin = make_shared<binary_scene>();
+  if (!bin->open(path) || !parse_text(bin->text(), path)) return false;
+  std::map<std::pair<uint32_t, uint32_t>, shared_ptr<triangle_mesh>> built;
+  for (size_t i = 0; i < bin->instance_count(); i++) {
+    auto const &in = bin->instances()[i];
+    std::string mat_name = bin->names()[in.material].str;
+    auto mat = materials_.find(mat_name);
+    if (mat == materials_.end()) {
+      std::cerr << path << ": unknown material '" << mat_name << "'\n";
+      return false;
+    }
+    auto &mesh = built[std::make_pair(in.mesh, in.material)];
+    if (!mesh) {
+      auto const &me = bin->meshes()[in.mesh];
+      std::vector<std::string> names;
+      for (uint32_t k = 0; k < me.name_count; k++)
+        names.push_back(bin->names()[me.first_name + k].str);
+      mesh = make_shared<triangle_mesh>(
+          bin->vertices() + 3 * me.first_vertex, me.vertex_count,
+          bin->indices() + 3 * me.first_triangle,
+          bin->material_ids() + me.first_triangle, me.triangle_count,
+          mesh_materials(names, mat->second), bin);
+    }
+    transform xf{in.xf};
+    if (xf.is_identity())
+      scene_.world.add(mesh);
+    else
+      scene_.world.add(make_shared<transform_instance>(mesh, xf));
+  }
+  return true;
+}
+
+#endif
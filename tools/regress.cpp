@@ -0,0 +1,358 @@
+/**
+ * regress: renders the scenes with a fixed seed at low spp and
+ * compares them with float references, run from the repository root.
+ *
+ *   regress [--only <scene>]      check against scenes/reference/
+ *   regress --update [--only <scene>]
+ *                                 render the references again and
+ *                                 set the tolerances from this tree
+ *
+ * The references are REF_SPP renders from a seed of their own,
+ * <scene>.hdr next to the tolerances file, which has a line
+ * "<scene> <spp> <max relMSE>" per scene.
+ * A check renders one sample per pixel per pass and measures after
+ * every power of two passes, so a line shows how the error falls:
+ *   rmse       root of the mean squared difference
+ *   relMSE     squared difference over the reference squared + 0.01,
+ *              what the tolerance is on
+ *   flip       mean difference of the displayed images, gamma 2 and
+ *              clamped as written, after a 3x3 box blur. A rough
+ *              stand-in for FLIP, it weighs what a viewer sees
+ *   to error   ms of passes until relMSE was within tolerance
+ * Noise alone stays within tolerance for an unbiased change, a biased
+ * one levels off above it. A faster renderer gets there sooner.
+ *
+ * At the check spp the relMSE is mostly noise, and a bias of a few
+ * percent hides in it. So the mean of each channel has to be within
+ * MAX_Z standard errors of the reference's too, see mean_z(). That
+ * catches a lambertian 10% darker in most scenes.
+ * earth is checked lit by a sky, as earth_lit. Its own lights face
+ * away from it and leave it black.
+ */
+#include "bvh.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "image_utils.h"
+#include "integrator.h"
+#include "sceneparser.h"
+
+char const *const REF_DIR = "scenes/reference/";
+char const *const TOLERANCES = "scenes/reference/tolerances.txt";
+int const WIDTH = 96;
+int const REF_SPP = 1024;
+int const CHECK_SPP = 16;
+unsigned const CHECK_SEED = 1, REF_SEED = 2;
+// the tolerance an update sets, over the error this tree has
+double const MARGIN = 1.5;
+// standard errors the mean of a channel may be off the reference
+double const MAX_Z = 4;
+
+// the scenes main() has an index for, earth lit by a sky instead
+std::vector<std::string> checked_scenes() {
+  auto names = scene_names();
+  for (auto &name : names)
+    if (name == "earth") name = "earth_lit";
+  return names;
+}
+
+struct error_metrics {
+  double rmse, relmse, flip;
+};
+struct tolerance {
+  int spp;
+  double max_relmse;
+};
+
+// a scene ready to trace, as main() sets it up for a still
+class still {
+ public:
+  int w_, h_;
+
+  /**
+   * the scene is read with one seed for all, perlin noise comes
+   * from rand(), then rand() is seeded for the samples
+   */
+  bool load(char const *name, unsigned seed);
+  // one sample per pixel more into sum, and its square into sum2 if
+  // given, rows from the top
+  void pass(std::vector<float> &sum, std::vector<float> *sum2 = nullptr);
+
+ private:
+  scene sc_;
+  still_setup st_;
+};
+
+bool still::load(char const *name, unsigned seed) {
+  std::string path = std::string("scenes/") + name + ".scene";
+  srand(CHECK_SEED);
+  if (!scene_parser::load(path.c_str(), sc_)) return false;
+  sc_.image_w = WIDTH;
+  // the footprint of one sample, the check spp is what matters
+  sc_.spp = CHECK_SPP;
+  st_ = prepare_still(sc_);
+  w_ = WIDTH;
+  h_ = st_.image_h;
+  srand(seed);
+  return true;
+}
+void still::pass(std::vector<float> &sum, std::vector<float> *sum2) {
+  sum.resize(size_t(w_) * h_ * 3, 0.0f);
+  if (sum2) sum2->resize(sum.size(), 0.0f);
+  for (int y = 0; y < h_; y++) {
+    int i = h_ - 1 - y;
+    for (int j = 0; j < w_; j++) {
+      auto u = (j + random_double()) / (w_ - 1);
+      auto v = (i + random_double()) / (h_ - 1);
+      auto c = ray_color(st_.cam->ray_at(u, v, st_.ds, st_.dt),
+                         sc_.background, st_.env.get(), *st_.world,
+                         st_.lights, sc_.max_bounce);
+      auto px = (size_t(y) * w_ + j) * 3;
+      for (int k = 0; k < 3; k++) {
+        // NaN as write_color() does, dropped
+        float v = c[k] == c[k] ? float(c[k]) : 0.0f;
+        sum[px + k] += v;
+        if (sum2) (*sum2)[px + k] += v * v;
+      }
+    }
+  }
+}
+
+// clamped and gamma 2 as write_color(), then box blurred over 3x3
+std::vector<float> displayed(std::vector<float> const &img, int w, int h) {
+  std::vector<float> shown(img.size()), blurred(img.size());
+  for (size_t i = 0; i < img.size(); i++)
+    shown[i] = std::sqrt(std::min(1.0f, std::max(0.0f, img[i])));
+  for (int y = 0; y < h; y++)
+    for (int x = 0; x < w; x++)
+      for (int k = 0; k < 3; k++) {
+        float s = 0;
+        int n = 0;
+        for (int dy = -1; dy <= 1; dy++)
+          for (int dx = -1; dx <= 1; dx++) {
+            int xx = x + dx, yy = y + dy;
+            if (xx < 0 || yy < 0 || xx >= w || yy >= h) continue;
+            s += shown[(size_t(yy) * w + xx) * 3 + k];
+            n++;
+          }
+        blurred[(size_t(y) * w + x) * 3 + k] = s / n;
+      }
+  return blurred;
+}
+error_metrics compare(std::vector<float> const &img,
+                      std::vector<float> const &ref, int w, int h) {
+  double se = 0, rel = 0, flip = 0;
+  auto a = displayed(img, w, h), b = displayed(ref, w, h);
+  for (size_t i = 0; i < img.size(); i++) {
+    double d = img[i] - ref[i];
+    se += d * d;
+    rel += d * d / (double(ref[i]) * ref[i] + 0.01);
+    flip += std::fabs(a[i] - b[i]);
+  }
+  double n = img.size();
+  return {std::sqrt(se / n), rel / n, flip / n};
+}
+
+/**
+ * How many standard errors the mean of a channel is off the reference,
+ * the worst of the three, for the s samples per pixel summed in sum
+ * and sum2. The error is that of both means, from the variance of each
+ * pixel over its samples, the reference's scaled to REF_SPP.
+ *
+ * The reference was truncated to 8 bits under the largest channel of
+ * each pixel as it was written, its mean is anywhere up to the mean
+ * step above what was read. Only a bias out of that range counts.
+ */
+double mean_z(std::vector<float> const &sum, std::vector<float> const &sum2,
+              int s, std::vector<float> const &ref) {
+  size_t n = sum.size() / 3;
+  double mean[3] = {}, ref_mean[3] = {}, step[3] = {}, var[3] = {};
+  for (size_t p = 0; p < n; p++) {
+    auto px = &ref[p * 3];
+    double largest = std::max(px[0], std::max(px[1], px[2]));
+    int e = 0;
+    if (largest > 0) std::frexp(largest, &e);
+    for (int k = 0; k < 3; k++) {
+      double m = sum[p * 3 + k] / s;
+      mean[k] += m;
+      ref_mean[k] += px[k];
+      step[k] += largest > 0 ? std::ldexp(1.0, e - 8) : 0.0;
+      var[k] += std::max(0.0, sum2[p * 3 + k] / s - m * m) / (s - 1);
+    }
+  }
+  double worst = 0;
+  for (int k = 0; k < 3; k++) {
+    double lo = ref_mean[k] / n, hi = (ref_mean[k] + step[k]) / n;
+    double d = std::max(0.0, std::max(lo - mean[k] / n, mean[k] / n - hi));
+    // of the mean of n pixels, the variance of each over s samples
+    double se = std::sqrt(var[k] * (1.0 + double(s) / REF_SPP)) / n;
+    if (d > 0) worst = std::max(worst, se > 0 ? d / se : INF_DBL);
+  }
+  return worst;
+}
+
+std::map<std::string, tolerance> read_tolerances() {
+  std::map<std::string, tolerance> tols;
+  std::ifstream in{TOLERANCES};
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.empty() || line[0] == '#') continue;
+    std::istringstream ss{line};
+    std::string name;
+    tolerance t;
+    if (ss >> name >> t.spp >> t.max_relmse) tols[name] = t;
+  }
+  return tols;
+}
+bool write_tolerances(std::map<std::string, tolerance> const &tols) {
+  std::string tmp_path = std::string(TOLERANCES) + ".tmp";
+  FILE *fp = fopen(tmp_path.c_str(), "w");
+  if (!fp) {
+    std::cerr << "ERROR: Could not write '" << TOLERANCES << "'.\n";
+    return false;
+  }
+  fprintf(fp, "# scene, spp and the largest relMSE against <scene>.hdr,\n"
+              "# written by regress --update\n");
+  for (auto const &t : tols)
+    fprintf(fp, "%s %d %.6g\n", t.first.c_str(), t.second.spp,
+            t.second.max_relmse);
+  if (fclose(fp) != 0 || rename(tmp_path.c_str(), TOLERANCES) != 0) {
+    remove(tmp_path.c_str());
+    std::cerr << "ERROR: Could not write '" << TOLERANCES << "'.\n";
+    return false;
+  }
+  return true;
+}
+
+// the average of spp passes
+std::vector<float> average(still &st, int spp) {
+  std::vector<float> sum;
+  for (int s = 0; s < spp; s++) st.pass(sum);
+  for (auto &v : sum) v /= spp;
+  return sum;
+}
+
+// the reference as written, false after reporting
+bool read_reference(char const *name, int &w, int &h, std::vector<float> &ref) {
+  auto path = std::string(REF_DIR) + name + ".hdr";
+  int comp;
+  float *data = stbi_loadf(path.c_str(), &w, &h, &comp, 3);
+  if (!data) {
+    printf("%-16s no reference %s\n", name, path.c_str());
+    return false;
+  }
+  ref.assign(data, data + size_t(w) * h * 3);
+  stbi_image_free(data);
+  return true;
+}
+
+bool update(char const *name, std::map<std::string, tolerance> &tols) {
+  still st;
+  if (!st.load(name, REF_SEED)) return false;
+  auto img = average(st, REF_SPP);
+  auto path = std::string(REF_DIR) + name + ".hdr";
+  if (!stbi_write_hdr(path.c_str(), st.w_, st.h_, 3, img.data())) {
+    std::cerr << "ERROR: Could not write '" << path << "'.\n";
+    return false;
+  }
+  // what this tree gets at the check spp, against the reference as read
+  int w, h;
+  std::vector<float> ref;
+  if (!read_reference(name, w, h, ref)) return false;
+  still check;
+  if (!check.load(name, CHECK_SEED)) return false;
+  auto err = compare(average(check, CHECK_SPP), ref, w, h);
+  tols[name] = tolerance{CHECK_SPP, std::max(1e-5, MARGIN * err.relmse)};
+  printf("%-16s reference %dx%d at %d spp, relMSE %.5f at %d spp\n", name,
+         st.w_, st.h_, REF_SPP, err.relmse, CHECK_SPP);
+  fflush(stdout);
+  return true;
+}
+// false if over tolerance or missing
+bool check(char const *name, tolerance const &tol) {
+  int rw, rh;
+  std::vector<float> ref;
+  if (!read_reference(name, rw, rh, ref)) return false;
+  still st;
+  if (!st.load(name, CHECK_SEED)) return false;
+  if (st.w_ != rw || st.h_ != rh) {
+    printf("%-16s FAIL, reference is %dx%d, render %dx%d\n", name, rw, rh,
+           st.w_, st.h_);
+    return false;
+  }
+
+  // the time is of the passes only, not of measuring
+  std::vector<float> sum, sum2;
+  double ms = 0, to_error = -1;
+  error_metrics err{};
+  for (int s = 1; s <= tol.spp; s++) {
+    auto start = std::chrono::steady_clock::now();
+    st.pass(sum, &sum2);
+    ms += std::chrono::duration<double, std::milli>(
+              std::chrono::steady_clock::now() - start)
+              .count();
+    if ((s & (s - 1)) != 0 && s != tol.spp) continue;
+    std::vector<float> img(sum);
+    for (auto &v : img) v /= s;
+    err = compare(img, ref, rw, rh);
+    if (to_error < 0 && err.relmse <= tol.max_relmse) to_error = ms;
+    printf("%-16s %4d spp  rmse %.5f  relMSE %.5f  flip %.5f  %8.1f ms\n",
+           name, s, err.rmse, err.relmse, err.flip, ms);
+  }
+  double z = mean_z(sum, sum2, tol.spp, ref);
+  bool ok = err.relmse <= tol.max_relmse && z <= MAX_Z;
+  printf("%-16s %s, relMSE %.5f of %.5f, mean off by %.1f of %.0f se, "
+         "to error ",
+         name, ok ? "ok" : "FAIL", err.relmse, tol.max_relmse, z, MAX_Z);
+  if (to_error < 0)
+    printf("never\n");
+  else
+    printf("%.1f ms\n", to_error);
+  fflush(stdout);
+  return ok;
+}
+
+int main(int argc, char *argv[]) {
+  bool updating = false;
+  char const *only = nullptr;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--update") == 0)
+      updating = true;
+    else if (strcmp(argv[i], "--only") == 0 && i + 1 < argc)
+      only = argv[++i];
+    else {
+      std::cerr << "usage: regress [--update] [--only <scene>]\n";
+      return 1;
+    }
+  }
+  auto tols = read_tolerances();
+  int failed = 0, run = 0;
+  for (auto const &scene_name : checked_scenes()) {
+    auto name = scene_name.c_str();
+    if (only && strcmp(name, only) != 0) continue;
+    run++;
+    if (updating) {
+      if (!update(name, tols)) return 1;
+      continue;
+    }
+    auto it = tols.find(name);
+    if (it == tols.end()) {
+      printf("%-16s FAIL, no tolerance in %s\n", name, TOLERANCES);
+      failed++;
+    } else if (!check(name, it->second)) {
+      failed++;
+    }
+  }
+  if (updating) return write_tolerances(tols) ? 0 : 1;
+  printf("%d of %d scenes within tolerance\n", run - failed, run);
+  return failed ? 1 : 0;
+}
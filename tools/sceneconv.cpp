@@ -0,0 +1,61 @@
+/**
+ * sceneconv: write a binary scene for slowpt to map.
+ *
+ *   sceneconv <in.scene> <out.sptb>
+ *   sceneconv <in.obj> <out.sptb>
+ *
+ * An OBJ gets a scene around it: grey lambertian as the default
+ * material, a sky background and a camera looking at its bounds.
+ */
+#include "bvh.h"
+
+#include <cfloat>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include "objloader.h"
+#include "sceneparser.h"
+
+// a scene of just the OBJ, it is named as it is, next to the text
+std::string obj_scene(char const *path) {
+  obj_data data;
+  if (!load_obj(path, data)) return "";
+  float lo[3] = {FLT_MAX, FLT_MAX, FLT_MAX};
+  float hi[3] = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+  for (size_t i = 0; i < data.positions.size(); i++) {
+    lo[i % 3] = std::min(lo[i % 3], data.positions[i]);
+    hi[i % 3] = std::max(hi[i % 3], data.positions[i]);
+  }
+  point3d center{(lo[0] + hi[0]) / 2.0, (lo[1] + hi[1]) / 2.0,
+                 (lo[2] + hi[2]) / 2.0};
+  auto radius = (point3d{hi[0], hi[1], hi[2]} - center).norm();
+  // the bounding sphere fills the 40 degree view
+  auto from = center + 3.0 * radius * unit_vector(vec3d{0.4, 0.3, 1});
+  auto slash = strrchr(path, '/');
+  char buf[512];
+  snprintf(buf, sizeof(buf),
+           "render background 0.70 0.80 1.00\n"
+           "camera from %g %g %g at %g %g %g vfov 40 focus %g\n"
+           "material default lambertian 0.73 0.73 0.73\n"
+           "mesh default %s\n",
+           from.x(), from.y(), from.z(), center.x(), center.y(), center.z(),
+           3.0 * radius, slash ? slash + 1 : path);
+  return buf;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 3) {
+    std::cerr << "usage: sceneconv <in.scene|in.obj> <out.sptb>\n";
+    return 1;
+  }
+  char const *in = argv[1], *out = argv[2];
+  auto len = strlen(in);
+  if (len > 4 && strcmp(in + len - 4, ".obj") == 0) {
+    auto text = obj_scene(in);
+    if (text.empty()) return 1;
+    return scene_parser::convert_text(text.c_str(), in, out) ? 0 : 1;
+  }
+  return scene_parser::convert(in, out) ? 0 : 1;
+}